@@ -0,0 +1,370 @@
+#include <dirent.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "line_index.h"
+#include "main.h"
+#include "save.h"
+
+#define MEGABYTE (1024.0 * 1024.0)
+#define GIGABYTE (1024.0 * 1024.0 * 1024.0)
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t heap_in_use(void) {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+static char *make_temp_name(const char *stem) {
+  const char *tmpdir = getenv("TMPDIR");
+  if (tmpdir == NULL) {
+    tmpdir = "/tmp";
+  }
+  size_t name_length = strlen(tmpdir) + strlen(stem) + 16;
+  char *name = malloc(name_length);
+  if (name == NULL) {
+    return NULL;
+  }
+  snprintf(name, name_length, "%s/%s.XXXXXX", tmpdir, stem);
+  return name;
+}
+
+static char *generate_file(size_t size) {
+  char *name = make_temp_name("editor-bench");
+  if (name == NULL) {
+    return NULL;
+  }
+
+  int fd = mkstemp(name);
+  if (fd == -1) {
+    free(name);
+    return NULL;
+  }
+  FILE *f = fdopen(fd, "w");
+  if (f == NULL) {
+    close(fd);
+    unlink(name);
+    free(name);
+    return NULL;
+  }
+
+  static const char alphabet[] =
+      "abcdefghijklmnopqrstuvwxyz    0123456789(){};=+-*/\"'";
+  char line[256];
+  unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+  size_t written = 0;
+  while (written < size) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    size_t length = (seed >> 33) % 160;
+    for (size_t i = 0; i < length; i++) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      line[i] = alphabet[(seed >> 33) % (sizeof(alphabet) - 1)];
+    }
+    line[length++] = '\n';
+    fwrite(line, 1, length, f);
+    written += length;
+  }
+  fclose(f);
+  return name;
+}
+
+static char *make_cache_directory(void) {
+  char *name = make_temp_name("editor-bench-cache");
+  if (name == NULL) {
+    return NULL;
+  }
+  if (mkdtemp(name) == NULL) {
+    free(name);
+    return NULL;
+  }
+  return name;
+}
+
+static void remove_cache_directory(const char *cache) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/editor/lines", cache);
+  DIR *dir = opendir(path);
+  if (dir != NULL) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.') {
+        char file[8192];
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+      }
+    }
+    closedir(dir);
+  }
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/editor", cache);
+  rmdir(path);
+  rmdir(cache);
+}
+
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} OwnedLine;
+
+static size_t load_with_getline(const char *name, size_t *heap) {
+  FILE *f = fopen(name, "r");
+  if (f == NULL) {
+    return 0;
+  }
+
+  OwnedLine *lines = NULL;
+  size_t length = 0;
+  char *line_buf = NULL;
+  size_t line_buf_size = 0;
+  ssize_t line_length;
+
+  while ((line_length = getline(&line_buf, &line_buf_size, f)) != -1) {
+    if (line_length > 0 && line_buf[line_length - 1] == '\n') {
+      line_buf[--line_length] = '\0';
+    }
+    if (line_length > 0 && line_buf[line_length - 1] == '\r') {
+      line_buf[--line_length] = '\0';
+    }
+    OwnedLine *new_lines = realloc(lines, (length + 1) * sizeof(OwnedLine));
+    if (new_lines == NULL) {
+      break;
+    }
+    lines = new_lines;
+    lines[length].data = strdup(line_buf);
+    lines[length].length = line_length;
+    lines[length].capacity = line_length + 1;
+    length++;
+  }
+
+  free(line_buf);
+  fclose(f);
+  *heap = heap_in_use();
+  for (size_t i = 0; i < length; i++) {
+    free(lines[i].data);
+  }
+  free(lines);
+  return length;
+}
+
+static size_t load_with_buffer(const char *name, size_t *heap) {
+  File file = {.name = (char *)name};
+  Buffer *buffer = create_buffer_from_file(file, 0);
+  if (buffer == NULL) {
+    return 0;
+  }
+  wait_for_buffer_load(buffer);
+  size_t length = buffer_line_count(buffer);
+  *heap = heap_in_use();
+  free_buffer(buffer);
+  return length;
+}
+
+static void report(const char *label, size_t bytes, size_t lines,
+                   double seconds) {
+  printf("  %-28s %8.3f s %8.2f GB/s %12zu lines\n", label, seconds,
+         bytes / GIGABYTE / seconds, lines);
+}
+
+static void report_memory(const char *label, size_t heap, size_t lines) {
+  printf("  %-28s %8.2f bytes/line\n", label,
+         lines > 0 ? (double)heap / lines : 0.0);
+}
+
+static void bench_load(const char *name, size_t size) {
+  printf("load (%.0f MB)\n", size / MEGABYTE);
+
+  size_t baseline = heap_in_use();
+  size_t getline_heap = 0;
+  double start = now_seconds();
+  size_t getline_lines = load_with_getline(name, &getline_heap);
+  report("getline + strdup", size, getline_lines, now_seconds() - start);
+
+  size_t buffer_heap = 0;
+  start = now_seconds();
+  size_t buffer_lines = load_with_buffer(name, &buffer_heap);
+  report("create_buffer_from_file", size, buffer_lines, now_seconds() - start);
+
+  File file = {.name = (char *)name};
+  start = now_seconds();
+  Buffer *buffer = create_buffer_from_file(file, 0);
+  if (buffer != NULL) {
+    wait_for_buffer_load(buffer);
+    report("reopen (cached index)", size, buffer_line_count(buffer),
+           now_seconds() - start);
+  }
+  if (buffer != NULL && buffer->map != NULL) {
+    size_t *ends = NULL;
+    size_t n_lines = 0;
+    start = now_seconds();
+    build_line_index(buffer->map, buffer->map_length, &ends, &n_lines);
+    report("build_line_index (warm)", buffer->map_length, n_lines,
+           now_seconds() - start);
+    free(ends);
+  }
+  free_buffer(buffer);
+
+  printf("memory\n");
+  report_memory("getline + strdup", getline_heap - baseline, getline_lines);
+  report_memory("create_buffer_from_file", buffer_heap - baseline,
+                buffer_lines);
+
+  if (getline_lines != buffer_lines) {
+    printf("  line count mismatch: %zu vs %zu\n", getline_lines,
+           buffer_lines);
+  }
+}
+
+static void save_with_stdio(Buffer *buffer, const char *name) {
+  FILE *f = fopen(name, "w");
+  if (f == NULL) {
+    return;
+  }
+  LineIterator iterator;
+  buffer_iterate(buffer, 0, &iterator);
+  Line line;
+  while (buffer_next_line(&iterator, &line)) {
+    if (line.length > 0) {
+      fwrite(line.data, 1, line.length, f);
+    }
+    fputc('\n', f);
+  }
+  fclose(f);
+}
+
+static void bench_save(const char *name, size_t size) {
+  printf("save (%.0f MB)\n", size / MEGABYTE);
+
+  char *output = make_temp_name("editor-bench-save");
+  if (output == NULL) {
+    return;
+  }
+  int fd = mkstemp(output);
+  if (fd == -1) {
+    free(output);
+    return;
+  }
+  close(fd);
+
+  File file = {.name = (char *)name};
+  Buffer *buffer = create_buffer_from_file(file, 0);
+  if (buffer == NULL) {
+    unlink(output);
+    free(output);
+    return;
+  }
+  wait_for_buffer_load(buffer);
+  size_t lines = buffer_line_count(buffer);
+
+  double start = now_seconds();
+  save_with_stdio(buffer, output);
+  report("fwrite + fputc per line", size, lines, now_seconds() - start);
+
+  buffer->file.name = output;
+  buffer->disk_known = false;
+  start = now_seconds();
+  save_buffer(buffer);
+  report("save_buffer (UI stall)", size, lines, now_seconds() - start);
+  wait_for_buffer_save(buffer);
+  report("save_buffer (fsync)", size, lines, now_seconds() - start);
+
+  Line text = {"x", 1};
+  for (size_t row = 0; row < lines; row += 1000) {
+    buffer_insert(buffer, row, 0, &text, 1);
+  }
+  start = now_seconds();
+  save_buffer(buffer);
+  report("save_buffer (edited, stall)", size, lines, now_seconds() - start);
+  wait_for_buffer_save(buffer);
+  report("save_buffer (edited, fsync)", size, lines, now_seconds() - start);
+  free_buffer(buffer);
+
+  file.name = output;
+  buffer = create_buffer_from_file(file, 0);
+  if (buffer != NULL) {
+    wait_for_buffer_load(buffer);
+    lines = buffer_line_count(buffer);
+    buffer_insert(buffer, lines - 1, 0, &text, 1);
+    start = now_seconds();
+    save_buffer(buffer);
+    wait_for_buffer_save(buffer);
+    report("save_buffer (tail edit)", size, lines, now_seconds() - start);
+    free_buffer(buffer);
+  }
+  unlink(output);
+  free(output);
+}
+
+static void print_help(const char *program_name) {
+  printf("Usage: %s [OPTIONS]\n", program_name);
+  printf("\n");
+  printf("Options:\n");
+  printf("  --size MB    Size of the generated input file (default 1024)\n");
+  printf("  --file FILE  Use FILE instead of generating one\n");
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  size_t size = 1024 * 1024 * 1024;
+  const char *input = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      size = strtoull(argv[i + 1], NULL, 10) * 1024 * 1024;
+      i++;
+    } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+      input = argv[i + 1];
+      i++;
+    } else {
+      print_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  char *cache = make_cache_directory();
+  if (cache != NULL) {
+    setenv("XDG_CACHE_HOME", cache, 1);
+  }
+
+  char *generated = NULL;
+  if (input == NULL) {
+    generated = generate_file(size);
+    if (generated == NULL) {
+      fprintf(stderr, "could not create input file\n");
+      return EXIT_FAILURE;
+    }
+    input = generated;
+  } else {
+    FILE *f = fopen(input, "r");
+    if (f == NULL) {
+      fprintf(stderr, "could not open %s\n", input);
+      return EXIT_FAILURE;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+  }
+
+  bench_load(input, size);
+  bench_save(input, size);
+
+  if (generated != NULL) {
+    unlink(generated);
+    free(generated);
+  }
+  if (cache != NULL) {
+    remove_cache_directory(cache);
+    free(cache);
+  }
+  return EXIT_SUCCESS;
+}
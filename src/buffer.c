@@ -0,0 +1,978 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "draw.h"
+#include "hash.h"
+#include "index_cache.h"
+#include "journal.h"
+#include "line_index.h"
+#include "piece_table.h"
+#include "save.h"
+#include "undo.h"
+
+#define BACKGROUND_LOAD_THRESHOLD (8 * 1024 * 1024)
+#define FIRST_SEGMENT_SIZE (256 * 1024)
+#define LOAD_SEGMENT_SIZE (32 * 1024 * 1024)
+#define BINARY_PROBE_SIZE 8000
+#define RELEASE_INTERVAL 256
+
+struct BufferLoad {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  size_t start;
+  IndexCache cache;
+  size_t *first_ends;
+  size_t first_length;
+  size_t *pending;
+  size_t pending_length;
+  size_t pending_capacity;
+  bool hashing;
+  ContentHash hash;
+  HashMarks *marks;
+  bool finished;
+  atomic_bool cancelled;
+  atomic_size_t indexed;
+};
+
+static bool read_whole_file(int fd, char **data, size_t *length) {
+  size_t capacity = 65536;
+  size_t size = 0;
+  char *buf = malloc(capacity);
+  if (buf == NULL) {
+    return false;
+  }
+
+  ssize_t bytes_read;
+  while ((bytes_read = read(fd, buf + size, capacity - size)) > 0) {
+    size += bytes_read;
+    if (size == capacity) {
+      char *new_buf = realloc(buf, capacity * 2);
+      if (new_buf == NULL) {
+        free(buf);
+        return false;
+      }
+      buf = new_buf;
+      capacity *= 2;
+    }
+  }
+
+  if (bytes_read < 0) {
+    free(buf);
+    return false;
+  }
+
+  *data = buf;
+  *length = size;
+  return true;
+}
+
+static void map_file(Buffer *buffer, int fd, size_t view_threshold) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    if (st.st_size == 0) {
+      return;
+    }
+    if (!buffer->paged && view_threshold > 0 &&
+        (size_t)st.st_size >= view_threshold) {
+      buffer->read_only = true;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ,
+                     buffer->read_only ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      buffer->map = map;
+      buffer->map_length = st.st_size;
+      buffer->mapped = true;
+      return;
+    }
+  }
+
+  if (!read_whole_file(fd, &buffer->map, &buffer->map_length)) {
+    buffer->map = NULL;
+    buffer->map_length = 0;
+  }
+}
+
+static size_t segment_end(const char *data, size_t length, size_t start,
+                          size_t size) {
+  if (length - start <= size) {
+    return length;
+  }
+  const char *newline = memchr(data + start + size, '\n', length - start - size);
+  return newline != NULL ? (size_t)(newline - data) + 1 : length;
+}
+
+static bool append_pending(BufferLoad *load, size_t base, const size_t *ends,
+                           size_t count) {
+  if (load->pending_length + count > load->pending_capacity) {
+    size_t new_capacity =
+        load->pending_capacity == 0 ? 4096 : load->pending_capacity * 2;
+    while (new_capacity < load->pending_length + count) {
+      new_capacity *= 2;
+    }
+    size_t *new_pending =
+        realloc(load->pending, new_capacity * sizeof(size_t));
+    if (new_pending == NULL) {
+      return false;
+    }
+    load->pending = new_pending;
+    load->pending_capacity = new_capacity;
+  }
+  for (size_t i = 0; i < count; i++) {
+    load->pending[load->pending_length + i] = base + ends[i];
+  }
+  load->pending_length += count;
+  return true;
+}
+
+static void release_pages(Buffer *buffer, size_t start, size_t end) {
+  if (!buffer->mapped || !buffer->table.original_sparse) {
+    return;
+  }
+  if (end > buffer->pinned_from) {
+    end = buffer->pinned_from;
+  }
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t first = start / page * page;
+  if (first < end) {
+    madvise(buffer->map + first, end - first, MADV_DONTNEED);
+  }
+}
+
+void release_buffer_pages(Buffer *buffer) {
+  release_pages(buffer, 0, buffer->map_length);
+  buffer->unreleased_edits = 0;
+}
+
+static void count_edit(Buffer *buffer) {
+  if (++buffer->unreleased_edits >= RELEASE_INTERVAL) {
+    release_buffer_pages(buffer);
+  }
+}
+
+bool pin_buffer_pages(Buffer *buffer, size_t offset) {
+  if (!buffer->mapped || offset >= buffer->pinned_from ||
+      offset >= buffer->map_length) {
+    return true;
+  }
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t first = offset / page * page;
+  size_t last = buffer->pinned_from < buffer->map_length ? buffer->pinned_from
+                                                          : buffer->map_length;
+  if (mprotect(buffer->map + first, last - first, PROT_READ | PROT_WRITE) ==
+      -1) {
+    return false;
+  }
+  for (size_t i = first; i < last; i += page) {
+    volatile char *p = buffer->map + i;
+    *p = *p;
+  }
+  mprotect(buffer->map + first, last - first, PROT_READ);
+  buffer->pinned_from = first;
+  return true;
+}
+
+void mark_buffer_modified(Buffer *buffer, size_t offset) {
+  if (offset < buffer->modified_from) {
+    buffer->modified_from = offset;
+  }
+}
+
+bool is_buffer_modified(Buffer *buffer) {
+  return buffer->generation != buffer->saved_generation;
+}
+
+bool add_buffer_listener(Buffer *buffer, BufferListener listener,
+                         void *data) {
+  if (buffer->n_watches == buffer->watches_capacity) {
+    size_t capacity =
+        buffer->watches_capacity == 0 ? 4 : buffer->watches_capacity * 2;
+    BufferWatch *watches =
+        realloc(buffer->watches, capacity * sizeof(BufferWatch));
+    if (watches == NULL) {
+      return false;
+    }
+    buffer->watches = watches;
+    buffer->watches_capacity = capacity;
+  }
+  buffer->watches[buffer->n_watches++] = (BufferWatch){listener, data};
+  return true;
+}
+
+void remove_buffer_listener(Buffer *buffer, BufferListener listener,
+                            void *data) {
+  for (size_t i = 0; i < buffer->n_watches; i++) {
+    if (buffer->watches[i].listener == listener &&
+        buffer->watches[i].data == data) {
+      buffer->watches[i] = buffer->watches[--buffer->n_watches];
+      return;
+    }
+  }
+}
+
+void publish_buffer_change(Buffer *buffer, size_t row, size_t removed,
+                           size_t inserted) {
+  BufferChange change = {row, removed, inserted, ++buffer->version};
+  for (size_t i = 0; i < buffer->n_watches; i++) {
+    buffer->watches[i].listener(buffer->watches[i].data, &change);
+  }
+}
+
+static void mark_modified(Buffer *buffer, size_t row, size_t col) {
+  buffer->generation = ++buffer->last_generation;
+  size_t length = piece_table_line_length(&buffer->table, row);
+  mark_buffer_modified(buffer, piece_table_row_offset(&buffer->table, row) +
+                                   (col < length ? col : length));
+}
+
+static void stamp_from_stat(const struct stat *st, FileStamp *stamp) {
+  stamp->device = st->st_dev;
+  stamp->inode = st->st_ino;
+  stamp->size = st->st_size;
+  stamp->mtime_sec = st->st_mtim.tv_sec;
+  stamp->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+bool stamp_file(int fd, FileStamp *stamp) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  stamp_from_stat(&st, stamp);
+  return true;
+}
+
+bool stamp_path(const char *path, FileStamp *stamp) {
+  struct stat st;
+  if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  stamp_from_stat(&st, stamp);
+  return true;
+}
+
+bool same_stamp(const FileStamp *a, const FileStamp *b) {
+  return a->device == b->device && a->inode == b->inode &&
+         a->size == b->size && a->mtime_sec == b->mtime_sec &&
+         a->mtime_nsec == b->mtime_nsec;
+}
+
+static int open_edit_log(const char *name) {
+  const char *tmpdir = getenv("TMPDIR");
+  size_t length = strlen(name) + (tmpdir != NULL ? strlen(tmpdir) : 4) + 32;
+  char *path = malloc(length);
+  if (path == NULL) {
+    return -1;
+  }
+
+  snprintf(path, length, "%s.log.XXXXXX", name);
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    snprintf(path, length, "%s/editor-log.XXXXXX",
+             tmpdir != NULL ? tmpdir : "/tmp");
+    fd = mkstemp(path);
+  }
+  if (fd != -1) {
+    unlink(path);
+  }
+  free(path);
+  return fd;
+}
+
+static void *load_in_background(void *arg) {
+  Buffer *buffer = arg;
+  BufferLoad *load = buffer->load;
+  const char *data = buffer->map;
+  size_t length = buffer->map_length;
+  size_t start = load->start;
+
+  if (begin_index_cache(&load->cache)) {
+    write_index_cache(&load->cache, load->cache.ends, load->cache.n_lines, 0);
+    write_index_cache(&load->cache, load->first_ends, load->first_length, 0);
+  }
+
+  while (start < length && !atomic_load(&load->cancelled)) {
+    size_t end = segment_end(data, length, start, LOAD_SEGMENT_SIZE);
+    size_t *ends = NULL;
+    size_t count = 0;
+    if (!build_line_index(data + start, end - start, &ends, &count)) {
+      break;
+    }
+
+    write_index_cache(&load->cache, ends, count, start);
+    if (load->hashing) {
+      update_marked_hash(&load->hash, load->marks, data + start,
+                         end - start);
+    }
+
+    pthread_mutex_lock(&load->mutex);
+    bool appended = append_pending(load, start, ends, count);
+    if (appended) {
+      atomic_store(&load->indexed, end);
+    }
+    pthread_cond_broadcast(&load->cond);
+    pthread_mutex_unlock(&load->mutex);
+    free(ends);
+
+    if (!appended) {
+      break;
+    }
+    start = end;
+  }
+  if (start >= length) {
+    if (load->hashing) {
+      load->cache.hashed = true;
+      load->cache.content_hash = finish_content_hash(&load->hash);
+    }
+    commit_index_cache(&load->cache, data);
+  }
+
+  pthread_mutex_lock(&load->mutex);
+  load->finished = true;
+  pthread_cond_broadcast(&load->cond);
+  pthread_mutex_unlock(&load->mutex);
+  return NULL;
+}
+
+static void free_background_load(BufferLoad *load) {
+  pthread_mutex_destroy(&load->mutex);
+  pthread_cond_destroy(&load->cond);
+  close_index_cache(&load->cache);
+  free_hash_marks(load->marks);
+  free(load->first_ends);
+  free(load->pending);
+  free(load);
+}
+
+static bool start_background_load(Buffer *buffer, size_t start,
+                                  IndexCache *cache, size_t *first_ends,
+                                  size_t first_length,
+                                  const ContentHash *hash,
+                                  HashMarks *marks) {
+  BufferLoad *load = malloc(sizeof(BufferLoad));
+  if (load == NULL) {
+    close_index_cache(cache);
+    free_hash_marks(marks);
+    free(first_ends);
+    return false;
+  }
+  pthread_mutex_init(&load->mutex, NULL);
+  pthread_cond_init(&load->cond, NULL);
+  load->start = start;
+  load->cache = *cache;
+  load->first_ends = first_ends;
+  load->first_length = first_length;
+  load->pending = NULL;
+  load->pending_length = 0;
+  load->pending_capacity = 0;
+  load->hashing = hash != NULL;
+  if (hash != NULL) {
+    load->hash = *hash;
+  }
+  load->marks = marks;
+  load->finished = false;
+  atomic_init(&load->cancelled, false);
+  atomic_init(&load->indexed, start);
+  buffer->load = load;
+
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int error = pthread_create(&load->thread, NULL, load_in_background, buffer);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (error != 0) {
+    buffer->load = NULL;
+    free_background_load(load);
+    return false;
+  }
+  return true;
+}
+
+static void finish_background_load(Buffer *buffer) {
+  BufferLoad *load = buffer->load;
+  pthread_join(load->thread, NULL);
+  if (atomic_load(&load->indexed) < buffer->map_length) {
+    buffer->partial = true;
+  } else if (load->cache.hashed) {
+    buffer->content_hashed = true;
+    buffer->content_hash = load->cache.content_hash;
+    buffer->hash_marks = load->marks;
+    load->marks = NULL;
+  }
+  buffer->load = NULL;
+  free_background_load(load);
+}
+
+bool poll_buffer_load(Buffer *buffer) {
+  BufferLoad *load = buffer->load;
+  if (load == NULL) {
+    return false;
+  }
+
+  pthread_mutex_lock(&load->mutex);
+  size_t *ends = load->pending;
+  size_t count = load->pending_length;
+  bool finished = load->finished;
+  load->pending = NULL;
+  load->pending_length = 0;
+  load->pending_capacity = 0;
+  pthread_mutex_unlock(&load->mutex);
+
+  if (count > 0) {
+    size_t start = buffer->table.original_limit;
+    size_t n_lines = piece_table_line_count(&buffer->table);
+    if (piece_table_append_original(&buffer->table, ends, count)) {
+      release_pages(buffer, start, buffer->table.original_limit);
+      size_t row = n_lines > 0 ? n_lines - 1 : 0;
+      publish_buffer_change(buffer, row, n_lines - row,
+                            piece_table_line_count(&buffer->table) - row);
+    } else {
+      atomic_store(&load->cancelled, true);
+      buffer->partial = true;
+    }
+  }
+  free(ends);
+
+  if (finished) {
+    finish_background_load(buffer);
+  }
+  return count > 0 || finished;
+}
+
+void wait_for_buffer_lines(Buffer *buffer, size_t n_lines) {
+  while (buffer->load != NULL &&
+         piece_table_line_count(&buffer->table) < n_lines) {
+    BufferLoad *load = buffer->load;
+    pthread_mutex_lock(&load->mutex);
+    while (!load->finished && load->pending_length == 0) {
+      pthread_cond_wait(&load->cond, &load->mutex);
+    }
+    pthread_mutex_unlock(&load->mutex);
+    poll_buffer_load(buffer);
+  }
+}
+
+void wait_for_buffer_load(Buffer *buffer) {
+  wait_for_buffer_lines(buffer, SIZE_MAX);
+}
+
+bool cancel_buffer_load(Buffer *buffer) {
+  BufferLoad *load = buffer->load;
+  if (load == NULL) {
+    return false;
+  }
+  atomic_store(&load->cancelled, true);
+  return true;
+}
+
+bool is_buffer_loading(Buffer *buffer) { return buffer->load != NULL; }
+
+double buffer_load_progress(Buffer *buffer) {
+  if (buffer->load == NULL || buffer->map_length == 0) {
+    return 1.0;
+  }
+  return (double)atomic_load(&buffer->load->indexed) / buffer->map_length;
+}
+
+static bool looks_binary(const char *data, size_t length) {
+  if (length > BINARY_PROBE_SIZE) {
+    length = BINARY_PROBE_SIZE;
+  }
+  return length > 0 && memchr(data, '\0', length) != NULL;
+}
+
+Buffer *create_buffer_from_file(File file, size_t view_threshold) {
+  Buffer *buffer = malloc(sizeof(Buffer));
+  if (buffer == NULL) {
+    return NULL;
+  }
+  buffer->file = file;
+  buffer->map = NULL;
+  buffer->map_length = 0;
+  buffer->mapped = false;
+  buffer->map_fd = -1;
+  buffer->pinned_from = SIZE_MAX;
+  buffer->disk_known = false;
+  buffer->disk_is_original = false;
+  buffer->modified_from = SIZE_MAX;
+  buffer->generation = 0;
+  buffer->saved_generation = 0;
+  buffer->last_generation = 0;
+  buffer->version = 0;
+  buffer->watches = NULL;
+  buffer->n_watches = 0;
+  buffer->watches_capacity = 0;
+  buffer->content_hashed = false;
+  buffer->hash_marks = NULL;
+  buffer->load = NULL;
+  buffer->save = NULL;
+  buffer->journal = NULL;
+  buffer->syntax = NULL;
+  init_undo_tree(&buffer->undo);
+  buffer->undo_map = NULL;
+  buffer->undo_map_length = 0;
+  buffer->undo_loaded = false;
+  buffer->partial = false;
+  buffer->read_only = file.read_only;
+  buffer->paged = file.paged && !file.read_only;
+  buffer->unreleased_edits = 0;
+  buffer->message[0] = '\0';
+
+  IndexCache cache;
+  int fd = open(file.name, O_RDONLY);
+  if (fd != -1) {
+    map_file(buffer, fd, view_threshold);
+  }
+  open_index_cache(&cache, fd, buffer->map, buffer->map_length);
+  if (fd != -1) {
+    buffer->disk_known = stamp_file(fd, &buffer->disk_stamp);
+    buffer->map_stamp = buffer->disk_stamp;
+    buffer->disk_is_original = buffer->disk_known;
+    if (buffer->mapped && buffer->disk_known) {
+      buffer->map_fd = fd;
+    } else {
+      close(fd);
+    }
+  }
+  if (!buffer->paged && looks_binary(buffer->map, buffer->map_length)) {
+    buffer->read_only = true;
+  }
+
+  size_t start = cache.indexed;
+  size_t first_end = buffer->map_length;
+  if (buffer->map_length - start >= BACKGROUND_LOAD_THRESHOLD) {
+    first_end = segment_end(buffer->map, buffer->map_length, start,
+                            FIRST_SEGMENT_SIZE);
+  }
+
+  size_t *ends = NULL;
+  size_t length = 0;
+  if ((first_end > start || cache.n_lines == 0) &&
+      !build_line_index(buffer->map + start, first_end - start, &ends,
+                        &length)) {
+    close_index_cache(&cache);
+    init_piece_table(&buffer->table, NULL, NULL, 0, false);
+    free_buffer(buffer);
+    return NULL;
+  }
+  for (size_t i = 0; i < length; i++) {
+    ends[i] += start;
+  }
+  buffer->content_hashed = cache.hashed;
+  buffer->content_hash = cache.content_hash;
+  ContentHash hash;
+  HashMarks *marks = NULL;
+  bool hashing = start == 0 && !buffer->read_only;
+  if (hashing) {
+    init_content_hash(&hash);
+    marks = create_hash_marks();
+    update_marked_hash(&hash, marks, buffer->map, first_end);
+  }
+  bool indexed =
+      init_piece_table(&buffer->table, buffer->map, cache.ends, cache.n_lines,
+                       buffer->read_only || buffer->paged) &&
+      piece_table_append_original(&buffer->table, ends, length);
+  if (!indexed) {
+    close_index_cache(&cache);
+    free_hash_marks(marks);
+    free(ends);
+    free_buffer(buffer);
+    return NULL;
+  }
+  release_pages(buffer, start, first_end);
+
+  if (buffer->paged) {
+    int log_fd = open_edit_log(file.name);
+    if (log_fd == -1) {
+      close_index_cache(&cache);
+      free_hash_marks(marks);
+      free(ends);
+      free_buffer(buffer);
+      return NULL;
+    }
+    piece_table_attach_log(&buffer->table, log_fd);
+  }
+
+  if (first_end < buffer->map_length) {
+    if (!start_background_load(buffer, first_end, &cache, ends, length,
+                               hashing ? &hash : NULL, marks)) {
+      free_buffer(buffer);
+      return NULL;
+    }
+  } else {
+    close_index_cache(&cache);
+    free(ends);
+    if (hashing) {
+      buffer->content_hashed = true;
+      buffer->content_hash = finish_content_hash(&hash);
+      buffer->hash_marks = marks;
+    }
+  }
+  open_buffer_journal(buffer);
+
+  return buffer;
+}
+
+void free_buffer(Buffer *buffer) {
+  if (buffer == NULL) {
+    return;
+  }
+  if (buffer->load != NULL) {
+    atomic_store(&buffer->load->cancelled, true);
+    finish_background_load(buffer);
+  }
+  wait_for_buffer_save(buffer);
+  close_buffer_journal(buffer);
+  free_undo_tree(&buffer->undo);
+  free_piece_table(&buffer->table);
+  if (buffer->mapped) {
+    munmap(buffer->map, buffer->map_length);
+  } else {
+    free(buffer->map);
+  }
+  if (buffer->map_fd != -1) {
+    close(buffer->map_fd);
+  }
+  if (buffer->undo_map != NULL) {
+    munmap(buffer->undo_map, buffer->undo_map_length);
+  }
+  free_syntax_cache(buffer);
+  free_hash_marks(buffer->hash_marks);
+  free(buffer->watches);
+  free(buffer);
+}
+
+size_t buffer_line_count(Buffer *buffer) {
+  return piece_table_line_count(&buffer->table);
+}
+
+Line buffer_get_line(Buffer *buffer, size_t row) {
+  return piece_table_get_line(&buffer->table, row);
+}
+
+void buffer_iterate(Buffer *buffer, size_t row, LineIterator *iterator) {
+  piece_table_iterate(&buffer->table, row, iterator);
+}
+
+bool buffer_next_line(LineIterator *iterator, Line *line) {
+  return piece_table_next_line(iterator, line);
+}
+
+Line buffer_get_line_range(Buffer *buffer, size_t row, size_t start,
+                           size_t length) {
+  return piece_table_get_line_range(&buffer->table, row, start, length);
+}
+
+size_t buffer_line_length(Buffer *buffer, size_t row) {
+  return piece_table_line_length(&buffer->table, row);
+}
+
+size_t buffer_byte_count(Buffer *buffer) {
+  return piece_table_byte_count(&buffer->table);
+}
+
+size_t buffer_row_offset(Buffer *buffer, size_t row) {
+  return piece_table_row_offset(&buffer->table, row);
+}
+
+size_t buffer_offset_row(Buffer *buffer, size_t offset, size_t *column) {
+  return piece_table_offset_row(&buffer->table, offset, column);
+}
+
+bool buffer_next_line_range(LineIterator *iterator, size_t start,
+                            size_t length, Line *line) {
+  return piece_table_next_line_range(iterator, start, length, line);
+}
+
+static const Line empty_line = {NULL, 0};
+
+static bool store_line(PieceTable *table, Line prefix, Line middle,
+                       Line suffix, Line *out) {
+  size_t length = prefix.length + middle.length + suffix.length;
+  if (middle.length == 0 && suffix.length == 0) {
+    *out = prefix;
+    return true;
+  }
+  if (prefix.length == 0 && middle.length == 0) {
+    *out = suffix;
+    return true;
+  }
+
+  char *text = NULL;
+  if (prefix.length > 0) {
+    text = piece_table_extend_text(table, prefix.data + prefix.length,
+                                   middle.length + suffix.length);
+  }
+  if (text != NULL) {
+    *out = (Line){prefix.data, length};
+  } else {
+    text = piece_table_reserve_text(table, length);
+    if (text == NULL) {
+      return false;
+    }
+    *out = (Line){text, length};
+    if (prefix.length > 0) {
+      memcpy(text, prefix.data, prefix.length);
+    }
+    text += prefix.length;
+  }
+
+  if (middle.length > 0) {
+    memcpy(text, middle.data, middle.length);
+  }
+  if (suffix.length > 0) {
+    memcpy(text + middle.length, suffix.data, suffix.length);
+  }
+  return true;
+}
+
+static Line line_slice(Line line, size_t start, size_t end) {
+  if (line.data == NULL || start >= end) {
+    return empty_line;
+  }
+  return (Line){line.data + start, end - start};
+}
+
+static void insert_text(Buffer *buffer, size_t row, size_t col,
+                        const Line *text, size_t count, bool recorded) {
+  PieceTable *table = &buffer->table;
+
+  if (count == 0 || row >= piece_table_line_count(table) ||
+      (count == 1 && text[0].length == 0)) {
+    return;
+  }
+  count_edit(buffer);
+  if (recorded) {
+    mark_modified(buffer, row, col);
+    journal_insert(buffer, row, col, text, count);
+  }
+
+  if (count == 1 && piece_table_line_length(table, row) + text[0].length >=
+                        LONG_LINE_LENGTH) {
+    if (recorded) {
+      record_undo_splice(buffer, row);
+    }
+    if (piece_table_splice_line(table, row, col, 0, text[0].data,
+                                text[0].length)) {
+      if (recorded) {
+        publish_buffer_change(buffer, row, 1, 1);
+      }
+      return;
+    }
+  }
+
+  piece_table_close_gap(table);
+  Line line = piece_table_get_line(table, row);
+  if (col > line.length) {
+    col = line.length;
+  }
+  Line prefix = line_slice(line, 0, col);
+  Line suffix = line_slice(line, col, line.length);
+
+  Line stack_lines[16];
+  Line *lines = stack_lines;
+  if (count > 16) {
+    lines = malloc(count * sizeof(Line));
+    if (lines == NULL) {
+      return;
+    }
+  }
+
+  bool ok;
+  if (count == 1) {
+    ok = store_line(table, prefix, text[0], suffix, &lines[0]);
+  } else {
+    ok = store_line(table, prefix, text[0], empty_line, &lines[0]);
+    for (size_t i = 1; ok && i + 1 < count; i++) {
+      ok = store_line(table, empty_line, text[i], empty_line, &lines[i]);
+    }
+    ok = ok && store_line(table, empty_line, text[count - 1], suffix,
+                          &lines[count - 1]);
+  }
+
+  if (ok) {
+    if (recorded) {
+      record_undo(buffer, row, 1, count);
+    }
+    if (piece_table_replace(table, row, 1, lines, count) && recorded) {
+      publish_buffer_change(buffer, row, 1, count);
+    }
+  }
+
+  if (lines != stack_lines) {
+    free(lines);
+  }
+}
+
+void buffer_insert(Buffer *buffer, size_t row, size_t col, const Line *text,
+                   size_t count) {
+  if (buffer->read_only) {
+    return;
+  }
+  wait_for_buffer_load(buffer);
+  insert_text(buffer, row, col, text, count, true);
+}
+
+static void delete_text(Buffer *buffer, size_t start_row, size_t start_col,
+                        size_t end_row, size_t end_col, bool recorded) {
+  PieceTable *table = &buffer->table;
+  size_t length = piece_table_line_count(table);
+
+  if (start_row >= length) {
+    return;
+  }
+
+  if (end_row >= length) {
+    end_row = length - 1;
+    end_col = piece_table_line_length(table, end_row);
+  }
+  if (end_row < start_row) {
+    return;
+  }
+  size_t end_length = piece_table_line_length(table, end_row);
+  if (end_col > end_length) {
+    end_col = end_length;
+  }
+  if (start_row == end_row && start_col >= end_col) {
+    return;
+  }
+  count_edit(buffer);
+  if (recorded) {
+    mark_modified(buffer, start_row, start_col);
+    journal_delete(buffer, start_row, start_col, end_row, end_col);
+  }
+
+  if (start_col == 0 && end_col == 0 && end_row > start_row) {
+    if (recorded) {
+      record_undo(buffer, start_row, end_row - start_row, 0);
+    }
+    if (piece_table_replace(table, start_row, end_row - start_row, NULL, 0) &&
+        recorded) {
+      publish_buffer_change(buffer, start_row, end_row - start_row, 0);
+    }
+    return;
+  }
+
+  if (start_row == end_row && end_length >= LONG_LINE_LENGTH) {
+    if (recorded) {
+      record_undo_splice(buffer, start_row);
+    }
+    if (piece_table_splice_line(table, start_row, start_col,
+                                end_col - start_col, NULL, 0)) {
+      if (recorded) {
+        publish_buffer_change(buffer, start_row, 1, 1);
+      }
+      return;
+    }
+  }
+
+  piece_table_close_gap(table);
+  Line last = piece_table_get_line(table, end_row);
+  Line first = start_row == end_row ? last
+                                    : piece_table_get_line(table, start_row);
+  if (start_col > first.length) {
+    start_col = first.length;
+  }
+
+  Line joined;
+  if (store_line(table, line_slice(first, 0, start_col), empty_line,
+                 line_slice(last, end_col, last.length), &joined)) {
+    if (recorded) {
+      record_undo(buffer, start_row, end_row - start_row + 1, 1);
+    }
+    if (piece_table_replace(table, start_row, end_row - start_row + 1,
+                            &joined, 1) &&
+        recorded) {
+      publish_buffer_change(buffer, start_row, end_row - start_row + 1, 1);
+    }
+  }
+}
+
+void buffer_delete(Buffer *buffer, size_t start_row, size_t start_col,
+                   size_t end_row, size_t end_col) {
+  if (buffer->read_only) {
+    return;
+  }
+  wait_for_buffer_load(buffer);
+  delete_text(buffer, start_row, start_col, end_row, end_col, true);
+}
+
+void buffer_apply_edit(Buffer *buffer, const EditOp *ops, size_t n_ops,
+                       const Line *lines) {
+  if (buffer->read_only) {
+    return;
+  }
+  wait_for_buffer_load(buffer);
+  if (n_ops == 1 && ops[0].insert) {
+    insert_text(buffer, ops[0].row, ops[0].column, lines + ops[0].first,
+                ops[0].count, true);
+    return;
+  }
+  if (n_ops == 1) {
+    delete_text(buffer, ops[0].row, ops[0].column, ops[0].end_row,
+                ops[0].end_column, true);
+    return;
+  }
+
+  size_t before = piece_table_line_count(&buffer->table);
+  size_t n_lines = before;
+  size_t first = SIZE_MAX;
+  size_t last = 0;
+  for (size_t i = 0; i < n_ops; i++) {
+    const EditOp *op = &ops[i];
+    size_t end_row = op->insert ? op->row : op->end_row;
+    if (op->row >= n_lines || (op->insert && op->count == 0)) {
+      continue;
+    }
+    if (end_row >= n_lines) {
+      end_row = n_lines - 1;
+    }
+    if (end_row < op->row) {
+      continue;
+    }
+    first = op->row < first ? op->row : first;
+    last = end_row > last ? end_row : last;
+    if (op->insert) {
+      last += op->count - 1;
+      n_lines += op->count - 1;
+    } else {
+      last -= end_row - op->row;
+      n_lines -= end_row - op->row;
+    }
+  }
+  if (first == SIZE_MAX) {
+    return;
+  }
+  size_t removed = last + before - n_lines - first + 1;
+  size_t inserted = last - first + 1;
+
+  mark_modified(buffer, first, 0);
+  journal_edit(buffer, ops, n_ops, lines);
+  record_undo(buffer, first, removed, inserted);
+  for (size_t i = 0; i < n_ops; i++) {
+    const EditOp *op = &ops[i];
+    if (op->insert) {
+      insert_text(buffer, op->row, op->column, lines + op->first, op->count,
+                  false);
+    } else {
+      delete_text(buffer, op->row, op->column, op->end_row, op->end_column,
+                  false);
+    }
+  }
+  publish_buffer_change(buffer, first, removed, inserted);
+}
@@ -0,0 +1,80 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdbool.h>
+
+#include "main.h"
+
+#define LONG_LINE_LENGTH (64 * 1024)
+
+Buffer *create_buffer_from_file(File file, size_t view_threshold);
+
+void free_buffer(Buffer *buffer);
+
+bool poll_buffer_load(Buffer *buffer);
+
+void wait_for_buffer_lines(Buffer *buffer, size_t n_lines);
+
+void wait_for_buffer_load(Buffer *buffer);
+
+bool cancel_buffer_load(Buffer *buffer);
+
+bool is_buffer_loading(Buffer *buffer);
+
+double buffer_load_progress(Buffer *buffer);
+
+void release_buffer_pages(Buffer *buffer);
+
+bool pin_buffer_pages(Buffer *buffer, size_t offset);
+
+void mark_buffer_modified(Buffer *buffer, size_t offset);
+
+bool is_buffer_modified(Buffer *buffer);
+
+bool add_buffer_listener(Buffer *buffer, BufferListener listener,
+                         void *data);
+
+void remove_buffer_listener(Buffer *buffer, BufferListener listener,
+                            void *data);
+
+void publish_buffer_change(Buffer *buffer, size_t row, size_t removed,
+                           size_t inserted);
+
+bool stamp_file(int fd, FileStamp *stamp);
+
+bool stamp_path(const char *path, FileStamp *stamp);
+
+bool same_stamp(const FileStamp *a, const FileStamp *b);
+
+size_t buffer_line_count(Buffer *buffer);
+
+Line buffer_get_line(Buffer *buffer, size_t row);
+
+void buffer_iterate(Buffer *buffer, size_t row, LineIterator *iterator);
+
+bool buffer_next_line(LineIterator *iterator, Line *line);
+
+Line buffer_get_line_range(Buffer *buffer, size_t row, size_t start,
+                           size_t length);
+
+size_t buffer_line_length(Buffer *buffer, size_t row);
+
+size_t buffer_byte_count(Buffer *buffer);
+
+size_t buffer_row_offset(Buffer *buffer, size_t row);
+
+size_t buffer_offset_row(Buffer *buffer, size_t offset, size_t *column);
+
+bool buffer_next_line_range(LineIterator *iterator, size_t start,
+                            size_t length, Line *line);
+
+void buffer_insert(Buffer *buffer, size_t row, size_t col, const Line *text,
+                   size_t count);
+
+void buffer_delete(Buffer *buffer, size_t start_row, size_t start_col,
+                   size_t end_row, size_t end_col);
+
+void buffer_apply_edit(Buffer *buffer, const EditOp *ops, size_t n_ops,
+                       const Line *lines);
+
+#endif
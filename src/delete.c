@@ -1,8 +1,8 @@
 #include <ctype.h>
-#include <stdlib.h>
-#include <string.h>
 
+#include "buffer.h"
 #include "delete.h"
+#include "edit.h"
 
 static bool is_word_char(char c) {
   return isalnum((unsigned char)c) || c == '_';
@@ -23,102 +23,27 @@ static void normalize_selection(size_t *start_row, size_t *start_col,
 
 void delete_range(Window *window, size_t start_row, size_t start_col,
                   size_t end_row, size_t end_col) {
-  Buffer *buffer = window->current_buffer;
-
-  if (buffer->length == 0 || start_row >= buffer->length) {
-    return;
-  }
-
-  if (end_row >= buffer->length) {
-    end_row = buffer->length - 1;
-    end_col = buffer->lines[end_row].length;
-  }
-
-  if (start_row == end_row) {
-    Line *line = &buffer->lines[start_row];
-
-    if (start_col >= line->length || start_col >= end_col) {
-      return;
-    }
-
-    if (end_col > line->length) {
-      end_col = line->length;
-    }
-
-    size_t delete_count = end_col - start_col;
-    memmove(line->data + start_col, line->data + end_col,
-            line->length - end_col);
-    line->length -= delete_count;
-
-    if (line->length == 0) {
-      free(line->data);
-      line->data = NULL;
-      line->capacity = 0;
-    }
-    return;
-  }
-
-  Line *start_line = &buffer->lines[start_row];
-  Line *end_line = &buffer->lines[end_row];
-
-  if (end_col > end_line->length) {
-    end_col = end_line->length;
-  }
-
-  size_t new_length = start_col + (end_line->length - end_col);
-  char *new_data = NULL;
-  size_t new_capacity = 0;
-
-  if (new_length > 0) {
-    new_capacity = new_length < 16 ? 16 : new_length * 2;
-    new_data = malloc(new_capacity);
-    if (new_data != NULL) {
-      if (start_col > 0) {
-        memcpy(new_data, start_line->data, start_col);
-      }
-      if (end_col < end_line->length) {
-        memcpy(new_data + start_col, end_line->data + end_col,
-               end_line->length - end_col);
-      }
-    }
-  }
-
-  for (size_t i = start_row; i <= end_row; i++) {
-    free(buffer->lines[i].data);
-  }
-
-  buffer->lines[start_row].data = new_data;
-  buffer->lines[start_row].length = new_length;
-  buffer->lines[start_row].capacity = new_capacity;
-  size_t lines_to_remove = end_row - start_row;
-  if (lines_to_remove > 0) {
-    memmove(&buffer->lines[start_row + 1], &buffer->lines[end_row + 1],
-            sizeof(Line) * (buffer->length - end_row - 1));
-    buffer->length -= lines_to_remove;
-    buffer->lines = realloc(buffer->lines, sizeof(Line) * buffer->length);
-  }
+  buffer_delete(window->current_buffer, start_row, start_col, end_row,
+                end_col);
 }
 
-void delete_char(Window *window) {
+void delete_chars(Window *window, size_t count) {
   Buffer *buffer = window->current_buffer;
   size_t row = window->cursor.row - 1;
   size_t col = window->cursor.column - 1;
 
-  if (buffer->length == 0) {
+  if (buffer_line_count(buffer) == 0) {
     return;
   }
 
-  Line *line = &buffer->lines[row];
-
-  if (line->length == 0) {
-    return;
+  size_t length = buffer_line_length(buffer, row);
+  BufferEdit edit;
+  begin_buffer_edit(&edit, buffer);
+  for (size_t i = 0; i < count && length > 0; i++, length--) {
+    size_t at = col < length ? col : length - 1;
+    edit_delete(&edit, row, at, row, at + 1);
   }
-
-  if (col >= line->length) {
-    col = line->length - 1;
-  }
-
-  delete_range(window, row, col, row, col + 1);
+  commit_buffer_edit(&edit);
 }
 
 void backspace_char(Window *window) {
@@ -126,44 +51,21 @@ void backspace_char(Window *window) {
   size_t row = window->cursor.row - 1;
   size_t col = window->cursor.column - 1;
 
-  if (buffer->length == 0) {
+  if (buffer_line_count(buffer) == 0) {
     return;
   }
 
-  Line *line = &buffer->lines[row];
-
   if (col == 0) {
     if (row == 0) {
       return;
     }
 
-    Line *prev_line = &buffer->lines[row - 1];
-    size_t prev_length = prev_line->length;
-
-    if (line->length > 0) {
-      size_t new_length = prev_line->length + line->length;
-      if (new_length > prev_line->capacity) {
-        size_t new_capacity = prev_line->capacity == 0 ? 16 : prev_line->capacity;
-        while (new_capacity < new_length) {
-          new_capacity *= 2;
-        }
-        prev_line->data = realloc(prev_line->data, new_capacity);
-        prev_line->capacity = new_capacity;
-      }
-      memcpy(prev_line->data + prev_line->length, line->data, line->length);
-      prev_line->length = new_length;
-      free(line->data);
-    }
-
-    memmove(&buffer->lines[row], &buffer->lines[row + 1],
-            sizeof(Line) * (buffer->length - row - 1));
-
-    buffer->length--;
-    buffer->lines = realloc(buffer->lines, sizeof(Line) * buffer->length);
+    size_t prev_length = buffer_line_length(buffer, row - 1);
+    buffer_delete(buffer, row - 1, prev_length, row, 0);
 
     window->cursor.row--;
     window->cursor.column = prev_length + 1;
-  } else if (col > 0 && col <= line->length) {
+  } else if (col > 0 && col <= buffer_line_length(buffer, row)) {
     delete_range(window, row, col - 1, row, col);
     window->cursor.column--;
   }
@@ -174,27 +76,27 @@ void delete_word(Window *window) {
   size_t row = window->cursor.row - 1;
   size_t col = window->cursor.column - 1;
 
-  if (buffer->length == 0) {
+  if (buffer_line_count(buffer) == 0) {
     return;
   }
 
-  Line *line = &buffer->lines[row];
+  Line line = buffer_get_line(buffer, row);
 
-  if (col >= line->length) {
+  if (col >= line.length) {
     return;
   }
 
-  if (!is_word_char(line->data[col])) {
+  if (!is_word_char(line.data[col])) {
     return;
   }
 
   size_t start = col;
-  while (start > 0 && is_word_char(line->data[start - 1])) {
+  while (start > 0 && is_word_char(line.data[start - 1])) {
     start--;
   }
 
   size_t end = col;
-  while (end < line->length && is_word_char(line->data[end])) {
+  while (end < line.length && is_word_char(line.data[end])) {
     end++;
   }
 
@@ -202,30 +104,23 @@ void delete_word(Window *window) {
   window->cursor.column = start + 1;
 }
 
-void delete_line(Window *window) {
+void delete_lines(Window *window, size_t row, size_t count) {
   Buffer *buffer = window->current_buffer;
-  size_t row = window->cursor.row - 1;
 
-  if (buffer->length == 0) {
+  wait_for_buffer_load(buffer);
+  size_t length = buffer_line_count(buffer);
+  if (count == 0 || row >= length) {
     return;
   }
 
-  if (buffer->length == 1) {
-    Line *line = &buffer->lines[row];
-    if (line->data != NULL) {
-      free(line->data);
-    }
-    line->data = NULL;
-    line->length = 0;
-    line->capacity = 0;
-    window->cursor.column = 1;
-    return;
+  if (row + count >= length) {
+    buffer_delete(buffer, row, 0, length, 0);
+  } else {
+    buffer_delete(buffer, row, 0, row + count, 0);
   }
 
-  delete_range(window, row, 0, row + 1, 0);
-
-  if (row >= buffer->length) {
-    window->cursor.row = buffer->length;
+  if (row >= buffer_line_count(buffer)) {
+    window->cursor.row = buffer_line_count(buffer);
   }
   window->cursor.column = 1;
 }
@@ -242,12 +137,7 @@ void delete_selection(Context *ctx) {
   normalize_selection(&start_row, &start_col, &end_row, &end_col);
 
   if (ctx->mode == MODE_LINEWISE_VISUAL) {
-    for (size_t i = start_row; i <= end_row; i++) {
-      delete_line(window);
-      if (window->cursor.row > start_row) {
-        window->cursor.row--;
-      }
-    }
+    delete_lines(window, start_row - 1, end_row - start_row + 1);
     window->cursor.row = start_row;
     window->cursor.column = 1;
   } else if (ctx->mode == MODE_CHARACTERWISE_VISUAL) {
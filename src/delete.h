@@ -3,11 +3,11 @@
 
 #include "main.h"
 
-void delete_char(Window *window);
+void delete_chars(Window *window, size_t count);
 
 void backspace_char(Window *window);
 
-void delete_line(Window *window);
+void delete_lines(Window *window, size_t row, size_t count);
 
 void delete_word(Window *window);
 
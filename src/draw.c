@@ -4,8 +4,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "buffer.h"
 #include "draw.h"
 #include "main.h"
+#include "save.h"
 
 #define COLOR_KEYWORD "\x1b[35m"
 #define COLOR_STRING "\x1b[33m"
@@ -14,6 +16,7 @@
 #define COLOR_NUMBER "\x1b[31m"
 #define COLOR_TAB "\x1b[34m"
 #define COLOR_RESET "\x1b[0m"
+#define SYNTAX_CHECKPOINT_INTERVAL 64
 
 typedef struct {
   char *data;
@@ -21,6 +24,12 @@ typedef struct {
   size_t capacity;
 } DrawBuffer;
 
+struct SyntaxCache {
+  SyntaxState *states;
+  size_t n_states;
+  size_t capacity;
+};
+
 static void draw_buffer_init(DrawBuffer *buf, size_t initial_capacity) {
   buf->data = malloc(initial_capacity);
   buf->length = 0;
@@ -155,11 +164,47 @@ static void set_cursor_position(DrawBuffer *buf, size_t row, size_t column) {
   draw_buffer_append(buf, pos, len);
 }
 
+static void format_load_status(Buffer *buffer, char *text, size_t size) {
+  if (is_buffer_loading(buffer)) {
+    snprintf(text, size, " [loading %d%%, %zu lines]",
+             (int)(buffer_load_progress(buffer) * 100),
+             buffer_line_count(buffer));
+  } else if (buffer->partial) {
+    snprintf(text, size, " [partial, %zu lines]", buffer_line_count(buffer));
+  } else if (is_buffer_saving(buffer)) {
+    snprintf(text, size, " [saving %d%%]",
+             (int)(buffer_save_progress(buffer) * 100));
+  } else if (buffer->message[0] != '\0') {
+    snprintf(text, size, " [%s]", buffer->message);
+  } else {
+    text[0] = '\0';
+  }
+}
+
+static void format_byte_status(Buffer *buffer, Cursor cursor, char *text,
+                               size_t size) {
+  size_t row = cursor.row > 0 ? cursor.row - 1 : 0;
+  size_t column = cursor.column > 0 ? cursor.column - 1 : 0;
+  size_t length = buffer_line_length(buffer, row);
+  if (column > length) {
+    column = length;
+  }
+  size_t offset = buffer_row_offset(buffer, row) + column;
+  size_t total = buffer_byte_count(buffer);
+  snprintf(text, size, " byte %zu / %d%%", offset,
+           total > 0 ? (int)((double)offset * 100 / total) : 0);
+}
+
 static void draw_status_bar(DrawBuffer *buf, size_t width, size_t height,
                             Cursor cursor, EditorMode mode, char *command_buffer,
                             size_t command_buffer_length, char *search_buffer,
                             size_t search_buffer_length, char *filter_buffer,
-                            size_t filter_buffer_length, const char *filename) {
+                            size_t filter_buffer_length, Buffer *buffer) {
+  const char *filename = buffer->file.name;
+  char load_status[160];
+  format_load_status(buffer, load_status, sizeof(load_status));
+  char byte_status[64];
+  format_byte_status(buffer, cursor, byte_status, sizeof(byte_status));
   set_cursor_position(buf, height, 1);
   draw_buffer_append_str(buf, "\x1b[7m");
   char status_bar_text[256];
@@ -179,8 +224,12 @@ static void draw_status_bar(DrawBuffer *buf, size_t width, size_t height,
     snprintf(status_bar_text, 256, "%s -- VISUAL -- %zu %zu",
              filename ? filename : "[No Name]", cursor.row, cursor.column);
   } else {
-    snprintf(status_bar_text, 256, "%s %zu %zu",
-             filename ? filename : "[No Name]", cursor.row, cursor.column);
+    snprintf(status_bar_text, 256, "%s%s%s %zu %zu%s%s",
+             filename ? filename : "[No Name]",
+             is_buffer_modified(buffer) ? " [+]" : "",
+             buffer->read_only ? " [view]" : buffer->paged ? " [paged]" : "",
+             cursor.row, cursor.column,
+             byte_status, load_status);
   }
   size_t len = strlen(status_bar_text);
   for (size_t i = 0; i < width; i++) {
@@ -232,35 +281,117 @@ static bool is_in_selection(size_t row, size_t col, EditorMode mode,
   }
 }
 
-static void compute_syntax_state_up_to_line(Buffer *buffer, size_t target_line,
-                                             SyntaxState *state) {
-  *state = (SyntaxState){0};
+static void advance_syntax_state(SyntaxState *state, Line line) {
+  for (size_t col = 0; col < line.length; col++) {
+    char c = line.data[col];
+    char next_c = (col + 1 < line.length) ? line.data[col + 1] : '\0';
+    bool is_closing_char = false;
 
-  for (size_t row = 0; row < target_line && row < buffer->length; row++) {
-    Line *line = &buffer->lines[row];
+    update_syntax_state(state, c, next_c, line.data, line.data + col,
+                        &is_closing_char);
 
-    for (size_t col = 0; col < line->length; col++) {
-      char c = line->data[col];
-      char next_c = (col + 1 < line->length) ? line->data[col + 1] : '\0';
-      bool is_closing_char = false;
+    if (is_closing_char) {
+      if (c == '*') {
+        state->in_block_comment = false;
+      } else if (c == '\'') {
+        state->in_single_quote_string = false;
+      } else if (c == '"') {
+        state->in_double_quote_string = false;
+      }
+    }
+  }
 
-      update_syntax_state(state, c, next_c, line->data, line->data + col,
-                          &is_closing_char);
+  state->in_line_comment = false;
+  state->in_preprocessor_directive = false;
+  state->in_keyword = false;
+}
 
-      if (is_closing_char) {
-        if (c == '*') {
-          state->in_block_comment = false;
-        } else if (c == '\'') {
-          state->in_single_quote_string = false;
-        } else if (c == '"') {
-          state->in_double_quote_string = false;
-        }
-      }
+static void invalidate_syntax_cache(void *data, const BufferChange *change) {
+  SyntaxCache *cache = data;
+  size_t valid = change->row / SYNTAX_CHECKPOINT_INTERVAL + 1;
+  if (valid < cache->n_states) {
+    cache->n_states = valid;
+  }
+}
+
+static SyntaxCache *syntax_cache(Buffer *buffer) {
+  if (buffer->syntax != NULL) {
+    return buffer->syntax;
+  }
+  SyntaxCache *cache = malloc(sizeof(SyntaxCache));
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->capacity = 16;
+  cache->states = malloc(cache->capacity * sizeof(SyntaxState));
+  if (cache->states == NULL ||
+      !add_buffer_listener(buffer, invalidate_syntax_cache, cache)) {
+    free(cache->states);
+    free(cache);
+    return NULL;
+  }
+  cache->states[0] = (SyntaxState){0};
+  cache->n_states = 1;
+  buffer->syntax = cache;
+  return cache;
+}
+
+static void add_syntax_checkpoint(SyntaxCache *cache,
+                                  const SyntaxState *state) {
+  if (cache->n_states == cache->capacity) {
+    SyntaxState *states =
+        realloc(cache->states, cache->capacity * 2 * sizeof(SyntaxState));
+    if (states == NULL) {
+      return;
+    }
+    cache->states = states;
+    cache->capacity *= 2;
+  }
+  cache->states[cache->n_states++] = *state;
+}
+
+void free_syntax_cache(Buffer *buffer) {
+  SyntaxCache *cache = buffer->syntax;
+  if (cache == NULL) {
+    return;
+  }
+  remove_buffer_listener(buffer, invalidate_syntax_cache, cache);
+  free(cache->states);
+  free(cache);
+  buffer->syntax = NULL;
+}
+
+static void compute_syntax_state_up_to_line(Buffer *buffer, size_t target_line,
+                                             SyntaxState *state) {
+  *state = (SyntaxState){0};
+  if (buffer->read_only) {
+    return;
+  }
+
+  SyntaxCache *cache = syntax_cache(buffer);
+  size_t row = 0;
+  if (cache != NULL) {
+    size_t index = target_line / SYNTAX_CHECKPOINT_INTERVAL;
+    if (index >= cache->n_states) {
+      index = cache->n_states - 1;
     }
+    row = index * SYNTAX_CHECKPOINT_INTERVAL;
+    *state = cache->states[index];
+  }
 
-    state->in_line_comment = false;
-    state->in_preprocessor_directive = false;
-    state->in_keyword = false;
+  LineIterator iterator;
+  buffer_iterate(buffer, row, &iterator);
+  Line line;
+  while (row < target_line &&
+         buffer_next_line_range(&iterator, 0, LONG_LINE_LENGTH + 1, &line)) {
+    if (line.length <= LONG_LINE_LENGTH) {
+      advance_syntax_state(state, line);
+    }
+    row++;
+    if (cache != NULL && row % SYNTAX_CHECKPOINT_INTERVAL == 0 &&
+        row / SYNTAX_CHECKPOINT_INTERVAL == cache->n_states) {
+      add_syntax_checkpoint(cache, state);
+    }
   }
 }
 
@@ -326,28 +457,10 @@ static void draw_line(DrawBuffer *buf, Window *window, Line line, size_t n,
     }
   }
 
-  for (size_t col = 0; col < line.length; col++) {
-    char c = line.data[col];
-    char next_c = (col + 1 < line.length) ? line.data[col + 1] : '\0';
-    bool is_closing_char = false;
-
-    update_syntax_state(syntax_state, c, next_c, line.data,
-                        line.data + col, &is_closing_char);
-
-    if (is_closing_char) {
-      if (c == '*') {
-        syntax_state->in_block_comment = false;
-      } else if (c == '\'') {
-        syntax_state->in_single_quote_string = false;
-      } else if (c == '"') {
-        syntax_state->in_double_quote_string = false;
-      }
-    }
-  }
-
-  SyntaxState line_render_state;
-  compute_syntax_state_up_to_line(window->current_buffer, scroll.vertical + n,
-                                   &line_render_state);
+  SyntaxState line_render_state = window->current_buffer->read_only
+                                      ? (SyntaxState){0}
+                                      : *syntax_state;
+  advance_syntax_state(syntax_state, line);
 
   for (size_t col = 0; col < scroll.horizontal && col < line.length; col++) {
     char c = line.data[col];
@@ -443,24 +556,57 @@ static void draw_line(DrawBuffer *buf, Window *window, Line line, size_t n,
     }
   }
 
-  syntax_state->in_line_comment = false;
-  syntax_state->in_preprocessor_directive = false;
-  syntax_state->in_keyword = false;
-
   #undef MAX_STACK_LINE_LENGTH
 }
 
+static void draw_long_line(DrawBuffer *buf, Window *window, size_t n,
+                           EditorMode mode, Selection *selection) {
+  Scroll scroll = window->scroll;
+  size_t buffer_row = scroll.vertical + n;
+  Line line = buffer_get_line_range(window->current_buffer, buffer_row,
+                                    scroll.horizontal, window->width);
+  set_cursor_position(buf, window->row + n, window->column);
+
+  for (size_t i = 0; i < window->width; i++) {
+    size_t buffer_col = scroll.horizontal + i;
+    bool in_selection =
+        is_in_selection(buffer_row + 1, buffer_col + 1, mode, selection);
+    char c = i < line.length ? line.data[i] : ' ';
+    bool needs_reset = false;
+
+    if (in_selection) {
+      draw_buffer_append_str(buf, "\x1b[48;5;240m");
+      needs_reset = true;
+    } else if (c == '\t') {
+      draw_buffer_append_str(buf, COLOR_TAB);
+      needs_reset = true;
+    }
+
+    if (c == '\t') {
+      draw_buffer_append_str(buf, ">>");
+    } else if (i < line.length && (c < 32 || c == 127)) {
+      draw_buffer_append_str(buf, "\xef\xbf\xbd");
+    } else {
+      draw_buffer_append_char(buf, c);
+    }
+
+    if (needs_reset) {
+      draw_buffer_append_str(buf, COLOR_RESET);
+    }
+  }
+}
+
 static void constrain_cursor(Window *window) {
   if (window->cursor.row < 1)
     window->cursor.row = 1;
   if (window->cursor.column < 1)
     window->cursor.column = 1;
-  if (window->cursor.row > window->current_buffer->length)
-    window->cursor.row = window->current_buffer->length;
-  if (window->cursor.column >
-      window->current_buffer->lines[window->cursor.row - 1].length + 1)
-    window->cursor.column =
-        window->current_buffer->lines[window->cursor.row - 1].length + 1;
+  if (window->cursor.row > buffer_line_count(window->current_buffer))
+    window->cursor.row = buffer_line_count(window->current_buffer);
+  size_t line_length =
+      buffer_line_length(window->current_buffer, window->cursor.row - 1);
+  if (window->cursor.column > line_length + 1)
+    window->cursor.column = line_length + 1;
 }
 
 static void update_scroll(Window *window) {
@@ -486,13 +632,16 @@ static void draw_window(DrawBuffer *buf, Window *window, EditorMode mode,
                                    &syntax_state);
 
   Line eof_line = {.data = "", .length = 0};
+  LineIterator iterator;
+  buffer_iterate(current_buffer, window->scroll.vertical, &iterator);
   for (size_t i = 0; i < window->height; i++) {
-    size_t buffer_row = window->scroll.vertical + i;
-    if (buffer_row < current_buffer->length) {
-      draw_line(buf, window, current_buffer->lines[buffer_row], i, mode,
-                selection, &syntax_state);
-    } else {
+    Line line;
+    if (!buffer_next_line_range(&iterator, 0, LONG_LINE_LENGTH + 1, &line)) {
       draw_line(buf, window, eof_line, i, mode, selection, &syntax_state);
+    } else if (line.length > LONG_LINE_LENGTH) {
+      draw_long_line(buf, window, i, mode, selection);
+    } else {
+      draw_line(buf, window, line, i, mode, selection, &syntax_state);
     }
   }
 }
@@ -509,7 +658,8 @@ static void draw_window_with_line_numbers(DrawBuffer *buf, Window *window,
   SyntaxState syntax_state;
   compute_syntax_state_up_to_line(current_buffer, window->scroll.vertical,
                                    &syntax_state);
-  size_t num_digits = snprintf(NULL, 0, "%zu", current_buffer->length);
+  size_t num_digits =
+      snprintf(NULL, 0, "%zu", buffer_line_count(current_buffer));
   if (num_digits < 3)
     num_digits = 3;
 
@@ -518,6 +668,8 @@ static void draw_window_with_line_numbers(DrawBuffer *buf, Window *window,
   window->column += line_num_width;
 
   Line eof_line = {.data = "", .length = 0};
+  LineIterator iterator;
+  buffer_iterate(current_buffer, window->scroll.vertical, &iterator);
   for (size_t i = 0; i < window->height; i++) {
     size_t buffer_row = window->scroll.vertical + i;
 
@@ -525,12 +677,16 @@ static void draw_window_with_line_numbers(DrawBuffer *buf, Window *window,
     int len = snprintf(line_num, sizeof(line_num), "\033[%zu;1H", window->row + i);
     draw_buffer_append(buf, line_num, len);
 
-    if (buffer_row < current_buffer->length) {
+    Line line;
+    if (buffer_next_line_range(&iterator, 0, LONG_LINE_LENGTH + 1, &line)) {
       len = snprintf(line_num, sizeof(line_num), "\033[38;5;242m%*zu \033[0m",
                      (int)num_digits, buffer_row + 1);
       draw_buffer_append(buf, line_num, len);
-      draw_line(buf, window, current_buffer->lines[buffer_row], i, mode,
-                selection, &syntax_state);
+      if (line.length > LONG_LINE_LENGTH) {
+        draw_long_line(buf, window, i, mode, selection);
+      } else {
+        draw_line(buf, window, line, i, mode, selection, &syntax_state);
+      }
     } else {
       len = snprintf(line_num, sizeof(line_num), "\033[38;5;242m%*s \033[0m",
                      (int)num_digits, "~");
@@ -558,7 +714,8 @@ void draw_screen(Window *window, size_t width, size_t height, EditorMode mode,
   window->height = height - 1;
 
   if (show_line_numbers) {
-    size_t num_digits = snprintf(NULL, 0, "%zu", window->current_buffer->length);
+    size_t num_digits =
+        snprintf(NULL, 0, "%zu", buffer_line_count(window->current_buffer));
     if (num_digits < 3)
       num_digits = 3;
     window->width -= (num_digits + 1);
@@ -570,13 +727,14 @@ void draw_screen(Window *window, size_t width, size_t height, EditorMode mode,
   draw_status_bar(&buf, width, height, window->cursor, mode, command_buffer,
                   command_buffer_length, search_buffer, search_buffer_length,
                   filter_buffer, filter_buffer_length,
-                  window->current_buffer->file.name);
+                  window->current_buffer);
 
   size_t screen_row = window->cursor.row - window->scroll.vertical;
   size_t screen_col = window->cursor.column - window->scroll.horizontal;
 
   if (show_line_numbers) {
-    size_t num_digits = snprintf(NULL, 0, "%zu", window->current_buffer->length);
+    size_t num_digits =
+        snprintf(NULL, 0, "%zu", buffer_line_count(window->current_buffer));
     if (num_digits < 3)
       num_digits = 3;
     screen_col += num_digits + 1;
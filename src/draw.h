@@ -3,6 +3,8 @@
 
 #include "main.h"
 
+void free_syntax_cache(Buffer *buffer);
+
 void draw_screen(Window *window, size_t width, size_t height, EditorMode mode,
                  Selection *selection, char *command_buffer,
                  size_t command_buffer_length, char *search_buffer,
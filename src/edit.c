@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "edit.h"
+
+static void *grow(void *items, size_t *capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) {
+    return items;
+  }
+  size_t new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+  void *new_items = realloc(items, new_capacity * size);
+  if (new_items != NULL) {
+    *capacity = new_capacity;
+  }
+  return new_items;
+}
+
+void begin_buffer_edit(BufferEdit *edit, Buffer *buffer) {
+  edit->buffer = buffer;
+  edit->ops = NULL;
+  edit->n_ops = 0;
+  edit->ops_capacity = 0;
+  edit->lines = NULL;
+  edit->n_lines = 0;
+  edit->lines_capacity = 0;
+  edit->text = NULL;
+  edit->text_length = 0;
+  edit->text_capacity = 0;
+  edit->failed = false;
+}
+
+void cancel_buffer_edit(BufferEdit *edit) {
+  free(edit->ops);
+  free(edit->lines);
+  free(edit->text);
+  begin_buffer_edit(edit, edit->buffer);
+}
+
+static bool append_text(BufferEdit *edit, Line line) {
+  if (line.length == 0) {
+    return true;
+  }
+  char *text = grow(edit->text, &edit->text_capacity,
+                    edit->text_length + line.length, 1);
+  if (text == NULL) {
+    return false;
+  }
+  edit->text = text;
+  memcpy(text + edit->text_length, line.data, line.length);
+  edit->text_length += line.length;
+  return true;
+}
+
+static bool append_lines(BufferEdit *edit, const Line *text, size_t count) {
+  if (count == 0) {
+    return true;
+  }
+  EditLine *lines = grow(edit->lines, &edit->lines_capacity,
+                         edit->n_lines + count, sizeof(EditLine));
+  if (lines == NULL) {
+    return false;
+  }
+  edit->lines = lines;
+  for (size_t i = 0; i < count; i++) {
+    size_t offset = edit->text_length;
+    if (!append_text(edit, text[i])) {
+      return false;
+    }
+    lines[edit->n_lines++] = (EditLine){offset, text[i].length};
+  }
+  return true;
+}
+
+static EditOp *last_op(BufferEdit *edit, bool insert) {
+  if (edit->n_ops == 0 || edit->ops[edit->n_ops - 1].insert != insert) {
+    return NULL;
+  }
+  return &edit->ops[edit->n_ops - 1];
+}
+
+static EditOp *add_op(BufferEdit *edit, bool insert, size_t row,
+                      size_t col) {
+  EditOp *ops = grow(edit->ops, &edit->ops_capacity, edit->n_ops + 1,
+                     sizeof(EditOp));
+  if (ops == NULL) {
+    edit->failed = true;
+    return NULL;
+  }
+  edit->ops = ops;
+  EditOp *op = &ops[edit->n_ops++];
+  op->insert = insert;
+  op->row = row;
+  op->column = col;
+  op->end_row = row;
+  op->end_column = col;
+  op->first = edit->n_lines;
+  op->count = 0;
+  return op;
+}
+
+void edit_insert(BufferEdit *edit, size_t row, size_t col, const Line *text,
+                 size_t count) {
+  if (edit->failed || count == 0) {
+    return;
+  }
+  EditOp *op = last_op(edit, true);
+  if (op != NULL && op->end_row == row && op->end_column == col) {
+    if (!append_text(edit, text[0])) {
+      edit->failed = true;
+      return;
+    }
+    edit->lines[edit->n_lines - 1].length += text[0].length;
+    text++;
+    count--;
+  } else if ((op = add_op(edit, true, row, col)) == NULL) {
+    return;
+  }
+  if (!append_lines(edit, text, count)) {
+    edit->failed = true;
+    return;
+  }
+  op->count += count;
+  op->end_row = op->row + op->count - 1;
+  op->end_column = (op->count == 1 ? op->column : 0) +
+                   edit->lines[edit->n_lines - 1].length;
+}
+
+void edit_delete(BufferEdit *edit, size_t start_row, size_t start_col,
+                 size_t end_row, size_t end_col) {
+  if (edit->failed) {
+    return;
+  }
+  EditOp *op = last_op(edit, false);
+  if (op != NULL && op->row == op->end_row && start_row == op->row &&
+      end_row == op->row && start_col <= op->column &&
+      end_col >= op->column) {
+    op->end_column += end_col - op->column;
+    op->column = start_col;
+    return;
+  }
+  op = add_op(edit, false, start_row, start_col);
+  if (op != NULL) {
+    op->end_row = end_row;
+    op->end_column = end_col;
+  }
+}
+
+bool commit_buffer_edit(BufferEdit *edit) {
+  bool ok = !edit->failed;
+  Line *lines = NULL;
+  if (ok && edit->n_lines > 0) {
+    lines = malloc(edit->n_lines * sizeof(Line));
+    ok = lines != NULL;
+  }
+  for (size_t i = 0; ok && i < edit->n_lines; i++) {
+    EditLine line = edit->lines[i];
+    lines[i] = (Line){line.length > 0 ? edit->text + line.offset : NULL,
+                      line.length};
+  }
+  if (ok && edit->n_ops > 0) {
+    buffer_apply_edit(edit->buffer, edit->ops, edit->n_ops, lines);
+  }
+  free(lines);
+  cancel_buffer_edit(edit);
+  return ok;
+}
@@ -0,0 +1,20 @@
+#ifndef EDIT_H
+#define EDIT_H
+
+#include <stdbool.h>
+
+#include "main.h"
+
+void begin_buffer_edit(BufferEdit *edit, Buffer *buffer);
+
+void edit_insert(BufferEdit *edit, size_t row, size_t col, const Line *text,
+                 size_t count);
+
+void edit_delete(BufferEdit *edit, size_t start_row, size_t start_col,
+                 size_t end_row, size_t end_col);
+
+bool commit_buffer_edit(BufferEdit *edit);
+
+void cancel_buffer_edit(BufferEdit *edit);
+
+#endif
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+#define MARK_INTERVAL (4 * 1024 * 1024)
+
+struct HashMarks {
+  ContentHash *states;
+  size_t length;
+  size_t capacity;
+};
+
+static uint64_t rotate(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t read64(const unsigned char *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint64_t mix_lane(uint64_t lane, uint64_t input) {
+  lane += input * PRIME2;
+  return rotate(lane, 31) * PRIME1;
+}
+
+static uint64_t merge_lane(uint64_t hash, uint64_t lane) {
+  hash ^= mix_lane(0, lane);
+  return hash * PRIME1 + PRIME4;
+}
+
+static void consume_stripes(uint64_t *lanes, const unsigned char *p,
+                            size_t n_stripes) {
+  uint64_t a = lanes[0];
+  uint64_t b = lanes[1];
+  uint64_t c = lanes[2];
+  uint64_t d = lanes[3];
+  for (size_t i = 0; i < n_stripes; i++, p += 32) {
+    a = mix_lane(a, read64(p));
+    b = mix_lane(b, read64(p + 8));
+    c = mix_lane(c, read64(p + 16));
+    d = mix_lane(d, read64(p + 24));
+  }
+  lanes[0] = a;
+  lanes[1] = b;
+  lanes[2] = c;
+  lanes[3] = d;
+}
+
+void init_content_hash(ContentHash *hash) {
+  hash->lanes[0] = PRIME1 + PRIME2;
+  hash->lanes[1] = PRIME2;
+  hash->lanes[2] = 0;
+  hash->lanes[3] = -PRIME1;
+  hash->total = 0;
+  hash->stripe_length = 0;
+}
+
+void update_content_hash(ContentHash *hash, const void *data, size_t length) {
+  const unsigned char *p = data;
+  hash->total += length;
+  if (hash->stripe_length > 0) {
+    size_t fill = 32 - hash->stripe_length;
+    if (length < fill) {
+      memcpy(hash->stripe + hash->stripe_length, p, length);
+      hash->stripe_length += length;
+      return;
+    }
+    memcpy(hash->stripe + hash->stripe_length, p, fill);
+    consume_stripes(hash->lanes, hash->stripe, 1);
+    p += fill;
+    length -= fill;
+    hash->stripe_length = 0;
+  }
+  consume_stripes(hash->lanes, p, length / 32);
+  p += length / 32 * 32;
+  length %= 32;
+  if (length > 0) {
+    memcpy(hash->stripe, p, length);
+    hash->stripe_length = length;
+  }
+}
+
+uint64_t finish_content_hash(const ContentHash *hash) {
+  const uint64_t *lanes = hash->lanes;
+  uint64_t result;
+  if (hash->total >= 32) {
+    result = rotate(lanes[0], 1) + rotate(lanes[1], 7) +
+             rotate(lanes[2], 12) + rotate(lanes[3], 18);
+    for (int i = 0; i < 4; i++) {
+      result = merge_lane(result, lanes[i]);
+    }
+  } else {
+    result = lanes[2] + PRIME5;
+  }
+  result += hash->total;
+
+  const unsigned char *p = hash->stripe;
+  size_t length = hash->stripe_length;
+  for (; length >= 8; p += 8, length -= 8) {
+    result ^= mix_lane(0, read64(p));
+    result = rotate(result, 27) * PRIME1 + PRIME4;
+  }
+  if (length >= 4) {
+    result ^= read32(p) * PRIME1;
+    result = rotate(result, 23) * PRIME2 + PRIME3;
+    p += 4;
+    length -= 4;
+  }
+  for (; length > 0; p++, length--) {
+    result ^= *p * PRIME5;
+    result = rotate(result, 11) * PRIME1;
+  }
+
+  result ^= result >> 33;
+  result *= PRIME2;
+  result ^= result >> 29;
+  result *= PRIME3;
+  result ^= result >> 32;
+  return result;
+}
+
+uint64_t hash_content(const void *data, size_t length) {
+  ContentHash hash;
+  init_content_hash(&hash);
+  update_content_hash(&hash, data, length);
+  return finish_content_hash(&hash);
+}
+
+HashMarks *create_hash_marks(void) {
+  return calloc(1, sizeof(HashMarks));
+}
+
+void free_hash_marks(HashMarks *marks) {
+  if (marks != NULL) {
+    free(marks->states);
+    free(marks);
+  }
+}
+
+static void add_mark(HashMarks *marks, const ContentHash *hash) {
+  if (marks->length >= marks->capacity) {
+    size_t capacity = marks->capacity == 0 ? 64 : marks->capacity * 2;
+    ContentHash *states = realloc(marks->states, capacity * sizeof(*states));
+    if (states == NULL) {
+      return;
+    }
+    marks->states = states;
+    marks->capacity = capacity;
+  }
+  marks->states[marks->length++] = *hash;
+}
+
+void update_marked_hash(ContentHash *hash, HashMarks *marks, const void *data,
+                        size_t length) {
+  const unsigned char *p = data;
+  while (length > 0) {
+    size_t step = MARK_INTERVAL - hash->total % MARK_INTERVAL;
+    step = step < length ? step : length;
+    update_content_hash(hash, p, step);
+    p += step;
+    length -= step;
+    if (marks != NULL && hash->total % MARK_INTERVAL == 0) {
+      add_mark(marks, hash);
+    }
+  }
+}
+
+HashMarks *resume_content_hash(const HashMarks *marks, size_t offset,
+                               ContentHash *hash) {
+  size_t kept = 0;
+  while (marks != NULL && kept < marks->length &&
+         marks->states[kept].total <= offset) {
+    kept++;
+  }
+  if (kept > 0) {
+    *hash = marks->states[kept - 1];
+  } else {
+    init_content_hash(hash);
+  }
+  HashMarks *resumed = create_hash_marks();
+  if (resumed == NULL || kept == 0) {
+    return resumed;
+  }
+  resumed->states = malloc(kept * sizeof(ContentHash));
+  if (resumed->states == NULL) {
+    free(resumed);
+    return NULL;
+  }
+  memcpy(resumed->states, marks->states, kept * sizeof(ContentHash));
+  resumed->length = kept;
+  resumed->capacity = kept;
+  return resumed;
+}
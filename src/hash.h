@@ -0,0 +1,34 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "main.h"
+
+typedef struct {
+  uint64_t lanes[4];
+  uint64_t total;
+  unsigned char stripe[32];
+  size_t stripe_length;
+} ContentHash;
+
+void init_content_hash(ContentHash *hash);
+
+void update_content_hash(ContentHash *hash, const void *data, size_t length);
+
+uint64_t finish_content_hash(const ContentHash *hash);
+
+uint64_t hash_content(const void *data, size_t length);
+
+HashMarks *create_hash_marks(void);
+
+void free_hash_marks(HashMarks *marks);
+
+void update_marked_hash(ContentHash *hash, HashMarks *marks, const void *data,
+                        size_t length);
+
+HashMarks *resume_content_hash(const HashMarks *marks, size_t offset,
+                               ContentHash *hash);
+
+#endif
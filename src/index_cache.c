@@ -0,0 +1,387 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index_cache.h"
+#include "line_index.h"
+
+#define INDEX_CACHE_THRESHOLD (64 * 1024 * 1024)
+#define INDEX_CACHE_LIMIT ((off_t)1024 * 1024 * 1024)
+#define INDEX_CACHE_MAGIC "EDLINES2"
+#define CHECK_SIZE 4096
+#define WRITE_BATCH 4096
+
+static char *cache_directory(void) {
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *format = "%s/editor/lines";
+  if (base == NULL || base[0] != '/') {
+    base = getenv("HOME");
+    format = "%s/.cache/editor/lines";
+  }
+  if (base == NULL) {
+    return NULL;
+  }
+
+  size_t length = strlen(base) + strlen(format);
+  char *path = malloc(length);
+  if (path == NULL) {
+    return NULL;
+  }
+  snprintf(path, length, format, base);
+
+  for (char *p = path + 1; *p != '\0'; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(path, 0700);
+      *p = '/';
+    }
+  }
+  mkdir(path, 0700);
+  return path;
+}
+
+static char *cache_path(uint64_t device, uint64_t inode) {
+  char *directory = cache_directory();
+  if (directory == NULL) {
+    return NULL;
+  }
+  size_t length = strlen(directory) + 40;
+  char *path = malloc(length);
+  if (path != NULL) {
+    snprintf(path, length, "%s/%llx-%llx", directory,
+             (unsigned long long)device, (unsigned long long)inode);
+  }
+  free(directory);
+  return path;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t prefix_check(const char *data, size_t indexed) {
+  size_t sample = indexed < CHECK_SIZE ? indexed : CHECK_SIZE;
+  uint64_t hash = hash_bytes(0xcbf29ce484222325ULL, data, sample);
+  return hash_bytes(hash, data + indexed - sample, sample);
+}
+
+static bool write_all(int fd, const void *data, size_t length) {
+  const char *p = data;
+  while (length > 0) {
+    ssize_t written = write(fd, p, length);
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    length -= written;
+  }
+  return true;
+}
+
+static bool cached_index_matches(const IndexCacheHeader *key,
+                                 const IndexCacheHeader *header,
+                                 size_t cache_length, const char *data) {
+  if (memcmp(header->magic, key->magic, sizeof(header->magic)) != 0 ||
+      header->device != key->device || header->inode != key->inode) {
+    return false;
+  }
+
+  size_t capacity = (cache_length - sizeof(IndexCacheHeader)) / sizeof(size_t);
+  if (header->n_lines == 0 || header->n_lines != capacity ||
+      cache_length != sizeof(IndexCacheHeader) + capacity * sizeof(size_t)) {
+    return false;
+  }
+
+  bool unchanged = header->size == key->size &&
+                   header->mtime_sec == key->mtime_sec &&
+                   header->mtime_nsec == key->mtime_nsec;
+  bool appended = header->size < key->size;
+  if (!unchanged && !appended) {
+    return false;
+  }
+
+  const size_t *ends = (const size_t *)(header + 1);
+  if (header->indexed > header->size ||
+      (ends[header->n_lines - 1] & ~LINE_END_CR) != header->indexed) {
+    return false;
+  }
+  return header->check == prefix_check(data, header->indexed);
+}
+
+static void map_cached_index(IndexCache *cache, const char *data) {
+  int fd = open(cache->path, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(IndexCacheHeader)) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+
+  const IndexCacheHeader *header = map;
+  if (!cached_index_matches(&cache->key, header, st.st_size, data)) {
+    munmap(map, st.st_size);
+    return;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  utimensat(AT_FDCWD, cache->path, NULL, 0);
+  cache->map = map;
+  cache->map_length = st.st_size;
+  cache->ends = (const size_t *)(header + 1);
+  cache->n_lines = header->n_lines;
+  cache->indexed = header->indexed;
+  cache->hashed = header->size == cache->key.size && header->hashed;
+  cache->content_hash = header->content_hash;
+}
+
+bool open_index_cache(IndexCache *cache, int fd, const char *data,
+                      size_t length) {
+  cache->path = NULL;
+  cache->temp_path = NULL;
+  cache->fd = -1;
+  cache->map = NULL;
+  cache->map_length = 0;
+  cache->ends = NULL;
+  cache->n_lines = 0;
+  cache->indexed = 0;
+  cache->written_lines = 0;
+  cache->written_end = 0;
+  cache->hashed = false;
+  cache->content_hash = 0;
+
+  struct stat st;
+  if (fd == -1 || length < INDEX_CACHE_THRESHOLD || fstat(fd, &st) == -1 ||
+      !S_ISREG(st.st_mode) || (size_t)st.st_size != length) {
+    return false;
+  }
+
+  memset(&cache->key, 0, sizeof(cache->key));
+  memcpy(cache->key.magic, INDEX_CACHE_MAGIC, sizeof(cache->key.magic));
+  cache->key.device = st.st_dev;
+  cache->key.inode = st.st_ino;
+  cache->key.size = length;
+  cache->key.mtime_sec = st.st_mtim.tv_sec;
+  cache->key.mtime_nsec = st.st_mtim.tv_nsec;
+
+  cache->path = cache_path(cache->key.device, cache->key.inode);
+  if (cache->path == NULL) {
+    return false;
+  }
+
+  map_cached_index(cache, data);
+  return true;
+}
+
+static void abandon_index_cache(IndexCache *cache) {
+  if (cache->fd != -1) {
+    close(cache->fd);
+    unlink(cache->temp_path);
+    cache->fd = -1;
+  }
+  free(cache->temp_path);
+  cache->temp_path = NULL;
+}
+
+bool begin_index_cache(IndexCache *cache) {
+  if (cache->path == NULL) {
+    return false;
+  }
+  size_t length = strlen(cache->path) + 8;
+  cache->temp_path = malloc(length);
+  if (cache->temp_path == NULL) {
+    return false;
+  }
+  snprintf(cache->temp_path, length, "%s.XXXXXX", cache->path);
+  cache->fd = mkstemp(cache->temp_path);
+  if (cache->fd == -1) {
+    abandon_index_cache(cache);
+    return false;
+  }
+
+  IndexCacheHeader header = {0};
+  if (!write_all(cache->fd, &header, sizeof(header))) {
+    abandon_index_cache(cache);
+    return false;
+  }
+  return true;
+}
+
+static bool flush_batch(IndexCache *cache, const size_t *batch, size_t used) {
+  if (used == 0) {
+    return true;
+  }
+  if (!write_all(cache->fd, batch, used * sizeof(size_t))) {
+    abandon_index_cache(cache);
+    return false;
+  }
+  cache->written_lines += used;
+  cache->written_end = batch[used - 1] & ~LINE_END_CR;
+  return true;
+}
+
+void write_index_cache(IndexCache *cache, const size_t *ends, size_t count,
+                       size_t base) {
+  if (cache->fd == -1) {
+    return;
+  }
+  size_t batch[WRITE_BATCH];
+  size_t used = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t end = base + ends[i];
+    if ((end & ~LINE_END_CR) > cache->key.size) {
+      break;
+    }
+    batch[used++] = end;
+    if (used == WRITE_BATCH) {
+      if (!flush_batch(cache, batch, used)) {
+        return;
+      }
+      used = 0;
+    }
+  }
+  flush_batch(cache, batch, used);
+}
+
+typedef struct {
+  char *name;
+  off_t size;
+  struct timespec used;
+} CacheEntry;
+
+static int compare_entries(const void *a, const void *b) {
+  const CacheEntry *x = a;
+  const CacheEntry *y = b;
+  if (x->used.tv_sec != y->used.tv_sec) {
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+  }
+  if (x->used.tv_nsec != y->used.tv_nsec) {
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+static void prune_index_cache(const char *keep) {
+  char *directory = cache_directory();
+  DIR *dir = directory != NULL ? opendir(directory) : NULL;
+  if (dir == NULL) {
+    free(directory);
+    return;
+  }
+  const char *keep_name = strrchr(keep, '/') + 1;
+  CacheEntry *entries = NULL;
+  size_t n_entries = 0;
+  size_t capacity = 0;
+  off_t total = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    struct stat st;
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    total += st.st_size;
+    if (strcmp(entry->d_name, keep_name) == 0) {
+      continue;
+    }
+    if (n_entries == capacity) {
+      size_t new_capacity = capacity == 0 ? 16 : capacity * 2;
+      CacheEntry *new_entries =
+          realloc(entries, new_capacity * sizeof(CacheEntry));
+      if (new_entries == NULL) {
+        break;
+      }
+      entries = new_entries;
+      capacity = new_capacity;
+    }
+    char *name = strdup(entry->d_name);
+    if (name == NULL) {
+      break;
+    }
+    entries[n_entries++] = (CacheEntry){name, st.st_size, st.st_mtim};
+  }
+
+  qsort(entries, n_entries, sizeof(CacheEntry), compare_entries);
+  for (size_t i = 0; i < n_entries; i++) {
+    if (total > INDEX_CACHE_LIMIT &&
+        unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+      total -= entries[i].size;
+    }
+    free(entries[i].name);
+  }
+  free(entries);
+  closedir(dir);
+  free(directory);
+}
+
+void commit_index_cache(IndexCache *cache, const char *data) {
+  if (cache->fd == -1) {
+    return;
+  }
+  if (cache->written_lines == 0) {
+    abandon_index_cache(cache);
+    return;
+  }
+
+  IndexCacheHeader header = cache->key;
+  header.n_lines = cache->written_lines;
+  header.indexed = cache->written_end;
+  header.check = prefix_check(data, cache->written_end);
+  header.hashed = cache->hashed;
+  header.content_hash = cache->content_hash;
+  if (pwrite(cache->fd, &header, sizeof(header), 0) != sizeof(header) ||
+      rename(cache->temp_path, cache->path) == -1) {
+    abandon_index_cache(cache);
+    return;
+  }
+  close(cache->fd);
+  cache->fd = -1;
+  free(cache->temp_path);
+  cache->temp_path = NULL;
+  prune_index_cache(cache->path);
+}
+
+void close_index_cache(IndexCache *cache) {
+  abandon_index_cache(cache);
+  if (cache->map != NULL) {
+    munmap(cache->map, cache->map_length);
+  }
+  cache->map = NULL;
+  cache->ends = NULL;
+  cache->n_lines = 0;
+  free(cache->path);
+  cache->path = NULL;
+}
+
+void forget_index_cache(const FileStamp *stamp) {
+  if (stamp->size < INDEX_CACHE_THRESHOLD) {
+    return;
+  }
+  char *path = cache_path(stamp->device, stamp->inode);
+  if (path != NULL) {
+    unlink(path);
+    free(path);
+  }
+}
+
+void remove_index_cache(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return;
+  }
+  FileStamp stamp = {.device = st.st_dev, .inode = st.st_ino,
+                     .size = st.st_size};
+  forget_index_cache(&stamp);
+}
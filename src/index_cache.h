@@ -0,0 +1,25 @@
+#ifndef INDEX_CACHE_H
+#define INDEX_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "main.h"
+
+bool open_index_cache(IndexCache *cache, int fd, const char *data,
+                      size_t length);
+
+bool begin_index_cache(IndexCache *cache);
+
+void write_index_cache(IndexCache *cache, const size_t *ends, size_t count,
+                       size_t base);
+
+void commit_index_cache(IndexCache *cache, const char *data);
+
+void close_index_cache(IndexCache *cache);
+
+void remove_index_cache(int fd);
+
+void forget_index_cache(const FileStamp *stamp);
+
+#endif
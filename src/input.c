@@ -3,10 +3,13 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "buffer.h"
 #include "draw.h"
 #include "input.h"
+#include "journal.h"
 #include "main.h"
 #include "mode_handlers.h"
+#include "save.h"
 
 #define MILLISECONDS 1000
 
@@ -53,7 +56,21 @@ void handle_input(Context *ctx) {
     }
   }
 
+  bool loaded = false;
+  for (size_t i = 0; i < ctx->n_buffers; i++) {
+    if (poll_buffer_load(ctx->buffers[i])) {
+      loaded = true;
+    }
+    if (poll_buffer_save(ctx->buffers[i])) {
+      loaded = true;
+    }
+    if (!got_input && flush_buffer_journal(ctx->buffers[i])) {
+      loaded = true;
+    }
+  }
+
   if (got_input) {
+    window->current_buffer->message[0] = '\0';
     if (ctx->mode == MODE_NORMAL) {
       handle_normal_mode(ctx, c);
     } else if (ctx->mode == MODE_COMMAND) {
@@ -68,6 +85,9 @@ void handle_input(Context *ctx) {
                ctx->mode == MODE_CHARACTERWISE_VISUAL) {
       handle_visual_mode(ctx, c);
     }
+  }
+
+  if (got_input || loaded) {
     draw_screen(window, width, height, ctx->mode, &ctx->selection,
                 ctx->command_buffer, ctx->command_buffer_length,
                 ctx->search_buffer, ctx->search_buffer_length,
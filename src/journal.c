@@ -0,0 +1,954 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "journal.h"
+#include "main.h"
+#include "undo.h"
+#include "undo_file.h"
+
+#define JOURNAL_MAGIC "EDJRNL03"
+#define JOURNAL_FLUSH_SIZE (1024 * 1024)
+#define COPY_BLOCK 65536
+#define EDIT_FIELDS 6
+
+typedef struct {
+  char magic[8];
+  int64_t pid;
+  uint64_t has_stamp;
+  FileStamp stamp;
+  uint64_t history;
+} JournalHeader;
+
+typedef struct {
+  uint64_t type;
+  uint64_t count;
+  uint64_t row;
+  uint64_t column;
+  uint64_t end_row;
+  uint64_t end_column;
+  uint64_t size;
+  uint64_t check;
+} JournalRecord;
+
+enum {
+  JOURNAL_INSERT = 1,
+  JOURNAL_DELETE,
+  JOURNAL_CHECKPOINT,
+  JOURNAL_UNDO,
+  JOURNAL_REPLACE,
+  JOURNAL_REDO,
+  JOURNAL_REBASE,
+  JOURNAL_EDIT,
+};
+
+static const char *const journal_suffixes[] = {"swp", "swo", "swn"};
+
+struct BufferJournal {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool started;
+  bool busy;
+  bool stopping;
+  atomic_bool failed;
+  bool reported;
+  bool abandoning;
+  char *path;
+  char *stale_path;
+  int fd;
+  JournalHeader header;
+  uint64_t file_start;
+  uint64_t file_end;
+  char *pending;
+  size_t pending_length;
+  size_t pending_capacity;
+  char *writing;
+  size_t writing_length;
+  size_t writing_capacity;
+  uint64_t appended;
+  size_t base;
+  size_t base_children;
+  bool marked;
+  bool marked_rebase;
+  size_t mark_nodes;
+  size_t mark_children;
+  bool rebase_wanted;
+  uint64_t rebase_mark;
+  JournalHeader rebase_header;
+  bool rebase;
+  uint64_t mark;
+  JournalHeader next_header;
+};
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t record_check(const JournalRecord *record, const char *payload) {
+  JournalRecord copy = *record;
+  copy.check = 0;
+  uint64_t hash = hash_bytes(0xcbf29ce484222325ULL, &copy, sizeof(copy));
+  return hash_bytes(hash, payload, record->size);
+}
+
+static bool write_all(int fd, const void *data, size_t length) {
+  const char *p = data;
+  while (length > 0) {
+    ssize_t written = write(fd, p, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    length -= written;
+  }
+  return true;
+}
+
+static char *journal_path(const char *name, const char *suffix) {
+  const char *base = strrchr(name, '/');
+  int directory = base != NULL ? (int)(base - name + 1) : 0;
+  base = base != NULL ? base + 1 : name;
+  size_t length = strlen(name) + strlen(suffix) + 3;
+  char *path = malloc(length);
+  if (path != NULL) {
+    snprintf(path, length, "%.*s.%s.%s", directory, name, base, suffix);
+  }
+  return path;
+}
+
+static const char *base_name(const char *path) {
+  const char *base = strrchr(path, '/');
+  return base != NULL ? base + 1 : path;
+}
+
+static bool read_header(const char *path, JournalHeader *header) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  ssize_t length = read(fd, header, sizeof(*header));
+  close(fd);
+  return length == sizeof(*header) &&
+         memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) == 0;
+}
+
+static bool owner_running(const JournalHeader *header) {
+  return header->pid != getpid() &&
+         (kill((pid_t)header->pid, 0) == 0 || errno == EPERM);
+}
+
+static void baseline_header(Buffer *buffer, JournalHeader *header) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+  header->pid = getpid();
+  header->has_stamp = buffer->disk_known;
+  if (buffer->disk_known) {
+    header->stamp = buffer->disk_stamp;
+  }
+}
+
+static bool header_matches(Buffer *buffer, const JournalHeader *header) {
+  if (!header->has_stamp) {
+    return !buffer->disk_known && buffer->map_length == 0;
+  }
+  return buffer->disk_known && same_stamp(&header->stamp, &buffer->disk_stamp);
+}
+
+static void find_journal(Buffer *buffer, BufferJournal *journal) {
+  size_t n_suffixes = sizeof(journal_suffixes) / sizeof(journal_suffixes[0]);
+  for (size_t i = 0; i < n_suffixes; i++) {
+    char *path = journal_path(buffer->file.name, journal_suffixes[i]);
+    if (path == NULL) {
+      return;
+    }
+    struct stat st;
+    JournalHeader header;
+    if (lstat(path, &st) == -1 && errno == ENOENT) {
+      if (journal->path == NULL) {
+        journal->path = path;
+        continue;
+      }
+    } else if (journal->stale_path == NULL && read_header(path, &header) &&
+               !owner_running(&header)) {
+      if (header_matches(buffer, &header)) {
+        journal->stale_path = path;
+        snprintf(buffer->message, sizeof(buffer->message),
+                 "found swap journal %s, :recover or :discard",
+                 base_name(path));
+        continue;
+      }
+      snprintf(buffer->message, sizeof(buffer->message),
+               "swap journal %s is for another version of the file",
+               base_name(path));
+    }
+    free(path);
+  }
+}
+
+void open_buffer_journal(Buffer *buffer) {
+  buffer->journal = NULL;
+  if (buffer->read_only) {
+    return;
+  }
+  BufferJournal *journal = calloc(1, sizeof(BufferJournal));
+  if (journal == NULL) {
+    return;
+  }
+  journal->fd = -1;
+  atomic_init(&journal->failed, false);
+  baseline_header(buffer, &journal->header);
+  find_journal(buffer, journal);
+  if (journal->path == NULL) {
+    free(journal->stale_path);
+    free(journal);
+    return;
+  }
+  pthread_mutex_init(&journal->mutex, NULL);
+  pthread_cond_init(&journal->cond, NULL);
+  buffer->journal = journal;
+}
+
+static void abandon_journal_file(BufferJournal *journal) {
+  atomic_store(&journal->failed, true);
+  if (journal->fd != -1) {
+    close(journal->fd);
+    unlink(journal->path);
+    journal->fd = -1;
+  }
+}
+
+static bool write_batch(BufferJournal *journal) {
+  if (journal->writing_length == 0) {
+    return true;
+  }
+  if (journal->fd == -1) {
+    journal->fd =
+        open(journal->path, O_RDWR | O_CREAT | O_EXCL | O_APPEND, 0600);
+    if (journal->fd == -1) {
+      return false;
+    }
+    journal->file_start = journal->file_end;
+    if (!write_all(journal->fd, &journal->header, sizeof(journal->header))) {
+      return false;
+    }
+  }
+  if (!write_all(journal->fd, journal->writing, journal->writing_length)) {
+    return false;
+  }
+  journal->file_end += journal->writing_length;
+  return fdatasync(journal->fd) == 0;
+}
+
+static bool copy_tail(BufferJournal *journal, int fd) {
+  char block[COPY_BLOCK];
+  off_t offset = sizeof(JournalHeader) + journal->mark - journal->file_start;
+  off_t end = sizeof(JournalHeader) + journal->file_end - journal->file_start;
+  while (offset < end) {
+    size_t wanted = end - offset < COPY_BLOCK ? end - offset : COPY_BLOCK;
+    ssize_t length = pread(journal->fd, block, wanted, offset);
+    if (length < 0 && errno == EINTR) {
+      continue;
+    }
+    if (length <= 0 || !write_all(fd, block, length)) {
+      return false;
+    }
+    offset += length;
+  }
+  return true;
+}
+
+static bool rebase_file(BufferJournal *journal) {
+  journal->header = journal->next_header;
+  if (journal->fd == -1 || journal->mark >= journal->file_end) {
+    if (journal->fd != -1) {
+      close(journal->fd);
+      unlink(journal->path);
+      journal->fd = -1;
+    }
+    journal->file_start = journal->file_end;
+    return true;
+  }
+
+  size_t length = strlen(journal->path) + 8;
+  char *temp_path = malloc(length);
+  if (temp_path == NULL) {
+    return false;
+  }
+  snprintf(temp_path, length, "%s.XXXXXX", journal->path);
+  int fd = mkstemp(temp_path);
+  if (fd == -1) {
+    free(temp_path);
+    return false;
+  }
+  bool copied = write_all(fd, &journal->header, sizeof(journal->header)) &&
+                copy_tail(journal, fd) && fdatasync(fd) == 0 &&
+                rename(temp_path, journal->path) == 0;
+  if (!copied) {
+    close(fd);
+    unlink(temp_path);
+    free(temp_path);
+    return false;
+  }
+  free(temp_path);
+  close(journal->fd);
+  journal->fd = fd;
+  journal->file_start = journal->mark;
+  return true;
+}
+
+static void *write_in_background(void *arg) {
+  BufferJournal *journal = arg;
+  pthread_mutex_lock(&journal->mutex);
+  while (true) {
+    while (!journal->busy && !journal->stopping) {
+      pthread_cond_wait(&journal->cond, &journal->mutex);
+    }
+    if (!journal->busy) {
+      break;
+    }
+    pthread_mutex_unlock(&journal->mutex);
+
+    bool written = !atomic_load(&journal->failed) && write_batch(journal) &&
+                   (!journal->rebase || rebase_file(journal));
+    if (!written || atomic_load(&journal->failed)) {
+      abandon_journal_file(journal);
+    }
+
+    pthread_mutex_lock(&journal->mutex);
+    journal->busy = false;
+    journal->writing_length = 0;
+    journal->rebase = false;
+    pthread_cond_broadcast(&journal->cond);
+  }
+  pthread_mutex_unlock(&journal->mutex);
+  return NULL;
+}
+
+static bool start_journal_thread(BufferJournal *journal) {
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  journal->started = pthread_create(&journal->thread, NULL,
+                                    write_in_background, journal) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return journal->started;
+}
+
+void close_buffer_journal(Buffer *buffer) {
+  BufferJournal *journal = buffer->journal;
+  if (journal == NULL) {
+    return;
+  }
+  if (journal->started) {
+    pthread_mutex_lock(&journal->mutex);
+    journal->stopping = true;
+    pthread_cond_broadcast(&journal->cond);
+    pthread_mutex_unlock(&journal->mutex);
+    pthread_join(journal->thread, NULL);
+  }
+  if (journal->fd != -1) {
+    close(journal->fd);
+    unlink(journal->path);
+  }
+  pthread_mutex_destroy(&journal->mutex);
+  pthread_cond_destroy(&journal->cond);
+  free(journal->pending);
+  free(journal->writing);
+  free(journal->path);
+  free(journal->stale_path);
+  free(journal);
+  buffer->journal = NULL;
+}
+
+bool flush_buffer_journal(Buffer *buffer) {
+  BufferJournal *journal = buffer->journal;
+  if (journal == NULL) {
+    return false;
+  }
+  bool failed = atomic_load(&journal->failed);
+  bool posted = false;
+  if (failed && !journal->reported) {
+    journal->reported = true;
+    snprintf(buffer->message, sizeof(buffer->message),
+             "swap journal disabled");
+    posted = true;
+  }
+  if (failed ? !journal->started || journal->abandoning
+             : journal->pending_length == 0 && !journal->rebase_wanted) {
+    return posted;
+  }
+  if (!journal->started && !start_journal_thread(journal)) {
+    atomic_store(&journal->failed, true);
+    return posted;
+  }
+
+  pthread_mutex_lock(&journal->mutex);
+  if (!journal->busy) {
+    journal->abandoning = failed;
+    char *data = journal->writing;
+    size_t capacity = journal->writing_capacity;
+    journal->writing = journal->pending;
+    journal->writing_capacity = journal->pending_capacity;
+    journal->writing_length = journal->pending_length;
+    journal->pending = data;
+    journal->pending_capacity = capacity;
+    journal->pending_length = 0;
+
+    journal->rebase = journal->rebase_wanted;
+    journal->mark = journal->rebase_mark;
+    journal->next_header = journal->rebase_header;
+    journal->rebase_wanted = false;
+    journal->busy = true;
+    pthread_cond_broadcast(&journal->cond);
+  }
+  pthread_mutex_unlock(&journal->mutex);
+  return posted;
+}
+
+static bool reserve_pending(BufferJournal *journal, size_t extra) {
+  size_t needed = journal->pending_length + extra;
+  if (needed <= journal->pending_capacity) {
+    return true;
+  }
+  size_t capacity =
+      journal->pending_capacity == 0 ? 4096 : journal->pending_capacity;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+  char *pending = realloc(journal->pending, capacity);
+  if (pending == NULL) {
+    return false;
+  }
+  journal->pending = pending;
+  journal->pending_capacity = capacity;
+  return true;
+}
+
+static char *put_line(char *p, Line line) {
+  uint64_t length = line.length;
+  memcpy(p, &length, sizeof(length));
+  p += sizeof(length);
+  if (length > 0) {
+    memcpy(p, line.data, length);
+  }
+  return p + length;
+}
+
+static char *reserve_record(BufferJournal *journal, JournalRecord *record) {
+  if (journal == NULL || atomic_load(&journal->failed)) {
+    return NULL;
+  }
+  if (!reserve_pending(journal, sizeof(*record) + record->size)) {
+    atomic_store(&journal->failed, true);
+    free(journal->pending);
+    journal->pending = NULL;
+    journal->pending_length = 0;
+    journal->pending_capacity = 0;
+    return NULL;
+  }
+  return journal->pending + journal->pending_length + sizeof(*record);
+}
+
+static void commit_record(Buffer *buffer, JournalRecord *record,
+                          const char *payload) {
+  BufferJournal *journal = buffer->journal;
+  record->check = record_check(record, payload);
+  memcpy(journal->pending + journal->pending_length, record, sizeof(*record));
+  journal->pending_length += sizeof(*record) + record->size;
+  journal->appended += sizeof(*record) + record->size;
+
+  if (journal->pending_length >= JOURNAL_FLUSH_SIZE) {
+    flush_buffer_journal(buffer);
+  }
+}
+
+static void append_record(Buffer *buffer, JournalRecord *record) {
+  char *payload = reserve_record(buffer->journal, record);
+  if (payload != NULL) {
+    commit_record(buffer, record, payload);
+  }
+}
+
+void journal_insert(Buffer *buffer, size_t row, size_t col, const Line *text,
+                    size_t count) {
+  JournalRecord record = {.type = JOURNAL_INSERT, .count = count,
+                          .row = row, .column = col};
+  for (size_t i = 0; i < count; i++) {
+    record.size += sizeof(uint64_t) + text[i].length;
+  }
+  char *payload = reserve_record(buffer->journal, &record);
+  if (payload == NULL) {
+    return;
+  }
+  char *p = payload;
+  for (size_t i = 0; i < count; i++) {
+    p = put_line(p, text[i]);
+  }
+  commit_record(buffer, &record, payload);
+}
+
+void journal_delete(Buffer *buffer, size_t start_row, size_t start_col,
+                    size_t end_row, size_t end_col) {
+  JournalRecord record = {.type = JOURNAL_DELETE, .row = start_row,
+                          .column = start_col, .end_row = end_row,
+                          .end_column = end_col};
+  append_record(buffer, &record);
+}
+
+void journal_edit(Buffer *buffer, const EditOp *ops, size_t n_ops,
+                  const Line *lines) {
+  JournalRecord record = {.type = JOURNAL_EDIT, .count = n_ops,
+                          .row = ops[0].row};
+  for (size_t i = 0; i < n_ops; i++) {
+    record.size += EDIT_FIELDS * sizeof(uint64_t);
+    for (size_t j = 0; ops[i].insert && j < ops[i].count; j++) {
+      record.size += sizeof(uint64_t) + lines[ops[i].first + j].length;
+    }
+  }
+  char *payload = reserve_record(buffer->journal, &record);
+  if (payload == NULL) {
+    return;
+  }
+  char *p = payload;
+  for (size_t i = 0; i < n_ops; i++) {
+    const EditOp *op = &ops[i];
+    uint64_t fields[EDIT_FIELDS] = {op->insert, op->row, op->column,
+                                    op->end_row, op->end_column,
+                                    op->insert ? op->count : 0};
+    memcpy(p, fields, sizeof(fields));
+    p += sizeof(fields);
+    for (size_t j = 0; op->insert && j < op->count; j++) {
+      p = put_line(p, lines[op->first + j]);
+    }
+  }
+  commit_record(buffer, &record, payload);
+}
+
+void journal_checkpoint(Buffer *buffer) {
+  if (buffer->journal == NULL) {
+    return;
+  }
+  JournalRecord record = {.type = JOURNAL_CHECKPOINT};
+  append_record(buffer, &record);
+}
+
+static void rebase_undo(BufferJournal *journal, const UndoTree *tree) {
+  journal->base = tree->n_nodes;
+  journal->base_children =
+      tree->n_nodes > 0 ? tree->nodes[tree->current].children : 0;
+}
+
+bool journal_follows_node(Buffer *buffer, size_t node) {
+  BufferJournal *journal = buffer->journal;
+  return journal == NULL || (!journal->marked && node >= journal->base);
+}
+
+void journal_replace(Buffer *buffer, size_t row, size_t removed,
+                     size_t inserted) {
+  if (buffer->journal == NULL) {
+    return;
+  }
+  JournalRecord record = {.type = JOURNAL_REPLACE, .count = inserted,
+                          .row = row, .end_row = row + removed};
+  LineIterator iterator;
+  Line line;
+  buffer_iterate(buffer, row, &iterator);
+  for (size_t i = 0; i < inserted && buffer_next_line(&iterator, &line);
+       i++) {
+    record.size += sizeof(uint64_t) + line.length;
+  }
+  char *payload = reserve_record(buffer->journal, &record);
+  if (payload == NULL) {
+    return;
+  }
+  char *p = payload;
+  buffer_iterate(buffer, row, &iterator);
+  for (size_t i = 0; i < inserted && buffer_next_line(&iterator, &line);
+       i++) {
+    p = put_line(p, line);
+  }
+  commit_record(buffer, &record, payload);
+}
+
+void journal_undo(Buffer *buffer) {
+  if (buffer->journal == NULL) {
+    return;
+  }
+  JournalRecord record = {.type = JOURNAL_UNDO};
+  append_record(buffer, &record);
+}
+
+void journal_redo(Buffer *buffer) {
+  BufferJournal *journal = buffer->journal;
+  if (journal == NULL) {
+    return;
+  }
+  UndoNode *node = &buffer->undo.nodes[buffer->undo.current];
+  size_t skipped = node->parent < journal->base ? journal->base_children : 0;
+  JournalRecord record = {.type = JOURNAL_REDO,
+                          .count = node->branch - skipped};
+  append_record(buffer, &record);
+}
+
+void journal_history_loaded(Buffer *buffer) {
+  BufferJournal *journal = buffer->journal;
+  if (journal == NULL) {
+    return;
+  }
+  if (journal->appended > 0 || journal->marked) {
+    rebase_undo(journal, &buffer->undo);
+    journal->marked_rebase = journal->marked;
+    return;
+  }
+  journal->header.history = buffer->undo.n_nodes;
+  journal->base = 0;
+  journal->base_children = 0;
+}
+
+void journal_history_dropped(Buffer *buffer) {
+  BufferJournal *journal = buffer->journal;
+  if (journal == NULL) {
+    return;
+  }
+  JournalRecord record = {.type = JOURNAL_REBASE,
+                          .row = buffer->undo.n_nodes};
+  append_record(buffer, &record);
+  rebase_undo(journal, &buffer->undo);
+  journal->marked_rebase = journal->marked;
+}
+
+uint64_t mark_buffer_journal(Buffer *buffer) {
+  BufferJournal *journal = buffer->journal;
+  if (journal == NULL) {
+    return 0;
+  }
+  const UndoTree *tree = &buffer->undo;
+  journal->marked = true;
+  journal->marked_rebase = false;
+  journal->mark_nodes = tree->n_nodes;
+  journal->mark_children =
+      tree->n_nodes > 0 ? tree->nodes[tree->current].children : 0;
+  return journal->appended;
+}
+
+void unmark_buffer_journal(Buffer *buffer) {
+  if (buffer->journal != NULL) {
+    buffer->journal->marked = false;
+  }
+}
+
+void rebase_buffer_journal(Buffer *buffer, uint64_t mark, size_t history) {
+  BufferJournal *journal = buffer->journal;
+  if (journal == NULL) {
+    return;
+  }
+  journal->marked = false;
+  if (!journal->marked_rebase) {
+    journal->base = history > 0 ? 0 : journal->mark_nodes;
+    journal->base_children = history > 0 ? 0 : journal->mark_children;
+  }
+  journal->rebase_wanted = true;
+  journal->rebase_mark = mark;
+  baseline_header(buffer, &journal->rebase_header);
+  journal->rebase_header.history = history;
+  flush_buffer_journal(buffer);
+}
+
+static bool read_journal(const char *path, char **data, size_t *length) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  *data = NULL;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(JournalHeader)) {
+    *data = malloc(st.st_size);
+  }
+  size_t size = 0;
+  while (*data != NULL && size < (size_t)st.st_size) {
+    ssize_t bytes_read = read(fd, *data + size, st.st_size - size);
+    if (bytes_read <= 0) {
+      break;
+    }
+    size += bytes_read;
+  }
+  close(fd);
+  *length = size;
+  return *data != NULL;
+}
+
+static const char *take_line(const char *p, const char *end, Line *line) {
+  uint64_t length;
+  if ((size_t)(end - p) < sizeof(length)) {
+    return NULL;
+  }
+  memcpy(&length, p, sizeof(length));
+  p += sizeof(length);
+  if (length > (size_t)(end - p)) {
+    return NULL;
+  }
+  *line = (Line){.data = (char *)p, .length = length};
+  return p + length;
+}
+
+static Line *read_lines(const JournalRecord *record, const char *payload) {
+  if (record->count > record->size / sizeof(uint64_t)) {
+    return NULL;
+  }
+  Line *lines = malloc((record->count + 1) * sizeof(Line));
+  if (lines == NULL) {
+    return NULL;
+  }
+  const char *p = payload;
+  const char *end = payload + record->size;
+  for (size_t i = 0; i < record->count; i++) {
+    p = take_line(p, end, &lines[i]);
+    if (p == NULL) {
+      free(lines);
+      return NULL;
+    }
+  }
+  return lines;
+}
+
+static bool replay_lines(Buffer *buffer, const JournalRecord *record,
+                         const char *payload) {
+  Line *lines = read_lines(record, payload);
+  if (lines == NULL) {
+    return false;
+  }
+  buffer_insert(buffer, record->row, record->column, lines, record->count);
+  free(lines);
+  return true;
+}
+
+static void remove_rows(Buffer *buffer, size_t row, size_t end_row) {
+  size_t last = buffer_line_count(buffer) - 1;
+  if (end_row <= last) {
+    buffer_delete(buffer, row, 0, end_row, 0);
+  } else if (row > 0) {
+    buffer_delete(buffer, row - 1, buffer_line_length(buffer, row - 1), last,
+                  buffer_line_length(buffer, last));
+  } else {
+    buffer_delete(buffer, 0, 0, last, buffer_line_length(buffer, last));
+  }
+}
+
+static void insert_rows(Buffer *buffer, size_t row, Line *lines,
+                        size_t count) {
+  size_t n_lines = buffer_line_count(buffer);
+  if (row < n_lines) {
+    lines[count] = (Line){NULL, 0};
+    buffer_insert(buffer, row, 0, lines, count + 1);
+    return;
+  }
+  memmove(lines + 1, lines, count * sizeof(Line));
+  lines[0] = (Line){NULL, 0};
+  buffer_insert(buffer, n_lines - 1, buffer_line_length(buffer, n_lines - 1),
+                lines, count + 1);
+}
+
+static bool replay_replace(Buffer *buffer, const JournalRecord *record,
+                           const char *payload) {
+  size_t n_lines = buffer_line_count(buffer);
+  if (record->row > n_lines || record->end_row < record->row ||
+      record->end_row > n_lines) {
+    return false;
+  }
+  Line *lines = read_lines(record, payload);
+  if (lines == NULL) {
+    return false;
+  }
+  if (record->end_row > record->row && record->count > 0) {
+    size_t last = record->end_row - 1;
+    buffer_delete(buffer, record->row, 0, last,
+                  buffer_line_length(buffer, last));
+    buffer_insert(buffer, record->row, 0, lines, record->count);
+  } else if (record->end_row > record->row) {
+    remove_rows(buffer, record->row, record->end_row);
+  } else if (record->count > 0) {
+    insert_rows(buffer, record->row, lines, record->count);
+  }
+  free(lines);
+  return true;
+}
+
+static bool replay_edit(Buffer *buffer, const JournalRecord *record,
+                        const char *payload) {
+  size_t op_size = EDIT_FIELDS * sizeof(uint64_t);
+  if (record->count == 0 || record->count > record->size / op_size) {
+    return false;
+  }
+  EditOp *ops = malloc(record->count * sizeof(EditOp));
+  Line *lines = malloc(record->size / sizeof(uint64_t) * sizeof(Line));
+  const char *p = payload;
+  const char *end = payload + record->size;
+  size_t n_lines = 0;
+  bool ok = ops != NULL && lines != NULL;
+  for (size_t i = 0; ok && i < record->count; i++) {
+    uint64_t fields[EDIT_FIELDS];
+    if ((size_t)(end - p) < sizeof(fields)) {
+      ok = false;
+      break;
+    }
+    memcpy(fields, p, sizeof(fields));
+    p += sizeof(fields);
+    ops[i] = (EditOp){.insert = fields[0] != 0, .row = fields[1],
+                      .column = fields[2], .end_row = fields[3],
+                      .end_column = fields[4], .first = n_lines,
+                      .count = fields[5]};
+    for (size_t j = 0; ok && ops[i].insert && j < ops[i].count; j++) {
+      p = take_line(p, end, &lines[n_lines++]);
+      ok = p != NULL;
+    }
+  }
+  if (ok) {
+    buffer_apply_edit(buffer, ops, record->count, lines);
+  }
+  free(ops);
+  free(lines);
+  return ok;
+}
+
+static bool replay_record(Context *ctx, Buffer *buffer,
+                          const JournalRecord *record, const char *payload,
+                          size_t *checkpoints) {
+  switch (record->type) {
+  case JOURNAL_INSERT:
+    return replay_lines(buffer, record, payload);
+  case JOURNAL_REPLACE:
+    return replay_replace(buffer, record, payload);
+  case JOURNAL_EDIT:
+    return replay_edit(buffer, record, payload);
+  case JOURNAL_REBASE:
+    free_undo_tree(&buffer->undo);
+    *checkpoints = 0;
+    return true;
+  case JOURNAL_DELETE:
+    buffer_delete(buffer, record->row, record->column, record->end_row,
+                  record->end_column);
+    return true;
+  case JOURNAL_CHECKPOINT:
+    push_undo_state(ctx);
+    (*checkpoints)++;
+    return true;
+  case JOURNAL_UNDO:
+    if (*checkpoints == 0) {
+      return false;
+    }
+    undo(ctx);
+    (*checkpoints)--;
+    return true;
+  case JOURNAL_REDO:
+    if (!redo_branch(ctx, record->count)) {
+      return false;
+    }
+    (*checkpoints)++;
+    return true;
+  }
+  return false;
+}
+
+bool recover_buffer_journal(Context *ctx) {
+  Window *window = ctx->windows[ctx->current_window];
+  Buffer *buffer = window->current_buffer;
+  BufferJournal *journal = buffer->journal;
+  char *message = buffer->message;
+  size_t size = sizeof(buffer->message);
+  if (journal == NULL || journal->stale_path == NULL) {
+    snprintf(message, size, "no swap journal to recover");
+    return false;
+  }
+  if (journal->appended > 0) {
+    snprintf(message, size, "buffer changed since it was opened");
+    return false;
+  }
+
+  char *data;
+  size_t length;
+  JournalHeader header;
+  if (!read_journal(journal->stale_path, &data, &length)) {
+    snprintf(message, size, "cannot read %s",
+             base_name(journal->stale_path));
+    return false;
+  }
+  if (length < sizeof(header)) {
+    length = 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+      !header_matches(buffer, &header)) {
+    free(data);
+    snprintf(message, size, "swap journal no longer matches the file");
+    return false;
+  }
+
+  wait_for_buffer_load(buffer);
+  free_undo_tree(&buffer->undo);
+  buffer->undo_loaded = header.history == 0;
+  load_undo_file(buffer);
+  size_t offset = sizeof(header);
+  size_t replayed = 0;
+  UndoTree *tree = &buffer->undo;
+  size_t checkpoints =
+      tree->n_nodes > 0 ? tree->nodes[tree->current].depth : 0;
+  JournalRecord record;
+  while (length - offset >= sizeof(record)) {
+    memcpy(&record, data + offset, sizeof(record));
+    const char *payload = data + offset + sizeof(record);
+    if (record.size > length - offset - sizeof(record) ||
+        record.check != record_check(&record, payload) ||
+        !replay_record(ctx, buffer, &record, payload, &checkpoints)) {
+      break;
+    }
+    offset += sizeof(record) + record.size;
+    replayed++;
+    if (record.type == JOURNAL_INSERT || record.type == JOURNAL_DELETE ||
+        record.type == JOURNAL_EDIT) {
+      window->cursor.row = record.row + 1;
+      window->cursor.column = 1;
+    }
+  }
+  free(data);
+
+  size_t n_lines = buffer_line_count(buffer);
+  if (window->cursor.row > n_lines) {
+    window->cursor.row = n_lines > 0 ? n_lines : 1;
+  }
+  unlink(journal->stale_path);
+  snprintf(message, size, "recovered %zu changes from %s", replayed,
+           base_name(journal->stale_path));
+  free(journal->stale_path);
+  journal->stale_path = NULL;
+  return true;
+}
+
+void discard_buffer_journal(Buffer *buffer) {
+  BufferJournal *journal = buffer->journal;
+  if (journal == NULL || journal->stale_path == NULL) {
+    snprintf(buffer->message, sizeof(buffer->message),
+             "no swap journal to discard");
+    return;
+  }
+  unlink(journal->stale_path);
+  snprintf(buffer->message, sizeof(buffer->message),
+           "discarded swap journal %s", base_name(journal->stale_path));
+  free(journal->stale_path);
+  journal->stale_path = NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "main.h"
+
+void open_buffer_journal(Buffer *buffer);
+
+void close_buffer_journal(Buffer *buffer);
+
+void journal_insert(Buffer *buffer, size_t row, size_t col, const Line *text,
+                    size_t count);
+
+void journal_delete(Buffer *buffer, size_t start_row, size_t start_col,
+                    size_t end_row, size_t end_col);
+
+void journal_edit(Buffer *buffer, const EditOp *ops, size_t n_ops,
+                  const Line *lines);
+
+void journal_checkpoint(Buffer *buffer);
+
+bool journal_follows_node(Buffer *buffer, size_t node);
+
+void journal_replace(Buffer *buffer, size_t row, size_t removed,
+                     size_t inserted);
+
+void journal_undo(Buffer *buffer);
+
+void journal_redo(Buffer *buffer);
+
+bool flush_buffer_journal(Buffer *buffer);
+
+void journal_history_loaded(Buffer *buffer);
+
+void journal_history_dropped(Buffer *buffer);
+
+uint64_t mark_buffer_journal(Buffer *buffer);
+
+void unmark_buffer_journal(Buffer *buffer);
+
+void rebase_buffer_journal(Buffer *buffer, uint64_t mark, size_t history);
+
+bool recover_buffer_journal(Context *ctx);
+
+void discard_buffer_journal(Buffer *buffer);
+
+#endif
@@ -0,0 +1,246 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "line_index.h"
+
+#define PARALLEL_THRESHOLD (8 * 1024 * 1024)
+#define MAX_WORKERS 8
+
+typedef struct {
+  size_t (*count)(const char *data, size_t length);
+  size_t *(*fill)(const char *data, size_t begin, size_t end, size_t *out,
+                  size_t *limit);
+} IndexKernels;
+
+typedef struct {
+  const char *data;
+  size_t begin;
+  size_t end;
+  size_t count;
+  size_t *out;
+  size_t filled;
+  const IndexKernels *kernels;
+} IndexChunk;
+
+static size_t count_newlines_scalar(const char *data, size_t length) {
+  size_t count = 0;
+  const char *p = data;
+  const char *end = data + length;
+  while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+    count++;
+    p++;
+  }
+  return count;
+}
+
+static size_t line_end(const char *data, size_t newline) {
+  return (newline + 1) |
+         (newline > 0 && data[newline - 1] == '\r' ? LINE_END_CR : 0);
+}
+
+static size_t *fill_lines_scalar(const char *data, size_t begin, size_t end,
+                                 size_t *out, size_t *limit) {
+  const char *p = data + begin;
+  const char *stop = data + end;
+  while (p < stop && (p = memchr(p, '\n', stop - p)) != NULL) {
+    if (out == limit) {
+      return out + 1;
+    }
+    *out++ = line_end(data, p - data);
+    p++;
+  }
+  return out;
+}
+
+#ifdef __SSE2__
+static size_t count_newlines_sse2(const char *data, size_t length) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+    count += __builtin_popcount(mask);
+  }
+  return count + count_newlines_scalar(data + i, length - i);
+}
+
+static size_t *fill_lines_sse2(const char *data, size_t begin, size_t end,
+                               size_t *out, size_t *limit) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t i = begin;
+  for (; i + 16 <= end; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+    for (; mask != 0 && out < limit; mask &= mask - 1) {
+      *out++ = line_end(data, i + __builtin_ctz(mask));
+    }
+    if (mask != 0) {
+      return out + 1;
+    }
+  }
+  return fill_lines_scalar(data, i, end, out, limit);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static size_t
+count_newlines_avx2(const char *data, size_t length) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+    unsigned mask_a = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, newline));
+    unsigned mask_b = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, newline));
+    count += __builtin_popcount(mask_a) + __builtin_popcount(mask_b);
+  }
+  return count + count_newlines_scalar(data + i, length - i);
+}
+
+__attribute__((target("avx2"))) static size_t *
+fill_lines_avx2(const char *data, size_t begin, size_t end, size_t *out,
+                size_t *limit) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t i = begin;
+  for (; i + 32 <= end; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+    for (; mask != 0 && out < limit; mask &= mask - 1) {
+      *out++ = line_end(data, i + __builtin_ctz(mask));
+    }
+    if (mask != 0) {
+      return out + 1;
+    }
+  }
+  return fill_lines_scalar(data, i, end, out, limit);
+}
+#endif
+
+static IndexKernels select_kernels(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) {
+    return (IndexKernels){count_newlines_avx2, fill_lines_avx2};
+  }
+#endif
+#ifdef __SSE2__
+  return (IndexKernels){count_newlines_sse2, fill_lines_sse2};
+#else
+  return (IndexKernels){count_newlines_scalar, fill_lines_scalar};
+#endif
+}
+
+static size_t choose_worker_count(size_t length) {
+  if (length < PARALLEL_THRESHOLD) {
+    return 1;
+  }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = cpus > 0 ? (size_t)cpus : 1;
+  if (workers > MAX_WORKERS) {
+    workers = MAX_WORKERS;
+  }
+  if (workers > length / (PARALLEL_THRESHOLD / 2)) {
+    workers = length / (PARALLEL_THRESHOLD / 2);
+  }
+  return workers > 0 ? workers : 1;
+}
+
+static void *count_chunk(void *arg) {
+  IndexChunk *chunk = arg;
+  chunk->count = chunk->kernels->count(chunk->data + chunk->begin,
+                                       chunk->end - chunk->begin);
+  return NULL;
+}
+
+static void *fill_chunk(void *arg) {
+  IndexChunk *chunk = arg;
+  size_t *limit = chunk->out + chunk->count;
+  size_t *out = chunk->kernels->fill(chunk->data, chunk->begin, chunk->end,
+                                     chunk->out, limit);
+  chunk->filled = out - chunk->out;
+  return NULL;
+}
+
+static void run_chunks(IndexChunk *chunks, size_t n_chunks,
+                       void *(*work)(void *)) {
+  pthread_t threads[MAX_WORKERS];
+  bool started[MAX_WORKERS] = {false};
+
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for (size_t i = 1; i < n_chunks; i++) {
+    started[i] = pthread_create(&threads[i], NULL, work, &chunks[i]) == 0;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  work(&chunks[0]);
+  for (size_t i = 1; i < n_chunks; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      work(&chunks[i]);
+    }
+  }
+}
+
+bool build_line_index(const char *data, size_t length, size_t **ends,
+                      size_t *n_lines) {
+  IndexKernels kernels = select_kernels();
+  size_t n_chunks = choose_worker_count(length);
+  IndexChunk chunks[MAX_WORKERS];
+
+  size_t chunk_size = length / n_chunks;
+  for (size_t i = 0; i < n_chunks; i++) {
+    chunks[i].data = data;
+    chunks[i].begin = i * chunk_size;
+    chunks[i].end = i + 1 == n_chunks ? length : (i + 1) * chunk_size;
+    chunks[i].kernels = &kernels;
+  }
+
+  run_chunks(chunks, n_chunks, count_chunk);
+
+  size_t total = 0;
+  for (size_t i = 0; i < n_chunks; i++) {
+    total += chunks[i].count;
+  }
+  bool has_tail = length == 0 || data[length - 1] != '\n';
+  size_t count = total + (has_tail ? 1 : 0);
+
+  size_t *result = malloc(count * sizeof(size_t));
+  if (result == NULL) {
+    return false;
+  }
+
+  size_t *out = result;
+  for (size_t i = 0; i < n_chunks; i++) {
+    chunks[i].out = out;
+    out += chunks[i].count;
+  }
+
+  run_chunks(chunks, n_chunks, fill_chunk);
+
+  bool changed = has_tail != (length == 0 || data[length - 1] != '\n');
+  for (size_t i = 0; i < n_chunks; i++) {
+    changed = changed || chunks[i].filled != chunks[i].count;
+  }
+  if (changed) {
+    free(result);
+    return false;
+  }
+
+  if (has_tail) {
+    *out = line_end(data, length);
+  }
+
+  *ends = result;
+  *n_lines = count;
+  return true;
+}
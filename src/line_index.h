@@ -0,0 +1,12 @@
+#ifndef LINE_INDEX_H
+#define LINE_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LINE_END_CR ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+bool build_line_index(const char *data, size_t length, size_t **ends,
+                      size_t *n_lines);
+
+#endif
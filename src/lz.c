@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 14
+#define VARINT_SIZE 10
+
+static unsigned char *put_varint(unsigned char *p, size_t value) {
+  while (value >= 0x80) {
+    *p++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (unsigned char)value;
+  return p;
+}
+
+static bool get_varint(const unsigned char **p, const unsigned char *end,
+                       size_t *value) {
+  *value = 0;
+  for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char byte = *(*p)++;
+    *value |= (size_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool put_literals(unsigned char **p, unsigned char *end,
+                         const unsigned char *literals, size_t count) {
+  if ((size_t)(end - *p) < count + 3 * VARINT_SIZE) {
+    return false;
+  }
+  *p = put_varint(*p, count);
+  memcpy(*p, literals, count);
+  *p += count;
+  return true;
+}
+
+static size_t hash_word(const unsigned char *p) {
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return (word * 2654435761u) >> (32 - HASH_BITS);
+}
+
+size_t lz_compress(const unsigned char *source, size_t length,
+                   unsigned char *target, size_t capacity) {
+  size_t *table = calloc((size_t)1 << HASH_BITS, sizeof(size_t));
+  if (table == NULL) {
+    return 0;
+  }
+  unsigned char *p = target;
+  unsigned char *end = target + capacity;
+  size_t anchor = 0;
+  size_t i = 0;
+  while (i + MIN_MATCH <= length) {
+    size_t hash = hash_word(source + i);
+    size_t candidate = table[hash];
+    table[hash] = i + 1;
+    if (candidate == 0 ||
+        memcmp(source + candidate - 1, source + i, MIN_MATCH) != 0) {
+      i++;
+      continue;
+    }
+    candidate--;
+    size_t match = MIN_MATCH;
+    while (i + match < length &&
+           source[candidate + match] == source[i + match]) {
+      match++;
+    }
+    if (!put_literals(&p, end, source + anchor, i - anchor)) {
+      free(table);
+      return 0;
+    }
+    p = put_varint(p, match);
+    p = put_varint(p, i - candidate);
+    i += match;
+    anchor = i;
+  }
+  free(table);
+  if (!put_literals(&p, end, source + anchor, length - anchor)) {
+    return 0;
+  }
+  return (size_t)(p - target);
+}
+
+bool lz_decompress(const unsigned char *source, size_t length,
+                   unsigned char *target, size_t capacity) {
+  const unsigned char *end = source + length;
+  unsigned char *out = target;
+  unsigned char *out_end = target + capacity;
+  for (;;) {
+    size_t literals;
+    if (!get_varint(&source, end, &literals) ||
+        literals > (size_t)(end - source) ||
+        literals > (size_t)(out_end - out)) {
+      return false;
+    }
+    memcpy(out, source, literals);
+    source += literals;
+    out += literals;
+    if (source == end) {
+      return out == out_end;
+    }
+
+    size_t match;
+    size_t offset;
+    if (!get_varint(&source, end, &match) ||
+        !get_varint(&source, end, &offset) || offset == 0 ||
+        offset > (size_t)(out - target) || match > (size_t)(out_end - out)) {
+      return false;
+    }
+    const unsigned char *from = out - offset;
+    for (size_t k = 0; k < match; k++) {
+      out[k] = from[k];
+    }
+    out += match;
+  }
+}
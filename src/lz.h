@@ -0,0 +1,13 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+size_t lz_compress(const unsigned char *source, size_t length,
+                   unsigned char *target, size_t capacity);
+
+bool lz_decompress(const unsigned char *source, size_t length,
+                   unsigned char *target, size_t capacity);
+
+#endif
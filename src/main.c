@@ -6,10 +6,14 @@
 #include <termios.h>
 #include <unistd.h>
 
+#include "buffer.h"
 #include "draw.h"
 #include "input.h"
 #include "main.h"
-#include "undo.h"
+#include "save.h"
+
+#define DEFAULT_VIEW_THRESHOLD_MB 1024
+#define DEFAULT_UNDO_BUDGET_MB 64
 
 Context *global_ctx;
 
@@ -33,113 +37,15 @@ static void leave_alt_screen(Context ctx) {
   fflush(stdout);
 }
 
-static Buffer *create_buffer_from_file(File file) {
-  FILE *f = fopen(file.name, "r");
-
-  Buffer *buffer = malloc(sizeof(Buffer));
-  if (buffer == NULL) {
-    if (f != NULL) {
-      fclose(f);
-    }
-    return NULL;
-  }
-  buffer->file = file;
-  buffer->lines = NULL;
-  buffer->length = 0;
-
-  if (f == NULL) {
-    buffer->lines = malloc(1 * sizeof(Line));
-    if (buffer->lines == NULL) {
-      free(buffer);
-      return NULL;
-    }
-    buffer->lines[0].data = strdup("");
-    if (buffer->lines[0].data == NULL) {
-      free(buffer->lines);
-      free(buffer);
-      return NULL;
-    }
-    buffer->lines[0].length = 0;
-    buffer->lines[0].capacity = 1;
-    buffer->length = 1;
-    return buffer;
-  }
-
-  char *line_buf = NULL;
-  size_t line_buf_size = 0;
-  ssize_t line_length;
-
-  while ((line_length = getline(&line_buf, &line_buf_size, f)) != -1) {
-    if (line_length > 0 && line_buf[line_length - 1] == '\n') {
-      line_buf[line_length - 1] = '\0';
-      line_length--;
-    }
-    if (line_length > 0 && line_buf[line_length - 1] == '\r') {
-      line_buf[line_length - 1] = '\0';
-      line_length--;
-    }
-
-    Line *new_lines =
-        realloc(buffer->lines, (buffer->length + 1) * sizeof(Line));
-    if (new_lines == NULL) {
-      free(line_buf);
-      fclose(f);
-      for (size_t i = 0; i < buffer->length; i++) {
-        free(buffer->lines[i].data);
-      }
-      free(buffer->lines);
-      free(buffer);
-      return NULL;
-    }
-    buffer->lines = new_lines;
-
-    buffer->lines[buffer->length].data = strdup(line_buf);
-    if (buffer->lines[buffer->length].data == NULL) {
-      free(line_buf);
-      fclose(f);
-      for (size_t i = 0; i < buffer->length; i++) {
-        free(buffer->lines[i].data);
-      }
-      free(buffer->lines);
-      free(buffer);
-      return NULL;
-    }
-    buffer->lines[buffer->length].length = line_length;
-    buffer->lines[buffer->length].capacity = line_length + 1;
-    buffer->length++;
-  }
-
-  free(line_buf);
-  fclose(f);
-
-  if (buffer->length == 0) {
-    buffer->lines = malloc(1 * sizeof(Line));
-    if (buffer->lines == NULL) {
-      free(buffer);
-      return NULL;
-    }
-    buffer->lines[0].data = strdup("");
-    if (buffer->lines[0].data == NULL) {
-      free(buffer->lines);
-      free(buffer);
-      return NULL;
-    }
-    buffer->lines[0].length = 0;
-    buffer->lines[0].capacity = 1;
-    buffer->length = 1;
-  }
-
-  return buffer;
-}
-
-static void init_buffers(Context *ctx, FileList file_list) {
+static void init_buffers(Context *ctx, FileList file_list,
+                         size_t view_threshold) {
   ctx->n_buffers = file_list.length;
   ctx->buffers = malloc(file_list.length * sizeof(Buffer *));
   if (ctx->buffers == NULL) {
     exit(EXIT_FAILURE);
   }
   for (size_t i = 0; i < file_list.length; i++) {
-    Buffer *b = create_buffer_from_file(file_list.files[i]);
+    Buffer *b = create_buffer_from_file(file_list.files[i], view_threshold);
     if (b == NULL) {
       exit(EXIT_FAILURE);
     }
@@ -155,6 +61,8 @@ static void add_file(FileList *file_list, char *filename) {
     exit(EXIT_FAILURE);
   }
 
+  file_list->files[file_list->length - 1].read_only = false;
+  file_list->files[file_list->length - 1].paged = false;
   file_list->files[file_list->length - 1].name = strdup(filename);
   if (file_list->files[file_list->length - 1].name == NULL) {
     exit(EXIT_FAILURE);
@@ -171,12 +79,21 @@ static void print_help(const char *program_name) {
   printf("  --record FILE          Record all input to FILE\n");
   printf("  --playback FILE        Play back input from FILE and exit when done\n");
   printf("  --playback-string STR  Play back input from string STR, then continue normally\n");
+  printf("  -R                     Open files read-only in view mode\n");
+  printf("  --paged                Edit files in place with bounded memory,\n");
+  printf("                         keeping edits in an on-disk log\n");
+  printf("  --view-threshold MB    Use view mode for files of at least MB megabytes\n");
+  printf("                         (default %d, 0 disables)\n", DEFAULT_VIEW_THRESHOLD_MB);
+  printf("  --undo-budget MB       Compress, then drop, the undo history of the\n");
+  printf("                         least recently used buffers beyond MB megabytes\n");
+  printf("                         (default %d, 0 disables)\n", DEFAULT_UNDO_BUDGET_MB);
   printf("\n");
   printf("Examples:\n");
   printf("  %s file.txt                            # Edit file.txt\n", program_name);
   printf("  %s --record session.rec file.txt       # Record editing session\n", program_name);
   printf("  %s --playback session.rec file.txt     # Play back recorded session\n", program_name);
   printf("  %s --playback-string 'iHello' file.txt # Insert 'Hello' then continue\n", program_name);
+  printf("  %s -R huge.log                         # Browse huge.log without loading it\n", program_name);
   printf("\n");
 }
 
@@ -186,6 +103,10 @@ static void parse_arguments(int argc, char *argv[], Arguments *arguments) {
   arguments->record_filename = NULL;
   arguments->playback_filename = NULL;
   arguments->playback_string = NULL;
+  arguments->read_only = false;
+  arguments->paged = false;
+  arguments->view_threshold = (size_t)DEFAULT_VIEW_THRESHOLD_MB * 1024 * 1024;
+  arguments->undo_budget = (size_t)DEFAULT_UNDO_BUDGET_MB * 1024 * 1024;
 
   bool has_files = false;
   for (int i = 1; i < argc; i++) {
@@ -201,6 +122,17 @@ static void parse_arguments(int argc, char *argv[], Arguments *arguments) {
     } else if (strcmp(argv[i], "--playback-string") == 0 && i + 1 < argc) {
       arguments->playback_string = argv[i + 1];
       i++;
+    } else if (strcmp(argv[i], "-R") == 0) {
+      arguments->read_only = true;
+    } else if (strcmp(argv[i], "--paged") == 0) {
+      arguments->paged = true;
+    } else if (strcmp(argv[i], "--view-threshold") == 0 && i + 1 < argc) {
+      arguments->view_threshold =
+          strtoull(argv[i + 1], NULL, 10) * 1024 * 1024;
+      i++;
+    } else if (strcmp(argv[i], "--undo-budget") == 0 && i + 1 < argc) {
+      arguments->undo_budget = strtoull(argv[i + 1], NULL, 10) * 1024 * 1024;
+      i++;
     } else {
       add_file(&arguments->file_list, argv[i]);
       has_files = true;
@@ -210,6 +142,11 @@ static void parse_arguments(int argc, char *argv[], Arguments *arguments) {
   if (!has_files) {
     add_file(&arguments->file_list, "Untitled");
   }
+
+  for (size_t i = 0; i < arguments->file_list.length; i++) {
+    arguments->file_list.files[i].read_only = arguments->read_only;
+    arguments->file_list.files[i].paged = arguments->paged;
+  }
 }
 
 static void get_terminal_size(size_t *width, size_t *height) {
@@ -234,7 +171,15 @@ static void handle_sigwinch(int sig) {
 
 static void handle_sigint(int sig) {
   (void)sig;
-  global_ctx->running = false;
+  bool cancelled = false;
+  for (size_t i = 0; i < global_ctx->n_buffers; i++) {
+    if (cancel_buffer_load(global_ctx->buffers[i])) {
+      cancelled = true;
+    }
+  }
+  if (!cancelled) {
+    global_ctx->running = false;
+  }
 }
 
 static void init_terminal(struct termios *attr) {
@@ -266,11 +211,7 @@ static void add_window(Context *ctx, size_t current_buffer) {
 
 static void cleanup(Context ctx, Arguments arguments) {
   for (size_t i = 0; i < ctx.n_buffers; i++) {
-    for (size_t j = 0; j < ctx.buffers[i]->length; j++) {
-      free(ctx.buffers[i]->lines[j].data);
-    }
-    free(ctx.buffers[i]->lines);
-    free(ctx.buffers[i]);
+    free_buffer(ctx.buffers[i]);
   }
   free(ctx.buffers);
   for (size_t i = 0; i < ctx.n_windows; i++) {
@@ -296,7 +237,6 @@ static void cleanup(Context ctx, Arguments arguments) {
   if (ctx.playback_file != NULL) {
     fclose(ctx.playback_file);
   }
-  free_undo_stack(&ctx);
   leave_alt_screen(ctx);
 }
 
@@ -331,6 +271,7 @@ int main(int argc, char *argv[]) {
 
   Arguments arguments = {0};
   parse_arguments(argc, argv, &arguments);
+  capture_umask();
 
   if (arguments.record_filename != NULL) {
     ctx.record_file = fopen(arguments.record_filename, "wb");
@@ -351,9 +292,9 @@ int main(int argc, char *argv[]) {
 
   init_terminal(&ctx.terminal.attrs);
 
-  init_buffers(&ctx, arguments.file_list);
+  ctx.undo_budget = arguments.undo_budget;
+  init_buffers(&ctx, arguments.file_list, arguments.view_threshold);
   add_window(&ctx, 0);
-  init_undo_stack(&ctx);
   ctx.show_line_numbers = true;
 
   handle_sigwinch(0);
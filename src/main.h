@@ -3,8 +3,10 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <termios.h>
+#include <time.h>
 
 typedef enum {
   MODE_COMMAND,
@@ -23,35 +25,279 @@ typedef struct {
 } Terminal;
 
 typedef struct {
-  char *data;
+  const char *data;
   size_t length;
-  size_t capacity;
 } Line;
 
+typedef enum { PIECE_ORIGINAL, PIECE_ADD } PieceSource;
+
+typedef struct {
+  PieceSource source;
+  size_t start;
+  size_t count;
+} Piece;
+
+typedef struct PieceNode PieceNode;
+
+typedef struct {
+  char *data;
+  size_t length;
+} Mapping;
+
+typedef struct {
+  const char *original_text;
+  bool original_sparse;
+  size_t original_limit;
+  uint32_t *original_ends;
+  size_t *original_bases;
+  size_t *original_wide;
+  uint64_t *original_crs;
+  size_t *original_cr_counts;
+  size_t original_cr_total;
+  size_t original_length;
+  size_t original_capacity;
+  Line *added;
+  size_t *added_ends;
+  size_t added_length;
+  size_t added_capacity;
+  char **slabs;
+  size_t n_slabs;
+  size_t slabs_capacity;
+  Mapping *texts;
+  size_t n_texts;
+  size_t texts_capacity;
+  char *slab;
+  size_t slab_used;
+  char *gap_text;
+  size_t gap_capacity;
+  size_t gap_start;
+  size_t gap_length;
+  size_t gap_index;
+  size_t gap_slab;
+  int log_fd;
+  size_t log_length;
+  Mapping *log_maps;
+  size_t n_log_maps;
+  size_t log_maps_capacity;
+  PieceNode *root;
+  PieceNode *free_nodes;
+  unsigned long long seed;
+} PieceTable;
+
+typedef struct {
+  PieceTable *table;
+  Piece *pieces;
+  size_t length;
+  Line *added;
+} PieceSnapshot;
+
+typedef struct {
+  PieceSnapshot *snapshot;
+  size_t piece;
+  size_t index;
+  size_t position;
+} SpanIterator;
+
+typedef struct {
+  PieceTable *table;
+  size_t row;
+  PieceSource source;
+  size_t index;
+  size_t remaining;
+  size_t position;
+} LineIterator;
+
 typedef struct {
   char *name;
+  bool read_only;
+  bool paged;
 } File;
 
+typedef struct {
+  char magic[8];
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t n_lines;
+  uint64_t indexed;
+  uint64_t check;
+  uint64_t hashed;
+  uint64_t content_hash;
+} IndexCacheHeader;
+
+typedef struct {
+  char *path;
+  char *temp_path;
+  int fd;
+  IndexCacheHeader key;
+  void *map;
+  size_t map_length;
+  const size_t *ends;
+  size_t n_lines;
+  size_t indexed;
+  size_t written_lines;
+  size_t written_end;
+  bool hashed;
+  uint64_t content_hash;
+} IndexCache;
+
+typedef struct {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} FileStamp;
+
+typedef struct BufferLoad BufferLoad;
+
+typedef struct BufferSave BufferSave;
+
+typedef struct BufferJournal BufferJournal;
+
+typedef struct UndoHistory UndoHistory;
+
+typedef struct SyntaxCache SyntaxCache;
+
+typedef struct HashMarks HashMarks;
+
+typedef struct {
+  size_t row;
+  size_t column;
+} Cursor;
+
+typedef struct {
+  size_t row;
+  size_t count;
+  size_t old_first;
+  size_t old_length;
+  size_t new_first;
+  size_t new_length;
+  bool stored;
+} UndoDelta;
+
+typedef struct {
+  size_t parent;
+  size_t child;
+  size_t branch;
+  size_t children;
+  size_t first;
+  size_t depth;
+  Cursor cursor;
+  uint64_t generation;
+  uint64_t result;
+  time_t time;
+} UndoNode;
+
+typedef struct {
+  UndoNode *nodes;
+  size_t n_nodes;
+  size_t nodes_capacity;
+  UndoDelta *deltas;
+  size_t n_deltas;
+  size_t deltas_capacity;
+  Piece *pieces;
+  size_t n_pieces;
+  size_t pieces_capacity;
+  size_t current;
+  bool splice_recorded;
+  unsigned char *packed;
+  size_t packed_length;
+  uint64_t used;
+} UndoTree;
+
+typedef struct {
+  size_t row;
+  size_t removed;
+  size_t inserted;
+  uint64_t version;
+} BufferChange;
+
+typedef void (*BufferListener)(void *data, const BufferChange *change);
+
+typedef struct {
+  BufferListener listener;
+  void *data;
+} BufferWatch;
+
 typedef struct {
   File file;
-  Line *lines;
-  size_t length;
+  PieceTable table;
+  char *map;
+  size_t map_length;
+  bool mapped;
+  int map_fd;
+  FileStamp map_stamp;
+  size_t pinned_from;
+  FileStamp disk_stamp;
+  bool disk_known;
+  bool disk_is_original;
+  size_t modified_from;
+  uint64_t generation;
+  uint64_t saved_generation;
+  uint64_t last_generation;
+  uint64_t version;
+  BufferWatch *watches;
+  size_t n_watches;
+  size_t watches_capacity;
+  bool content_hashed;
+  uint64_t content_hash;
+  HashMarks *hash_marks;
+  BufferLoad *load;
+  BufferSave *save;
+  BufferJournal *journal;
+  SyntaxCache *syntax;
+  UndoTree undo;
+  char *undo_map;
+  size_t undo_map_length;
+  bool undo_loaded;
+  bool partial;
+  bool read_only;
+  bool paged;
+  size_t unreleased_edits;
+  char message[128];
 } Buffer;
 
 typedef struct {
+  size_t offset;
+  size_t length;
+} EditLine;
+
+typedef struct {
+  bool insert;
   size_t row;
   size_t column;
-} Position;
+  size_t end_row;
+  size_t end_column;
+  size_t first;
+  size_t count;
+} EditOp;
 
 typedef struct {
-  Position start;
-  Position end;
-} Selection;
+  Buffer *buffer;
+  EditOp *ops;
+  size_t n_ops;
+  size_t ops_capacity;
+  EditLine *lines;
+  size_t n_lines;
+  size_t lines_capacity;
+  char *text;
+  size_t text_length;
+  size_t text_capacity;
+  bool failed;
+} BufferEdit;
 
 typedef struct {
   size_t row;
   size_t column;
-} Cursor;
+} Position;
+
+typedef struct {
+  Position start;
+  Position end;
+} Selection;
 
 typedef struct {
   size_t vertical;
@@ -68,18 +314,6 @@ typedef struct {
   Buffer *current_buffer;
 } Window;
 
-typedef struct {
-  Line *lines;
-  size_t length;
-  Cursor cursor;
-} UndoState;
-
-typedef struct {
-  UndoState *states;
-  size_t length;
-  size_t capacity;
-} UndoStack;
-
 typedef struct {
   Terminal terminal;
   Window **windows;
@@ -103,7 +337,6 @@ typedef struct {
   size_t *yank_buffer_lengths;
   size_t yank_buffer_length;
   bool yank_linewise;
-  UndoStack undo_stack;
   bool show_line_numbers;
   size_t count;
   FILE *record_file;
@@ -113,6 +346,7 @@ typedef struct {
   size_t playback_string_index;
   size_t playback_string_length;
   bool literal_next;
+  size_t undo_budget;
 } Context;
 
 typedef struct {
@@ -134,6 +368,10 @@ typedef struct {
   char *record_filename;
   char *playback_filename;
   char *playback_string;
+  bool read_only;
+  bool paged;
+  size_t view_threshold;
+  size_t undo_budget;
 } Arguments;
 
 #endif
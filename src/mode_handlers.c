@@ -5,8 +5,11 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "buffer.h"
 #include "delete.h"
+#include "edit.h"
 #include "insert.h"
+#include "journal.h"
 #include "main.h"
 #include "mode_handlers.h"
 #include "save.h"
@@ -15,6 +18,10 @@
 #include "undo.h"
 #include "yank.h"
 
+static bool is_editing_key(unsigned char c) {
+  return c != '\0' && strchr("oxdciIAp", c) != NULL;
+}
+
 void handle_normal_mode(Context *ctx, unsigned char c) {
   Window *window = ctx->windows[ctx->current_window];
   EditorMode *mode = &ctx->mode;
@@ -29,6 +36,11 @@ void handle_normal_mode(Context *ctx, unsigned char c) {
     }
   }
 
+  if (window->current_buffer->read_only && is_editing_key(c)) {
+    ctx->count = 0;
+    return;
+  }
+
   switch (c) {
   case 'h':
     for (size_t i = 0; i < repeat_count; i++) {
@@ -54,8 +66,8 @@ void handle_normal_mode(Context *ctx, unsigned char c) {
     window->cursor.column = 1;
     break;
   case '$': {
-    Line *line_ptr = &window->current_buffer->lines[window->cursor.row - 1];
-    window->cursor.column = line_ptr->length + 1;
+    window->cursor.column =
+        buffer_line_length(window->current_buffer, window->cursor.row - 1) + 1;
     break;
   }
   case 4:
@@ -76,20 +88,22 @@ void handle_normal_mode(Context *ctx, unsigned char c) {
     }
     break;
   case 'G':
-    window->cursor.row = window->current_buffer->length;
+    wait_for_buffer_load(window->current_buffer);
+    window->cursor.row = buffer_line_count(window->current_buffer);
     break;
   case 'o': {
     push_undo_state(ctx);
-    Line *line_ptr = &window->current_buffer->lines[window->cursor.row - 1];
+    Line line =
+        buffer_get_line(window->current_buffer, window->cursor.row - 1);
     size_t leading_spaces = 0;
-    if (line_ptr->data != NULL) {
-      for (; leading_spaces < line_ptr->length; leading_spaces++) {
-        if (line_ptr->data[leading_spaces] != ' ') {
+    if (line.data != NULL) {
+      for (; leading_spaces < line.length; leading_spaces++) {
+        if (line.data[leading_spaces] != ' ') {
           break;
         }
       }
     }
-    window->cursor.column = line_ptr->length + 1;
+    window->cursor.column = line.length + 1;
     insert_newline(window);
     for (size_t i = 0; i < leading_spaces; i++) {
       insert_char(window, ' ');
@@ -99,17 +113,13 @@ void handle_normal_mode(Context *ctx, unsigned char c) {
   }
   case 'x':
     push_undo_state(ctx);
-    for (size_t i = 0; i < repeat_count; i++) {
-      delete_char(window);
-    }
+    delete_chars(window, repeat_count);
     break;
   case 'd':
     if (read(STDIN_FILENO, &c, 1) == 1) {
       if (c == 'd') {
         push_undo_state(ctx);
-        for (size_t i = 0; i < repeat_count; i++) {
-          delete_line(window);
-        }
+        delete_lines(window, window->cursor.row - 1, repeat_count);
       } else if (c == 'w') {
         push_undo_state(ctx);
         for (size_t i = 0; i < repeat_count; i++) {
@@ -165,11 +175,12 @@ void handle_normal_mode(Context *ctx, unsigned char c) {
     break;
   case 'I': {
     push_undo_state(ctx);
-    Line *line_ptr = &window->current_buffer->lines[window->cursor.row - 1];
-    if (line_ptr->data != NULL) {
+    Line line =
+        buffer_get_line(window->current_buffer, window->cursor.row - 1);
+    if (line.data != NULL) {
       for (window->cursor.column = 0;
-           line_ptr->data[window->cursor.column] == ' ' &&
-           window->cursor.column < line_ptr->length;
+           window->cursor.column < line.length &&
+           line.data[window->cursor.column] == ' ';
            window->cursor.column++) {
       }
     } else {
@@ -181,8 +192,8 @@ void handle_normal_mode(Context *ctx, unsigned char c) {
   }
   case 'A': {
     push_undo_state(ctx);
-    Line *line_ptr = &window->current_buffer->lines[window->cursor.row - 1];
-    window->cursor.column = line_ptr->length + 1;
+    window->cursor.column =
+        buffer_line_length(window->current_buffer, window->cursor.row - 1) + 1;
     *mode = MODE_INSERT;
     break;
   }
@@ -217,6 +228,9 @@ void handle_normal_mode(Context *ctx, unsigned char c) {
   case 'u':
     undo(ctx);
     break;
+  case 18:
+    redo(ctx);
+    break;
   case 'n':
     if (*search_buffer_length > 0) {
       find_occurrence(window, *search_buffer, *search_buffer_length,
@@ -293,13 +307,71 @@ static void command_goto_line(Context *ctx, char *command_buffer,
   }
   int line_number_int = atoi(command_buffer);
   size_t line_number = line_number_int < 0 ? 0 : (size_t)line_number_int;
-  if (line_number > window->current_buffer->length) {
-    line_number = window->current_buffer->length;
+  wait_for_buffer_lines(window->current_buffer, line_number);
+  if (line_number > buffer_line_count(window->current_buffer)) {
+    line_number = buffer_line_count(window->current_buffer);
   }
   window->cursor.row = line_number;
   window->cursor.column = 1;
 }
 
+static void command_goto_byte(Context *ctx, const char *argument,
+                              size_t argument_length) {
+  Window *window = ctx->windows[ctx->current_window];
+  size_t byte = 0;
+  for (size_t i = 0; i < argument_length; i++) {
+    if (!isdigit((unsigned char)argument[i])) {
+      return;
+    }
+    byte = byte * 10 + (argument[i] - '0');
+  }
+  wait_for_buffer_load(window->current_buffer);
+  size_t column;
+  size_t row = buffer_offset_row(window->current_buffer, byte > 0 ? byte - 1 : 0,
+                                 &column);
+  window->cursor.row = row + 1;
+  window->cursor.column = column + 1;
+}
+
+static void command_undo_time(Context *ctx, const char *argument,
+                              size_t argument_length, long direction) {
+  size_t i = 0;
+  while (i < argument_length && argument[i] == ' ') {
+    i++;
+  }
+  size_t digits = i;
+  long step = 0;
+  for (; i < argument_length && isdigit((unsigned char)argument[i]); i++) {
+    step = step * 10 + (argument[i] - '0');
+  }
+  if (i == digits) {
+    step = 1;
+  }
+
+  bool seconds = i < argument_length;
+  if (seconds) {
+    if (i + 1 != argument_length) {
+      return;
+    }
+    switch (argument[i]) {
+    case 's':
+      break;
+    case 'm':
+      step *= 60;
+      break;
+    case 'h':
+      step *= 60 * 60;
+      break;
+    case 'd':
+      step *= 24 * 60 * 60;
+      break;
+    default:
+      return;
+    }
+  }
+  undo_time(ctx, direction * step, seconds);
+}
+
 static bool is_numeric_command(char *command_buffer,
                                size_t command_buffer_length) {
   for (size_t i = 0; i < command_buffer_length; i++) {
@@ -324,15 +396,37 @@ static void execute_command(Context *ctx) {
 
   if (command_matches(command_buffer, command_buffer_length, "w")) {
     save_buffer(window->current_buffer);
+  } else if (command_matches(command_buffer, command_buffer_length, "w!")) {
+    force_save_buffer(window->current_buffer);
   } else if (command_matches(command_buffer, command_buffer_length, "q")) {
     ctx->running = false;
   } else if (command_matches(command_buffer, command_buffer_length, "x")) {
-    save_buffer(window->current_buffer);
-    ctx->running = false;
+    if (save_buffer(window->current_buffer) &&
+        wait_for_buffer_save(window->current_buffer)) {
+      ctx->running = false;
+    }
+  } else if (command_matches(command_buffer, command_buffer_length,
+                             "recover")) {
+    recover_buffer_journal(ctx);
+  } else if (command_matches(command_buffer, command_buffer_length,
+                             "discard")) {
+    discard_buffer_journal(window->current_buffer);
   } else if (command_matches(command_buffer, command_buffer_length, "bn")) {
     command_next_buffer(ctx);
   } else if (command_matches(command_buffer, command_buffer_length, "bp")) {
     command_prev_buffer(ctx);
+  } else if (command_matches(command_buffer, command_buffer_length,
+                             "undostats")) {
+    report_undo_stats(ctx);
+  } else if (command_buffer_length >= 7 &&
+             strncmp(command_buffer, "earlier", 7) == 0) {
+    command_undo_time(ctx, command_buffer + 7, command_buffer_length - 7, -1);
+  } else if (command_buffer_length >= 5 &&
+             strncmp(command_buffer, "later", 5) == 0) {
+    command_undo_time(ctx, command_buffer + 5, command_buffer_length - 5, 1);
+  } else if (command_buffer_length > 5 &&
+             strncmp(command_buffer, "goto ", 5) == 0) {
+    command_goto_byte(ctx, command_buffer + 5, command_buffer_length - 5);
   } else if (command_buffer_length > 0 &&
              is_numeric_command(command_buffer, command_buffer_length)) {
     command_goto_line(ctx, command_buffer, command_buffer_length);
@@ -469,8 +563,10 @@ static void execute_filter(Context *ctx) {
 
   size_t num_lines = end_row - start_row + 1;
   size_t total_size = 0;
-  for (size_t i = start_row - 1; i < end_row && i < buffer->length; i++) {
-    total_size += buffer->lines[i].length + 1;
+  wait_for_buffer_load(buffer);
+  size_t length = buffer_line_count(buffer);
+  for (size_t i = start_row - 1; i < end_row && i < length; i++) {
+    total_size += buffer_line_length(buffer, i) + 1;
   }
 
   char *input_text = malloc(total_size);
@@ -480,10 +576,11 @@ static void execute_filter(Context *ctx) {
   }
 
   size_t offset = 0;
-  for (size_t i = start_row - 1; i < end_row && i < buffer->length; i++) {
-    if (buffer->lines[i].length > 0 && buffer->lines[i].data != NULL) {
-      memcpy(input_text + offset, buffer->lines[i].data, buffer->lines[i].length);
-      offset += buffer->lines[i].length;
+  for (size_t i = start_row - 1; i < end_row && i < length; i++) {
+    Line line = buffer_get_line(buffer, i);
+    if (line.length > 0 && line.data != NULL) {
+      memcpy(input_text + offset, line.data, line.length);
+      offset += line.length;
     }
     input_text[offset++] = '\n';
   }
@@ -556,44 +653,51 @@ static void execute_filter(Context *ctx) {
   waitpid(pid, NULL, 0);
 
   push_undo_state(ctx);
-  window->cursor.row = start_row;
-  window->cursor.column = 1;
-  for (size_t i = 0; i < num_lines; i++) {
-    delete_line(window);
-    if (window->cursor.row > start_row) {
-      window->cursor.row--;
+  BufferEdit edit;
+  begin_buffer_edit(&edit, buffer);
+  size_t n_lines = buffer_line_count(buffer);
+  size_t row = start_row - 1;
+  if (row < n_lines) {
+    if (row + num_lines < n_lines) {
+      edit_delete(&edit, row, 0, row + num_lines, 0);
+      n_lines -= num_lines;
+    } else {
+      edit_delete(&edit, row, 0, n_lines, 0);
+      n_lines = row + 1;
     }
   }
-
-  if (buffer->length == 0) {
-    free(output);
-    return;
-  }
-
-  if (window->cursor.row > buffer->length) {
-    window->cursor.row = buffer->length;
-  }
-  if (window->cursor.row < 1) {
-    window->cursor.row = 1;
-  }
-
-  if (start_row <= buffer->length) {
-    window->cursor.row = start_row;
-  } else {
-    window->cursor.row = buffer->length;
-  }
+  window->cursor.row = start_row <= n_lines ? start_row : n_lines;
   window->cursor.column = 1;
 
   if (output_size > 0) {
+    size_t n_segments = 1;
     for (size_t i = 0; i < output_size; i++) {
       if (output[i] == '\n') {
-        insert_newline(window);
-      } else {
-        insert_char(window, output[i]);
+        n_segments++;
+      }
+    }
+    Line *segments = malloc(n_segments * sizeof(Line));
+    if (segments != NULL) {
+      size_t segment = 0;
+      size_t segment_start = 0;
+      for (size_t i = 0; i <= output_size; i++) {
+        if (i == output_size || output[i] == '\n') {
+          segments[segment++] =
+              (Line){output + segment_start, i - segment_start};
+          segment_start = i + 1;
+        }
       }
+      edit_insert(&edit, window->cursor.row - 1, window->cursor.column - 1,
+                  segments, n_segments);
+      window->cursor.row += n_segments - 1;
+      window->cursor.column =
+          (n_segments > 1 ? 1 : window->cursor.column) +
+          segments[n_segments - 1].length;
+      free(segments);
     }
   }
 
+  commit_buffer_edit(&edit);
   free(output);
 }
 
@@ -727,8 +831,8 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
     window->cursor.column = 1;
     break;
   case '$': {
-    Line *line_ptr = &window->current_buffer->lines[window->cursor.row - 1];
-    window->cursor.column = line_ptr->length + 1;
+    window->cursor.column =
+        buffer_line_length(window->current_buffer, window->cursor.row - 1) + 1;
     break;
   }
   case 'g':
@@ -739,7 +843,8 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
     }
     break;
   case 'G':
-    window->cursor.row = window->current_buffer->length;
+    wait_for_buffer_load(window->current_buffer);
+    window->cursor.row = buffer_line_count(window->current_buffer);
     break;
   case 'y':
     yank_selection(ctx);
@@ -769,24 +874,24 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
         size_t row = window->cursor.row - 1;
         size_t col = window->cursor.column - 1;
 
-        if (row < buf->length) {
-          Line *line = &buf->lines[row];
+        if (row < buffer_line_count(buf)) {
+          Line line = buffer_get_line(buf, row);
 
           if (text_obj == 'p') {
             size_t para_start = row;
             size_t para_end = row;
 
             for (size_t r = row; r > 0; r--) {
-              Line *check_line = &buf->lines[r - 1];
-              if (check_line->length == 0) {
+              Line check_line = buffer_get_line(buf, r - 1);
+              if (check_line.length == 0) {
                 break;
               }
               para_start = r - 1;
             }
 
-            for (size_t r = row + 1; r < buf->length; r++) {
-              Line *check_line = &buf->lines[r];
-              if (check_line->length == 0) {
+            for (size_t r = row + 1; r < buffer_line_count(buf); r++) {
+              Line check_line = buffer_get_line(buf, r);
+              if (check_line.length == 0) {
                 break;
               }
               para_end = r;
@@ -795,19 +900,19 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
             ctx->selection.start.row = para_start + 1;
             ctx->selection.start.column = 1;
             ctx->selection.end.row = para_end + 1;
-            ctx->selection.end.column = buf->lines[para_end].length + 1;
+            ctx->selection.end.column = buffer_line_length(buf, para_end) + 1;
             update_selection_end = false;
           } else if (text_obj == 'w') {
-            if (col < line->length && isalnum((unsigned char)line->data[col])) {
+            if (col < line.length && isalnum((unsigned char)line.data[col])) {
               size_t start = col;
               size_t end = col;
 
               while (start > 0 &&
-                     isalnum((unsigned char)line->data[start - 1])) {
+                     isalnum((unsigned char)line.data[start - 1])) {
                 start--;
               }
-              while (end < line->length &&
-                     isalnum((unsigned char)line->data[end])) {
+              while (end < line.length &&
+                     isalnum((unsigned char)line.data[end])) {
                 end++;
               }
 
@@ -843,9 +948,9 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
             if (is_bracket) {
               int depth = 0;
               for (size_t i = col; i > 0; i--) {
-                if (line->data[i - 1] == close_char) {
+                if (line.data[i - 1] == close_char) {
                   depth++;
-                } else if (line->data[i - 1] == text_obj) {
+                } else if (line.data[i - 1] == text_obj) {
                   if (depth == 0) {
                     start_col = i;
                     found_start = true;
@@ -857,11 +962,11 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
 
               if (!found_start) {
                 for (size_t r = row; r > 0; r--) {
-                  Line *prev_line = &buf->lines[r - 1];
-                  for (size_t i = prev_line->length; i > 0; i--) {
-                    if (prev_line->data[i - 1] == close_char) {
+                  Line prev_line = buffer_get_line(buf, r - 1);
+                  for (size_t i = prev_line.length; i > 0; i--) {
+                    if (prev_line.data[i - 1] == close_char) {
                       depth++;
-                    } else if (prev_line->data[i - 1] == text_obj) {
+                    } else if (prev_line.data[i - 1] == text_obj) {
                       if (depth == 0) {
                         start_row = r - 1;
                         start_col = i;
@@ -881,10 +986,10 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
                 bool search_current = (start_row == row);
                 size_t search_start = search_current ? start_col : 0;
 
-                for (size_t i = search_start; i < line->length; i++) {
-                  if (line->data[i] == text_obj) {
+                for (size_t i = search_start; i < line.length; i++) {
+                  if (line.data[i] == text_obj) {
                     depth++;
-                  } else if (line->data[i] == close_char) {
+                  } else if (line.data[i] == close_char) {
                     if (depth == 0) {
                       end_row = row;
                       end_col = i;
@@ -896,12 +1001,12 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
                 }
 
                 if (!found_end) {
-                  for (size_t r = row + 1; r < buf->length; r++) {
-                    Line *next_line = &buf->lines[r];
-                    for (size_t i = 0; i < next_line->length; i++) {
-                      if (next_line->data[i] == text_obj) {
+                  for (size_t r = row + 1; r < buffer_line_count(buf); r++) {
+                    Line next_line = buffer_get_line(buf, r);
+                    for (size_t i = 0; i < next_line.length; i++) {
+                      if (next_line.data[i] == text_obj) {
                         depth++;
-                      } else if (next_line->data[i] == close_char) {
+                      } else if (next_line.data[i] == close_char) {
                         if (depth == 0) {
                           end_row = r;
                           end_col = i;
@@ -918,7 +1023,7 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
               }
             } else {
               for (size_t i = col; i > 0; i--) {
-                if (line->data[i - 1] == text_obj) {
+                if (line.data[i - 1] == text_obj) {
                   start_col = i;
                   found_start = true;
                   break;
@@ -927,9 +1032,9 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
 
               if (!found_start) {
                 for (size_t r = row; r > 0; r--) {
-                  Line *prev_line = &buf->lines[r - 1];
-                  for (size_t i = prev_line->length; i > 0; i--) {
-                    if (prev_line->data[i - 1] == text_obj) {
+                  Line prev_line = buffer_get_line(buf, r - 1);
+                  for (size_t i = prev_line.length; i > 0; i--) {
+                    if (prev_line.data[i - 1] == text_obj) {
                       start_row = r - 1;
                       start_col = i;
                       found_start = true;
@@ -945,8 +1050,8 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
                 bool search_current = (start_row == row);
                 size_t search_start = search_current ? start_col : 0;
 
-                for (size_t i = search_start; i < line->length; i++) {
-                  if (line->data[i] == close_char) {
+                for (size_t i = search_start; i < line.length; i++) {
+                  if (line.data[i] == close_char) {
                     end_row = row;
                     end_col = i;
                     found_end = true;
@@ -955,10 +1060,10 @@ void handle_visual_mode(Context *ctx, unsigned char c) {
                 }
 
                 if (!found_end) {
-                  for (size_t r = row + 1; r < buf->length; r++) {
-                    Line *next_line = &buf->lines[r];
-                    for (size_t i = 0; i < next_line->length; i++) {
-                      if (next_line->data[i] == close_char) {
+                  for (size_t r = row + 1; r < buffer_line_count(buf); r++) {
+                    Line next_line = buffer_get_line(buf, r);
+                    for (size_t i = 0; i < next_line.length; i++) {
+                      if (next_line.data[i] == close_char) {
                         end_row = r;
                         end_col = i;
                         found_end = true;
@@ -0,0 +1,1382 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "line_index.h"
+#include "piece_table.h"
+
+#define SLAB_SIZE (64 * 1024)
+#define GAP_SIZE 4096
+#define ORIGINAL_BLOCK 256
+#define NODE_BLOCK 256
+
+typedef struct {
+  const char *data;
+  size_t length;
+  size_t index;
+} TextRef;
+
+struct PieceNode {
+  Piece piece;
+  size_t piece_bytes;
+  size_t lines;
+  size_t bytes;
+  size_t added;
+  unsigned int priority;
+  PieceNode *left;
+  PieceNode *right;
+};
+
+static unsigned int next_priority(PieceTable *table) {
+  table->seed ^= table->seed << 13;
+  table->seed ^= table->seed >> 7;
+  table->seed ^= table->seed << 17;
+  return (unsigned int)(table->seed >> 32);
+}
+
+static size_t next_newline(PieceTable *table, size_t position) {
+  if (position >= table->original_limit) {
+    return table->original_limit;
+  }
+  const char *newline = memchr(table->original_text + position, '\n',
+                               table->original_limit - position);
+  return newline != NULL ? (size_t)(newline - table->original_text)
+                         : table->original_limit;
+}
+
+static bool ends_with_cr(PieceTable *table, size_t start, size_t newline) {
+  return newline > start && table->original_text[newline - 1] == '\r';
+}
+
+static size_t scan_sparse(PieceTable *table, size_t index, size_t *start,
+                          size_t *crs) {
+  size_t block = index / ORIGINAL_BLOCK;
+  size_t position = table->original_bases[block];
+  size_t count = table->original_cr_counts[block];
+  for (size_t i = block * ORIGINAL_BLOCK;; i++) {
+    size_t newline = next_newline(table, position);
+    if (ends_with_cr(table, position, newline)) {
+      count++;
+    }
+    if (i == index) {
+      if (start != NULL) {
+        *start = position;
+      }
+      if (crs != NULL) {
+        *crs = count;
+      }
+      return newline + 1;
+    }
+    position = newline + 1;
+  }
+}
+
+static size_t original_end(PieceTable *table, size_t index) {
+  if (table->original_sparse) {
+    return scan_sparse(table, index, NULL, NULL);
+  }
+  if (table->original_wide != NULL) {
+    return table->original_wide[index];
+  }
+  return table->original_bases[index / ORIGINAL_BLOCK] +
+         table->original_ends[index];
+}
+
+static size_t original_crs_through(PieceTable *table, size_t index) {
+  if (table->original_sparse) {
+    size_t crs;
+    scan_sparse(table, index, NULL, &crs);
+    return crs;
+  }
+  size_t block = index / ORIGINAL_BLOCK;
+  size_t count = table->original_cr_counts[block];
+  for (size_t word = block * (ORIGINAL_BLOCK / 64); word < index / 64;
+       word++) {
+    count += __builtin_popcountll(table->original_crs[word]);
+  }
+  uint64_t mask = (2ULL << (index % 64)) - 1;
+  return count + __builtin_popcountll(table->original_crs[index / 64] & mask);
+}
+
+static Line original_line(PieceTable *table, size_t start, size_t newline) {
+  if (ends_with_cr(table, start, newline)) {
+    newline--;
+  }
+  return (Line){newline > start ? table->original_text + start : NULL,
+                newline - start};
+}
+
+static size_t range_bytes(PieceTable *table, PieceSource source, size_t start,
+                          size_t count) {
+  if (count == 0) {
+    return 0;
+  }
+  size_t last = start + count - 1;
+  if (source == PIECE_ADD) {
+    return table->added_ends[last] -
+           (start > 0 ? table->added_ends[start - 1] : 0);
+  }
+  size_t bytes =
+      original_end(table, last) - (start > 0 ? original_end(table, start - 1) : 0);
+  size_t crs = original_crs_through(table, last) -
+               (start > 0 ? original_crs_through(table, start - 1) : 0);
+  return bytes - crs;
+}
+
+static size_t node_lines(const PieceNode *node) {
+  return node != NULL ? node->lines : 0;
+}
+
+static size_t node_bytes(const PieceNode *node) {
+  return node != NULL ? node->bytes : 0;
+}
+
+static size_t node_added(const PieceNode *node) {
+  return node != NULL ? node->added : 0;
+}
+
+static size_t own_added(const PieceNode *node) {
+  return node->piece.source == PIECE_ADD ? node->piece_bytes : 0;
+}
+
+static void update_node(PieceNode *node) {
+  node->lines =
+      node_lines(node->left) + node->piece.count + node_lines(node->right);
+  node->bytes =
+      node_bytes(node->left) + node->piece_bytes + node_bytes(node->right);
+  node->added =
+      node_added(node->left) + own_added(node) + node_added(node->right);
+}
+
+static bool add_slab(PieceTable *table, char *slab) {
+  if (table->n_slabs >= table->slabs_capacity) {
+    size_t new_capacity =
+        table->slabs_capacity == 0 ? 16 : table->slabs_capacity * 2;
+    char **new_slabs = realloc(table->slabs, new_capacity * sizeof(char *));
+    if (new_slabs == NULL) {
+      return false;
+    }
+    table->slabs = new_slabs;
+    table->slabs_capacity = new_capacity;
+  }
+  table->slabs[table->n_slabs++] = slab;
+  return true;
+}
+
+static bool add_text(PieceTable *table, char *text, size_t length) {
+  if (table->n_texts >= table->texts_capacity) {
+    size_t new_capacity =
+        table->texts_capacity == 0 ? 16 : table->texts_capacity * 2;
+    Mapping *new_texts = realloc(table->texts, new_capacity * sizeof(Mapping));
+    if (new_texts == NULL) {
+      return false;
+    }
+    table->texts = new_texts;
+    table->texts_capacity = new_capacity;
+  }
+  table->texts[table->n_texts++] = (Mapping){text, length};
+  return true;
+}
+
+static bool reserve_nodes(PieceTable *table, size_t count) {
+  size_t available = 0;
+  for (PieceNode *node = table->free_nodes; node != NULL && available < count;
+       node = node->right) {
+    available++;
+  }
+  while (available < count) {
+    PieceNode *block = malloc(NODE_BLOCK * sizeof(PieceNode));
+    if (block == NULL || !add_slab(table, (char *)block)) {
+      free(block);
+      return false;
+    }
+    for (size_t i = 0; i < NODE_BLOCK; i++) {
+      block[i].right = table->free_nodes;
+      table->free_nodes = &block[i];
+    }
+    available += NODE_BLOCK;
+  }
+  return true;
+}
+
+static PieceNode *take_node(PieceTable *table, Piece piece) {
+  PieceNode *node = table->free_nodes;
+  table->free_nodes = node->right;
+  node->piece = piece;
+  node->piece_bytes = range_bytes(table, piece.source, piece.start, piece.count);
+  node->lines = piece.count;
+  node->bytes = node->piece_bytes;
+  node->added = own_added(node);
+  node->priority = next_priority(table);
+  node->left = NULL;
+  node->right = NULL;
+  return node;
+}
+
+static void release_tree(PieceTable *table, PieceNode *node) {
+  if (node == NULL) {
+    return;
+  }
+  release_tree(table, node->left);
+  release_tree(table, node->right);
+  node->right = table->free_nodes;
+  table->free_nodes = node;
+}
+
+static PieceNode *merge(PieceNode *left, PieceNode *right) {
+  if (left == NULL) {
+    return right;
+  }
+  if (right == NULL) {
+    return left;
+  }
+  if (left->priority > right->priority) {
+    left->right = merge(left->right, right);
+    update_node(left);
+    return left;
+  }
+  right->left = merge(left, right->left);
+  update_node(right);
+  return right;
+}
+
+static void split(PieceTable *table, PieceNode *node, size_t row,
+                  PieceNode **left, PieceNode **right) {
+  if (node == NULL) {
+    *left = NULL;
+    *right = NULL;
+    return;
+  }
+
+  size_t left_lines = node_lines(node->left);
+  if (row <= left_lines) {
+    split(table, node->left, row, left, &node->left);
+    update_node(node);
+    *right = node;
+  } else if (row >= left_lines + node->piece.count) {
+    split(table, node->right, row - left_lines - node->piece.count,
+          &node->right, right);
+    update_node(node);
+    *left = node;
+  } else {
+    size_t inner = row - left_lines;
+    Piece tail = node->piece;
+    tail.start += inner;
+    tail.count -= inner;
+    node->piece.count = inner;
+    node->piece_bytes -= range_bytes(table, tail.source, tail.start, tail.count);
+    PieceNode *rest = node->right;
+    node->right = NULL;
+    update_node(node);
+    *left = node;
+    *right = merge(take_node(table, tail), rest);
+  }
+}
+
+static bool extend_last(PieceTable *table, PieceNode *node, Piece piece) {
+  if (node->right != NULL) {
+    if (!extend_last(table, node->right, piece)) {
+      return false;
+    }
+  } else if (node->piece.source != piece.source ||
+             node->piece.start + node->piece.count != piece.start) {
+    return false;
+  } else {
+    node->piece.count += piece.count;
+    node->piece_bytes +=
+        range_bytes(table, piece.source, piece.start, piece.count);
+  }
+  update_node(node);
+  return true;
+}
+
+static PieceNode *append_piece(PieceTable *table, PieceNode *tree,
+                               Piece piece) {
+  if (tree != NULL && extend_last(table, tree, piece)) {
+    return tree;
+  }
+  return merge(tree, take_node(table, piece));
+}
+
+bool init_piece_table(PieceTable *table, const char *text, const size_t *ends,
+                      size_t length, bool sparse) {
+  table->original_text = text;
+  table->original_sparse = sparse;
+  table->original_limit = 0;
+  table->original_cr_total = 0;
+  table->original_ends = NULL;
+  table->original_bases = NULL;
+  table->original_wide = NULL;
+  table->original_crs = NULL;
+  table->original_cr_counts = NULL;
+  table->original_length = 0;
+  table->original_capacity = 0;
+  table->added = NULL;
+  table->added_ends = NULL;
+  table->added_length = 0;
+  table->added_capacity = 0;
+  table->slabs = NULL;
+  table->n_slabs = 0;
+  table->slabs_capacity = 0;
+  table->texts = NULL;
+  table->n_texts = 0;
+  table->texts_capacity = 0;
+  table->slab = NULL;
+  table->slab_used = 0;
+  table->gap_text = NULL;
+  table->log_fd = -1;
+  table->log_length = 0;
+  table->log_maps = NULL;
+  table->n_log_maps = 0;
+  table->log_maps_capacity = 0;
+  table->root = NULL;
+  table->free_nodes = NULL;
+  table->seed = 0x9e3779b97f4a7c15ULL;
+
+  return piece_table_append_original(table, ends, length);
+}
+
+void free_piece_table(PieceTable *table) {
+  table->root = NULL;
+  table->free_nodes = NULL;
+  for (size_t i = 0; i < table->n_slabs; i++) {
+    free(table->slabs[i]);
+  }
+  free(table->slabs);
+  for (size_t i = 0; i < table->n_texts; i++) {
+    free(table->texts[i].data);
+  }
+  free(table->texts);
+  for (size_t i = 0; i < table->n_log_maps; i++) {
+    munmap(table->log_maps[i].data, table->log_maps[i].length);
+  }
+  free(table->log_maps);
+  if (table->log_fd != -1) {
+    close(table->log_fd);
+  }
+  free(table->added);
+  free(table->added_ends);
+  free(table->original_ends);
+  free(table->original_bases);
+  free(table->original_wide);
+  free(table->original_crs);
+  free(table->original_cr_counts);
+  table->slabs = NULL;
+  table->n_slabs = 0;
+  table->texts = NULL;
+  table->n_texts = 0;
+  table->log_maps = NULL;
+  table->n_log_maps = 0;
+  table->log_fd = -1;
+  table->slab = NULL;
+  table->gap_text = NULL;
+  table->added = NULL;
+  table->added_ends = NULL;
+  table->original_ends = NULL;
+  table->original_bases = NULL;
+  table->original_wide = NULL;
+  table->original_crs = NULL;
+  table->original_cr_counts = NULL;
+}
+
+size_t piece_table_line_count(PieceTable *table) {
+  return node_lines(table->root);
+}
+
+static PieceNode *find_piece(PieceTable *table, size_t row, size_t *offset) {
+  PieceNode *node = table->root;
+  while (node != NULL) {
+    size_t left_lines = node_lines(node->left);
+    if (row < left_lines) {
+      node = node->left;
+    } else if (row < left_lines + node->piece.count) {
+      *offset = row - left_lines;
+      return node;
+    } else {
+      row -= left_lines + node->piece.count;
+      node = node->right;
+    }
+  }
+  return NULL;
+}
+
+static Line stored_line(PieceTable *table, PieceSource source, size_t index) {
+  if (source == PIECE_ADD) {
+    return table->added[index];
+  }
+  size_t start;
+  size_t end;
+  if (table->original_sparse) {
+    end = scan_sparse(table, index, &start, NULL);
+  } else {
+    start = index > 0 ? original_end(table, index - 1) : 0;
+    end = original_end(table, index);
+  }
+  return original_line(table, start, end - 1);
+}
+
+static bool is_gap_line(PieceTable *table, PieceSource source, size_t index) {
+  return source == PIECE_ADD && table->gap_text != NULL &&
+         index == table->gap_index;
+}
+
+static void move_gap(PieceTable *table, size_t position) {
+  char *text = table->gap_text;
+  size_t gap_end = table->gap_start + table->gap_length;
+  if (position < table->gap_start) {
+    size_t count = table->gap_start - position;
+    memmove(text + gap_end - count, text + position, count);
+  } else if (position > table->gap_start) {
+    size_t count = position - table->gap_start;
+    memmove(text + table->gap_start, text + gap_end, count);
+  }
+  table->gap_start = position;
+}
+
+static Line clip_line(PieceTable *table, PieceSource source, size_t index,
+                      Line line, size_t start, size_t length) {
+  if (start > line.length) {
+    start = line.length;
+  }
+  if (length > line.length - start) {
+    length = line.length - start;
+  }
+  if (length == 0) {
+    return (Line){NULL, 0};
+  }
+
+  if (!is_gap_line(table, source, index)) {
+    return (Line){line.data + start, length};
+  }
+
+  size_t end = start + length;
+  if (table->gap_start > start && table->gap_start < end) {
+    move_gap(table, table->gap_start - start < end - table->gap_start ? start
+                                                                      : end);
+  }
+  if (start >= table->gap_start) {
+    start += table->gap_length;
+  }
+  return (Line){table->gap_text + start, length};
+}
+
+static Line line_range(PieceTable *table, PieceSource source, size_t index,
+                       size_t start, size_t length) {
+  return clip_line(table, source, index, stored_line(table, source, index),
+                   start, length);
+}
+
+Line piece_table_get_line(PieceTable *table, size_t row) {
+  return piece_table_get_line_range(table, row, 0, SIZE_MAX);
+}
+
+Line piece_table_get_line_range(PieceTable *table, size_t row, size_t start,
+                                size_t length) {
+  size_t offset;
+  PieceNode *node = find_piece(table, row, &offset);
+  if (node == NULL) {
+    return (Line){NULL, 0};
+  }
+  return line_range(table, node->piece.source, node->piece.start + offset,
+                    start, length);
+}
+
+size_t piece_table_line_length(PieceTable *table, size_t row) {
+  size_t offset;
+  PieceNode *node = find_piece(table, row, &offset);
+  if (node == NULL) {
+    return 0;
+  }
+  return stored_line(table, node->piece.source, node->piece.start + offset)
+      .length;
+}
+
+size_t piece_table_byte_count(PieceTable *table) {
+  return node_bytes(table->root);
+}
+
+size_t piece_table_row_offset(PieceTable *table, size_t row) {
+  size_t offset = 0;
+  PieceNode *node = table->root;
+  while (node != NULL) {
+    size_t left_lines = node_lines(node->left);
+    if (row < left_lines) {
+      node = node->left;
+    } else if (row < left_lines + node->piece.count) {
+      return offset + node_bytes(node->left) +
+             range_bytes(table, node->piece.source, node->piece.start,
+                         row - left_lines);
+    } else {
+      offset += node_bytes(node->left) + node->piece_bytes;
+      row -= left_lines + node->piece.count;
+      node = node->right;
+    }
+  }
+  return offset;
+}
+
+size_t piece_table_offset_row(PieceTable *table, size_t offset,
+                              size_t *column) {
+  size_t row = 0;
+  PieceNode *node = table->root;
+  while (node != NULL) {
+    size_t left_bytes = node_bytes(node->left);
+    if (offset < left_bytes) {
+      node = node->left;
+    } else if (offset < left_bytes + node->piece_bytes) {
+      Piece piece = node->piece;
+      offset -= left_bytes;
+      size_t low = 0;
+      size_t high = piece.count - 1;
+      while (low < high) {
+        size_t mid = low + (high - low + 1) / 2;
+        if (range_bytes(table, piece.source, piece.start, mid) <= offset) {
+          low = mid;
+        } else {
+          high = mid - 1;
+        }
+      }
+      *column = offset - range_bytes(table, piece.source, piece.start, low);
+      return row + node_lines(node->left) + low;
+    } else {
+      offset -= left_bytes + node->piece_bytes;
+      row += node_lines(node->left) + node->piece.count;
+      node = node->right;
+    }
+  }
+
+  size_t count = piece_table_line_count(table);
+  if (count == 0) {
+    *column = 0;
+    return 0;
+  }
+  *column = piece_table_line_length(table, count - 1);
+  return count - 1;
+}
+
+void piece_table_iterate(PieceTable *table, size_t row,
+                         LineIterator *iterator) {
+  iterator->table = table;
+  iterator->row = row;
+  iterator->remaining = 0;
+}
+
+bool piece_table_next_line_range(LineIterator *iterator, size_t start,
+                                 size_t length, Line *line) {
+  if (iterator->remaining == 0) {
+    size_t offset;
+    PieceNode *node = find_piece(iterator->table, iterator->row, &offset);
+    if (node == NULL) {
+      return false;
+    }
+    iterator->source = node->piece.source;
+    iterator->index = node->piece.start + offset;
+    iterator->remaining = node->piece.count - offset;
+    if (iterator->source == PIECE_ORIGINAL && iterator->table->original_sparse) {
+      scan_sparse(iterator->table, iterator->index, &iterator->position, NULL);
+    }
+  }
+  if (iterator->source == PIECE_ORIGINAL && iterator->table->original_sparse) {
+    size_t newline = next_newline(iterator->table, iterator->position);
+    Line stored = original_line(iterator->table, iterator->position, newline);
+    iterator->position = newline + 1;
+    *line = clip_line(iterator->table, iterator->source, iterator->index++,
+                      stored, start, length);
+  } else {
+    *line = line_range(iterator->table, iterator->source, iterator->index++,
+                       start, length);
+  }
+  iterator->remaining--;
+  iterator->row++;
+  return true;
+}
+
+bool piece_table_next_line(LineIterator *iterator, Line *line) {
+  return piece_table_next_line_range(iterator, 0, SIZE_MAX, line);
+}
+
+static bool reserve_original(PieceTable *table, size_t count) {
+  if (table->original_length + count <= table->original_capacity) {
+    return true;
+  }
+  size_t new_capacity =
+      table->original_capacity == 0 ? 4096 : table->original_capacity * 2;
+  while (new_capacity < table->original_length + count) {
+    new_capacity *= 2;
+  }
+
+  if (table->original_wide != NULL) {
+    size_t *wide =
+        realloc(table->original_wide, new_capacity * sizeof(size_t));
+    if (wide == NULL) {
+      return false;
+    }
+    table->original_wide = wide;
+  } else {
+    if (!table->original_sparse) {
+      uint32_t *ends =
+          realloc(table->original_ends, new_capacity * sizeof(uint32_t));
+      if (ends == NULL) {
+        return false;
+      }
+      table->original_ends = ends;
+    }
+    size_t *bases = realloc(table->original_bases,
+                            (new_capacity / ORIGINAL_BLOCK) * sizeof(size_t));
+    if (bases == NULL) {
+      return false;
+    }
+    table->original_bases = bases;
+  }
+
+  if (!table->original_sparse) {
+    uint64_t *crs =
+        realloc(table->original_crs, (new_capacity / 64) * sizeof(uint64_t));
+    if (crs == NULL) {
+      return false;
+    }
+    table->original_crs = crs;
+  }
+  size_t *cr_counts = realloc(table->original_cr_counts,
+                              (new_capacity / ORIGINAL_BLOCK) * sizeof(size_t));
+  if (cr_counts == NULL) {
+    return false;
+  }
+  table->original_cr_counts = cr_counts;
+  table->original_capacity = new_capacity;
+  return true;
+}
+
+static bool widen_original(PieceTable *table, size_t length) {
+  size_t *wide = malloc(table->original_capacity * sizeof(size_t));
+  if (wide == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++) {
+    wide[i] = original_end(table, i);
+  }
+  free(table->original_ends);
+  free(table->original_bases);
+  table->original_ends = NULL;
+  table->original_bases = NULL;
+  table->original_wide = wide;
+  return true;
+}
+
+bool piece_table_append_original(PieceTable *table, const size_t *ends,
+                                 size_t count) {
+  if (count == 0) {
+    return true;
+  }
+  if (!reserve_nodes(table, 1) || !reserve_original(table, count)) {
+    return false;
+  }
+
+  size_t start = table->original_length > 0 ? table->original_limit + 1 : 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t index = table->original_length + i;
+    size_t block = index / ORIGINAL_BLOCK;
+    if (index % ORIGINAL_BLOCK == 0) {
+      table->original_cr_counts[block] = table->original_cr_total;
+      if (table->original_wide == NULL) {
+        table->original_bases[block] = start;
+      }
+    }
+
+    size_t end = ends[i] & ~LINE_END_CR;
+    bool cr = (ends[i] & LINE_END_CR) != 0;
+    if (cr) {
+      table->original_cr_total++;
+    }
+    if (!table->original_sparse) {
+      if (index % 64 == 0) {
+        table->original_crs[index / 64] = 0;
+      }
+      if (cr) {
+        table->original_crs[index / 64] |= 1ULL << (index % 64);
+      }
+    }
+    start = end;
+
+    if (table->original_sparse) {
+      continue;
+    }
+    if (table->original_wide == NULL) {
+      if (end - table->original_bases[block] <= UINT32_MAX) {
+        table->original_ends[index] = end - table->original_bases[block];
+        continue;
+      }
+      if (!widen_original(table, index)) {
+        return false;
+      }
+    }
+    table->original_wide[index] = end;
+  }
+  table->original_limit = start - 1;
+
+  table->root = append_piece(
+      table, table->root,
+      (Piece){PIECE_ORIGINAL, table->original_length, count});
+  table->original_length += count;
+  return true;
+}
+
+static char *map_log(PieceTable *table, size_t length) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  length = (length + page - 1) / page * page;
+
+  if (table->n_log_maps >= table->log_maps_capacity) {
+    size_t new_capacity =
+        table->log_maps_capacity == 0 ? 16 : table->log_maps_capacity * 2;
+    Mapping *maps = realloc(table->log_maps, new_capacity * sizeof(Mapping));
+    if (maps == NULL) {
+      return NULL;
+    }
+    table->log_maps = maps;
+    table->log_maps_capacity = new_capacity;
+  }
+
+  if (ftruncate(table->log_fd, table->log_length + length) == -1) {
+    return NULL;
+  }
+  char *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   table->log_fd, table->log_length);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  table->log_maps[table->n_log_maps++] = (Mapping){map, length};
+  table->log_length += length;
+  return map;
+}
+
+static char *allocate_text(PieceTable *table, size_t length) {
+  if (table->log_fd != -1) {
+    return map_log(table, length);
+  }
+  char *slab = malloc(length);
+  if (slab == NULL || !add_text(table, slab, length)) {
+    free(slab);
+    return NULL;
+  }
+  return slab;
+}
+
+void piece_table_attach_log(PieceTable *table, int fd) {
+  table->log_fd = fd;
+  table->slab = NULL;
+}
+
+char *piece_table_reserve_text(PieceTable *table, size_t length) {
+  if (length > SLAB_SIZE / 4) {
+    return allocate_text(table, length);
+  }
+
+  if (table->slab == NULL || table->slab_used + length > SLAB_SIZE) {
+    char *slab = allocate_text(table, SLAB_SIZE);
+    if (slab == NULL) {
+      return NULL;
+    }
+    table->slab = slab;
+    table->slab_used = 0;
+  }
+
+  char *text = table->slab + table->slab_used;
+  table->slab_used += length;
+  return text;
+}
+
+char *piece_table_extend_text(PieceTable *table, const char *end,
+                              size_t length) {
+  if (table->slab == NULL || end != table->slab + table->slab_used ||
+      table->slab_used + length > SLAB_SIZE) {
+    return NULL;
+  }
+  char *text = table->slab + table->slab_used;
+  table->slab_used += length;
+  return text;
+}
+
+static bool reserve_added(PieceTable *table, size_t count) {
+  if (table->added_length + count <= table->added_capacity) {
+    return true;
+  }
+  size_t new_capacity =
+      table->added_capacity == 0 ? 256 : table->added_capacity * 2;
+  while (new_capacity < table->added_length + count) {
+    new_capacity *= 2;
+  }
+  Line *added = realloc(table->added, new_capacity * sizeof(Line));
+  if (added == NULL) {
+    return false;
+  }
+  table->added = added;
+  size_t *ends = realloc(table->added_ends, new_capacity * sizeof(size_t));
+  if (ends == NULL) {
+    return false;
+  }
+  table->added_ends = ends;
+  table->added_capacity = new_capacity;
+  return true;
+}
+
+static void push_added(PieceTable *table, Line line) {
+  size_t index = table->added_length++;
+  table->added[index] = line;
+  table->added_ends[index] =
+      (index > 0 ? table->added_ends[index - 1] : 0) + line.length + 1;
+}
+
+size_t piece_table_add_line(PieceTable *table, Line line) {
+  if (!reserve_added(table, 1)) {
+    return SIZE_MAX;
+  }
+  push_added(table, line);
+  return table->added_length - 1;
+}
+
+bool piece_table_replace(PieceTable *table, size_t row, size_t count,
+                         const Line *lines, size_t n_lines) {
+  piece_table_close_gap(table);
+  if (!reserve_nodes(table, 3) || !reserve_added(table, n_lines)) {
+    return false;
+  }
+
+  size_t start = table->added_length;
+  for (size_t i = 0; i < n_lines; i++) {
+    push_added(table, lines[i]);
+  }
+
+  PieceNode *left;
+  PieceNode *middle;
+  PieceNode *right;
+  split(table, table->root, row, &left, &middle);
+  split(table, middle, count, &middle, &right);
+  release_tree(table, middle);
+
+  if (n_lines > 0) {
+    left = append_piece(table, left, (Piece){PIECE_ADD, start, n_lines});
+  }
+  table->root = merge(left, right);
+  return true;
+}
+
+void piece_table_close_gap(PieceTable *table) {
+  if (table->gap_text == NULL) {
+    return;
+  }
+  Line *line = &table->added[table->gap_index];
+  move_gap(table, line->length);
+  size_t length = line->length > 0 ? line->length : 1;
+  char *text = realloc(table->gap_text, length);
+  if (text != NULL) {
+    table->texts[table->gap_slab] = (Mapping){text, length};
+    line->data = line->length > 0 ? text : NULL;
+  }
+  table->gap_text = NULL;
+}
+
+static bool open_gap(PieceTable *table, size_t row, PieceNode *node,
+                     size_t offset) {
+  Line line = line_range(table, node->piece.source, node->piece.start + offset,
+                         0, SIZE_MAX);
+  piece_table_close_gap(table);
+  if (!reserve_nodes(table, 3) || !reserve_added(table, 1)) {
+    return false;
+  }
+
+  size_t capacity = line.length + line.length / 2 + GAP_SIZE;
+  char *text = malloc(capacity);
+  if (text == NULL || !add_text(table, text, capacity)) {
+    free(text);
+    return false;
+  }
+  if (line.length > 0) {
+    memcpy(text, line.data, line.length);
+  }
+
+  table->gap_text = text;
+  table->gap_capacity = capacity;
+  table->gap_start = line.length;
+  table->gap_length = capacity - line.length;
+  table->gap_index = table->added_length;
+  table->gap_slab = table->n_texts - 1;
+  push_added(table, (Line){text, line.length});
+
+  PieceNode *left;
+  PieceNode *middle;
+  PieceNode *right;
+  split(table, table->root, row, &left, &middle);
+  split(table, middle, 1, &middle, &right);
+  release_tree(table, middle);
+  left = append_piece(table, left, (Piece){PIECE_ADD, table->gap_index, 1});
+  table->root = merge(left, right);
+  return true;
+}
+
+static bool grow_gap(PieceTable *table, size_t length) {
+  size_t line_length = table->added[table->gap_index].length;
+  size_t capacity = table->gap_capacity * 2;
+  if (capacity < line_length + length + GAP_SIZE) {
+    capacity = line_length + length + GAP_SIZE;
+  }
+  char *text = realloc(table->gap_text, capacity);
+  if (text == NULL) {
+    return false;
+  }
+  size_t tail = line_length - table->gap_start;
+  memmove(text + capacity - tail,
+          text + table->gap_start + table->gap_length, tail);
+  table->gap_text = text;
+  table->gap_capacity = capacity;
+  table->gap_length = capacity - line_length;
+  table->texts[table->gap_slab] = (Mapping){text, capacity};
+  table->added[table->gap_index].data = text;
+  return true;
+}
+
+static void resize_line_bytes(PieceTable *table, size_t row, size_t old_length,
+                              size_t new_length) {
+  table->added_ends[table->gap_index] =
+      table->added_ends[table->gap_index] - old_length + new_length;
+  PieceNode *node = table->root;
+  while (node != NULL) {
+    node->bytes = node->bytes - old_length + new_length;
+    node->added = node->added - old_length + new_length;
+    size_t left_lines = node_lines(node->left);
+    if (row < left_lines) {
+      node = node->left;
+    } else if (row < left_lines + node->piece.count) {
+      node->piece_bytes = node->piece_bytes - old_length + new_length;
+      return;
+    } else {
+      row -= left_lines + node->piece.count;
+      node = node->right;
+    }
+  }
+}
+
+bool piece_table_splice_line(PieceTable *table, size_t row, size_t col,
+                             size_t delete_length, const char *text,
+                             size_t length) {
+  size_t offset;
+  PieceNode *node = find_piece(table, row, &offset);
+  if (node == NULL) {
+    return false;
+  }
+  if (!is_gap_line(table, node->piece.source, node->piece.start + offset) &&
+      !open_gap(table, row, node, offset)) {
+    return false;
+  }
+
+  Line *line = &table->added[table->gap_index];
+  if (col > line->length) {
+    col = line->length;
+  }
+  if (delete_length > line->length - col) {
+    delete_length = line->length - col;
+  }
+  if (length > table->gap_length + delete_length &&
+      !grow_gap(table, length - delete_length)) {
+    return false;
+  }
+
+  size_t old_length = line->length;
+  move_gap(table, col);
+  table->gap_length += delete_length;
+  line->length -= delete_length;
+  if (length > 0) {
+    memcpy(table->gap_text + table->gap_start, text, length);
+  }
+  table->gap_start += length;
+  table->gap_length -= length;
+  line->length += length;
+  resize_line_bytes(table, row, old_length, line->length);
+  return true;
+}
+
+static size_t count_nodes(const PieceNode *node) {
+  if (node == NULL) {
+    return 0;
+  }
+  return count_nodes(node->left) + 1 + count_nodes(node->right);
+}
+
+static Piece *collect_pieces(const PieceNode *node, Piece *out) {
+  if (node == NULL) {
+    return out;
+  }
+  out = collect_pieces(node->left, out);
+  *out++ = node->piece;
+  return collect_pieces(node->right, out);
+}
+
+size_t piece_table_snapshot(PieceTable *table, Piece **pieces) {
+  piece_table_close_gap(table);
+  size_t length = count_nodes(table->root);
+  *pieces = malloc((length > 0 ? length : 1) * sizeof(Piece));
+  if (*pieces == NULL) {
+    return 0;
+  }
+  collect_pieces(table->root, *pieces);
+  return length;
+}
+
+static size_t collect_range(const PieceNode *node, size_t row, size_t count,
+                            Piece *out) {
+  if (node == NULL || count == 0) {
+    return 0;
+  }
+  size_t n = 0;
+  size_t start = node_lines(node->left);
+  size_t end = start + node->piece.count;
+  if (row < start) {
+    n += collect_range(node->left, row, count, out);
+  }
+  if (row < end && row + count > start) {
+    size_t from = row > start ? row - start : 0;
+    size_t to = row + count < end ? row + count - start : node->piece.count;
+    if (out != NULL) {
+      out[n] = (Piece){node->piece.source, node->piece.start + from,
+                       to - from};
+    }
+    n++;
+  }
+  if (row + count > end) {
+    size_t first = row > end ? row : end;
+    n += collect_range(node->right, first - end, row + count - first,
+                       out != NULL ? out + n : NULL);
+  }
+  return n;
+}
+
+size_t piece_table_copy_range(PieceTable *table, size_t row, size_t count,
+                              Piece *pieces) {
+  piece_table_close_gap(table);
+  return collect_range(table->root, row, count, pieces);
+}
+
+bool piece_table_replace_pieces(PieceTable *table, size_t row, size_t count,
+                                const Piece *pieces, size_t length) {
+  piece_table_close_gap(table);
+  if (!reserve_nodes(table, length + 2)) {
+    return false;
+  }
+
+  PieceNode *left;
+  PieceNode *middle;
+  PieceNode *right;
+  split(table, table->root, row, &left, &middle);
+  split(table, middle, count, &middle, &right);
+  release_tree(table, middle);
+
+  for (size_t i = 0; i < length; i++) {
+    left = append_piece(table, left, pieces[i]);
+  }
+  table->root = merge(left, right);
+  return true;
+}
+
+bool piece_table_gap_row(PieceTable *table, size_t row) {
+  size_t offset;
+  PieceNode *node = find_piece(table, row, &offset);
+  return node != NULL &&
+         is_gap_line(table, node->piece.source, node->piece.start + offset);
+}
+
+bool piece_table_freeze(PieceTable *table, PieceSnapshot *snapshot) {
+  snapshot->table = table;
+  snapshot->length = piece_table_snapshot(table, &snapshot->pieces);
+  if (snapshot->pieces == NULL) {
+    return false;
+  }
+  size_t capacity = table->added_length > 0 ? table->added_length : 1;
+  snapshot->added = malloc(capacity * sizeof(Line));
+  if (snapshot->added == NULL) {
+    free(snapshot->pieces);
+    snapshot->pieces = NULL;
+    return false;
+  }
+  if (table->added_length > 0) {
+    memcpy(snapshot->added, table->added, table->added_length * sizeof(Line));
+  }
+  return true;
+}
+
+void piece_table_free_snapshot(PieceSnapshot *snapshot) {
+  free(snapshot->pieces);
+  free(snapshot->added);
+  snapshot->pieces = NULL;
+  snapshot->added = NULL;
+  snapshot->length = 0;
+}
+
+Line piece_table_snapshot_line(PieceSnapshot *snapshot, PieceSource source,
+                               size_t index) {
+  if (source == PIECE_ADD) {
+    return snapshot->added[index];
+  }
+  return stored_line(snapshot->table, source, index);
+}
+
+void piece_table_iterate_spans(PieceSnapshot *snapshot, size_t row,
+                               SpanIterator *iterator) {
+  iterator->snapshot = snapshot;
+  iterator->piece = 0;
+  iterator->position = SIZE_MAX;
+  while (iterator->piece < snapshot->length &&
+         row >= snapshot->pieces[iterator->piece].count) {
+    row -= snapshot->pieces[iterator->piece].count;
+    iterator->piece++;
+  }
+  iterator->index = row;
+}
+
+static size_t original_range_crs(PieceTable *table, size_t start,
+                                 size_t count) {
+  size_t before = start > 0 ? original_crs_through(table, start - 1) : 0;
+  return original_crs_through(table, start + count - 1) - before;
+}
+
+bool piece_table_next_span(SpanIterator *iterator, Line *span, size_t *lines) {
+  PieceSnapshot *snapshot = iterator->snapshot;
+  while (iterator->piece < snapshot->length &&
+         iterator->index >= snapshot->pieces[iterator->piece].count) {
+    iterator->piece++;
+    iterator->index = 0;
+    iterator->position = SIZE_MAX;
+  }
+  if (iterator->piece >= snapshot->length) {
+    return false;
+  }
+
+  PieceTable *table = snapshot->table;
+  Piece piece = snapshot->pieces[iterator->piece];
+  if (piece.source == PIECE_ADD) {
+    *span = snapshot->added[piece.start + iterator->index++];
+    *lines = 1;
+    return true;
+  }
+
+  if (iterator->position == SIZE_MAX) {
+    size_t index = piece.start + iterator->index;
+    size_t count = piece.count - iterator->index;
+    size_t start = 0;
+    if (table->original_sparse) {
+      scan_sparse(table, index, &start, NULL);
+    } else if (index > 0) {
+      start = original_end(table, index - 1);
+    }
+    if (original_range_crs(table, index, count) == 0) {
+      size_t end = original_end(table, index + count - 1) - 1;
+      *span = (Line){end > start ? table->original_text + start : NULL,
+                     end - start};
+      *lines = count;
+      iterator->index = piece.count;
+      return true;
+    }
+    iterator->position = start;
+  }
+
+  size_t newline = next_newline(table, iterator->position);
+  *span = original_line(table, iterator->position, newline);
+  *lines = 1;
+  iterator->position = newline + 1;
+  iterator->index++;
+  return true;
+}
+
+size_t piece_table_piece_bytes(PieceTable *table, Piece piece) {
+  return range_bytes(table, piece.source, piece.start, piece.count);
+}
+
+size_t piece_table_detached_bytes(PieceTable *table) {
+  if (table->log_fd != -1 || table->added_length == 0) {
+    return 0;
+  }
+  size_t total = table->added_ends[table->added_length - 1];
+  size_t live = node_added(table->root);
+  return total > live ? total - live : 0;
+}
+
+static void mark_range(size_t *remap, Piece piece) {
+  if (piece.source == PIECE_ADD) {
+    for (size_t i = 0; i < piece.count; i++) {
+      remap[piece.start + i] = 0;
+    }
+  }
+}
+
+static void mark_tree(const PieceNode *node, size_t *remap) {
+  if (node != NULL) {
+    mark_tree(node->left, remap);
+    mark_range(remap, node->piece);
+    mark_tree(node->right, remap);
+  }
+}
+
+static void remap_tree(PieceNode *node, const size_t *remap) {
+  if (node != NULL) {
+    remap_tree(node->left, remap);
+    if (node->piece.source == PIECE_ADD) {
+      node->piece.start = remap[node->piece.start];
+    }
+    remap_tree(node->right, remap);
+  }
+}
+
+static int compare_texts(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)((const Mapping *)a)->data;
+  uintptr_t y = (uintptr_t)((const Mapping *)b)->data;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_refs(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)((const TextRef *)a)->data;
+  uintptr_t y = (uintptr_t)((const TextRef *)b)->data;
+  return x < y ? -1 : x > y;
+}
+
+static bool owned_text(const Mapping *texts, size_t n_texts, const char *data) {
+  size_t low = 0;
+  size_t high = n_texts;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if ((uintptr_t)texts[middle].data <= (uintptr_t)data) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low > 0 && (uintptr_t)data - (uintptr_t)texts[low - 1].data <
+                        texts[low - 1].length;
+}
+
+static size_t move_runs(const TextRef *refs, size_t count, char *out,
+                        Line *added) {
+  size_t length = 0;
+  for (size_t i = 0; i < count;) {
+    uintptr_t start = (uintptr_t)refs[i].data;
+    uintptr_t end = start;
+    for (; i < count && (uintptr_t)refs[i].data <= end; i++) {
+      uintptr_t line_end = (uintptr_t)refs[i].data + refs[i].length;
+      end = line_end > end ? line_end : end;
+      if (out != NULL) {
+        added[refs[i].index].data =
+            out + length + ((uintptr_t)refs[i].data - start);
+      }
+    }
+    if (out != NULL) {
+      memcpy(out + length, (const char *)start, end - start);
+    }
+    length += end - start;
+  }
+  return length;
+}
+
+bool piece_table_compact(PieceTable *table, Piece *const *kept,
+                         size_t n_kept) {
+  if (table->log_fd != -1) {
+    return false;
+  }
+  piece_table_close_gap(table);
+  size_t count = table->added_length;
+  size_t *remap = malloc((count > 0 ? count : 1) * sizeof(size_t));
+  Mapping *texts =
+      malloc((table->n_texts > 0 ? table->n_texts : 1) * sizeof(Mapping));
+  if (remap == NULL || texts == NULL) {
+    free(remap);
+    free(texts);
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    remap[i] = SIZE_MAX;
+  }
+  mark_tree(table->root, remap);
+  for (size_t i = 0; i < n_kept; i++) {
+    mark_range(remap, *kept[i]);
+  }
+  if (table->n_texts > 0) {
+    memcpy(texts, table->texts, table->n_texts * sizeof(Mapping));
+  }
+  qsort(texts, table->n_texts, sizeof(Mapping), compare_texts);
+
+  size_t n_live = 0;
+  size_t n_refs = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (remap[i] != SIZE_MAX) {
+      remap[i] = n_live++;
+      n_refs += table->added[i].length > 0 &&
+                owned_text(texts, table->n_texts, table->added[i].data);
+    }
+  }
+  size_t capacity = n_live > 0 ? n_live : 1;
+  TextRef *refs = malloc((n_refs > 0 ? n_refs : 1) * sizeof(TextRef));
+  Line *added = malloc(capacity * sizeof(Line));
+  size_t *ends = malloc(capacity * sizeof(size_t));
+  Mapping *new_texts = malloc(sizeof(Mapping));
+  bool ok = refs != NULL && added != NULL && ends != NULL && new_texts != NULL;
+
+  n_refs = 0;
+  for (size_t i = 0; ok && i < count; i++) {
+    if (remap[i] == SIZE_MAX) {
+      continue;
+    }
+    Line line = table->added[i];
+    added[remap[i]] = line;
+    if (owned_text(texts, table->n_texts, line.data)) {
+      added[remap[i]].data = NULL;
+      if (line.length > 0) {
+        refs[n_refs++] = (TextRef){line.data, line.length, remap[i]};
+      }
+    }
+  }
+  size_t length = 0;
+  if (ok) {
+    qsort(refs, n_refs, sizeof(TextRef), compare_refs);
+    length = move_runs(refs, n_refs, NULL, NULL);
+  }
+  char *text = length > 0 ? malloc(length) : NULL;
+  if (!ok || (length > 0 && text == NULL)) {
+    free(remap);
+    free(texts);
+    free(refs);
+    free(added);
+    free(ends);
+    free(new_texts);
+    return false;
+  }
+  move_runs(refs, n_refs, text, added);
+  for (size_t i = 0; i < n_live; i++) {
+    ends[i] = (i > 0 ? ends[i - 1] : 0) + added[i].length + 1;
+  }
+
+  for (size_t i = 0; i < table->n_texts; i++) {
+    free(table->texts[i].data);
+  }
+  free(table->texts);
+  new_texts[0] = (Mapping){text, length};
+  table->texts = new_texts;
+  table->n_texts = text != NULL;
+  table->texts_capacity = 1;
+  table->slab = NULL;
+  table->slab_used = 0;
+  free(table->added);
+  free(table->added_ends);
+  table->added = added;
+  table->added_ends = ends;
+  table->added_length = n_live;
+  table->added_capacity = capacity;
+
+  remap_tree(table->root, remap);
+  for (size_t i = 0; i < n_kept; i++) {
+    if (kept[i]->source == PIECE_ADD) {
+      kept[i]->start = remap[kept[i]->start];
+    }
+  }
+  free(remap);
+  free(texts);
+  free(refs);
+  return true;
+}
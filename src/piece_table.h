@@ -0,0 +1,88 @@
+#ifndef PIECE_TABLE_H
+#define PIECE_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "main.h"
+
+bool init_piece_table(PieceTable *table, const char *text, const size_t *ends,
+                      size_t length, bool sparse);
+
+void free_piece_table(PieceTable *table);
+
+size_t piece_table_line_count(PieceTable *table);
+
+Line piece_table_get_line(PieceTable *table, size_t row);
+
+Line piece_table_get_line_range(PieceTable *table, size_t row, size_t start,
+                                size_t length);
+
+size_t piece_table_line_length(PieceTable *table, size_t row);
+
+size_t piece_table_byte_count(PieceTable *table);
+
+size_t piece_table_row_offset(PieceTable *table, size_t row);
+
+size_t piece_table_offset_row(PieceTable *table, size_t offset,
+                              size_t *column);
+
+void piece_table_iterate(PieceTable *table, size_t row,
+                         LineIterator *iterator);
+
+bool piece_table_next_line(LineIterator *iterator, Line *line);
+
+bool piece_table_next_line_range(LineIterator *iterator, size_t start,
+                                 size_t length, Line *line);
+
+bool piece_table_append_original(PieceTable *table, const size_t *ends,
+                                 size_t count);
+
+void piece_table_attach_log(PieceTable *table, int fd);
+
+char *piece_table_reserve_text(PieceTable *table, size_t length);
+
+char *piece_table_extend_text(PieceTable *table, const char *end,
+                              size_t length);
+
+bool piece_table_splice_line(PieceTable *table, size_t row, size_t col,
+                             size_t delete_length, const char *text,
+                             size_t length);
+
+void piece_table_close_gap(PieceTable *table);
+
+size_t piece_table_add_line(PieceTable *table, Line line);
+
+bool piece_table_replace(PieceTable *table, size_t row, size_t count,
+                         const Line *lines, size_t n_lines);
+
+size_t piece_table_snapshot(PieceTable *table, Piece **pieces);
+
+size_t piece_table_copy_range(PieceTable *table, size_t row, size_t count,
+                              Piece *pieces);
+
+bool piece_table_replace_pieces(PieceTable *table, size_t row, size_t count,
+                                const Piece *pieces, size_t length);
+
+bool piece_table_gap_row(PieceTable *table, size_t row);
+
+size_t piece_table_piece_bytes(PieceTable *table, Piece piece);
+
+size_t piece_table_detached_bytes(PieceTable *table);
+
+bool piece_table_compact(PieceTable *table, Piece *const *kept,
+                         size_t n_kept);
+
+bool piece_table_freeze(PieceTable *table, PieceSnapshot *snapshot);
+
+void piece_table_free_snapshot(PieceSnapshot *snapshot);
+
+Line piece_table_snapshot_line(PieceSnapshot *snapshot, PieceSource source,
+                               size_t index);
+
+void piece_table_iterate_spans(PieceSnapshot *snapshot, size_t row,
+                               SpanIterator *iterator);
+
+bool piece_table_next_span(SpanIterator *iterator, Line *span, size_t *lines);
+
+#endif
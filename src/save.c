@@ -1,26 +1,585 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include "buffer.h"
+#include "hash.h"
+#include "index_cache.h"
+#include "journal.h"
 #include "main.h"
+#include "piece_table.h"
 #include "save.h"
+#include "undo.h"
+#include "undo_file.h"
 
-void save_buffer(Buffer *buffer) {
-  if (buffer == NULL || buffer->file.name == NULL) {
-    return;
+#define SAVE_BATCH 1024
+#define SAVE_CHUNK (16 * 1024 * 1024)
+#define COPY_MINIMUM (64 * 1024)
+#define IN_PLACE_MINIMUM (16 * 1024 * 1024)
+#define IN_PLACE_FRACTION 8
+
+struct BufferSave {
+  pthread_t thread;
+  PieceSnapshot snapshot;
+  UndoHistory *history;
+  size_t history_nodes;
+  char *target;
+  size_t lines;
+  size_t from;
+  size_t start;
+  size_t row;
+  size_t column;
+  bool in_place;
+  int fd;
+  const char *map;
+  size_t map_length;
+  int map_fd;
+  size_t copy_limit;
+  size_t modified_from;
+  uint64_t journal_mark;
+  uint64_t generation;
+  bool verify;
+  uint64_t expected_hash;
+  ContentHash hash;
+  HashMarks *marks;
+  FileStamp stamp;
+  FileStamp replaced;
+  bool replaced_known;
+  mode_t mask;
+  size_t total;
+  atomic_size_t written;
+  atomic_bool finished;
+  bool succeeded;
+  bool queued;
+  bool queued_force;
+  char message[128];
+};
+
+static char newline = '\n';
+
+static mode_t creation_mask = 022;
+
+void capture_umask(void) {
+  creation_mask = umask(0);
+  umask(creation_mask);
+}
+
+static bool write_vectors(int fd, struct iovec *vectors, size_t count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, vectors, count);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      if (written == 0) {
+        errno = EIO;
+      }
+      return false;
+    }
+    while (count > 0 && (size_t)written >= vectors->iov_len) {
+      written -= vectors->iov_len;
+      vectors++;
+      count--;
+    }
+    if (count > 0) {
+      vectors->iov_base = (char *)vectors->iov_base + written;
+      vectors->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+static bool flush_vectors(BufferSave *save, int fd, struct iovec *vectors,
+                          size_t *count, size_t *pending) {
+  if (!write_vectors(fd, vectors, *count)) {
+    return false;
+  }
+  atomic_fetch_add(&save->written, *pending);
+  *count = 0;
+  *pending = 0;
+  return true;
+}
+
+static size_t copyable_bytes(BufferSave *save, Line span) {
+  if (save->map_fd == -1 || span.data < save->map ||
+      span.data + span.length > save->map + save->map_length) {
+    return 0;
   }
+  size_t offset = span.data - save->map;
+  if (offset >= save->copy_limit) {
+    return 0;
+  }
+  size_t length = save->copy_limit - offset;
+  length = length < span.length ? length : span.length;
+  return length >= COPY_MINIMUM ? length : 0;
+}
+
+static void copy_span(BufferSave *save, int fd, Line *span, size_t length) {
+  off_t offset = span->data - save->map;
+  while (length > 0) {
+    ssize_t copied =
+        copy_file_range(save->map_fd, &offset, fd, NULL, length, 0);
+    if (copied < 0 && errno == EINTR) {
+      continue;
+    }
+    if (copied <= 0) {
+      save->map_fd = -1;
+      return;
+    }
+    span->data += copied;
+    span->length -= copied;
+    length -= copied;
+    atomic_fetch_add(&save->written, copied);
+  }
+}
+
+static void hash_span(BufferSave *save, size_t offset, const char *data,
+                      size_t length) {
+  size_t hashed = save->hash.total;
+  if (offset + length > hashed) {
+    size_t skip = hashed > offset ? hashed - offset : 0;
+    update_marked_hash(&save->hash, save->marks, data + skip, length - skip);
+  }
+}
+
+static bool write_spans(BufferSave *save, int fd) {
+  struct iovec vectors[SAVE_BATCH];
+  size_t count = 0;
+  size_t pending = 0;
 
-  FILE *f = fopen(buffer->file.name, "w");
-  if (f == NULL) {
+  SpanIterator iterator;
+  piece_table_iterate_spans(&save->snapshot, save->row, &iterator);
+  size_t skip = save->column;
+  size_t offset = save->from;
+  Line span;
+  size_t lines;
+  while (piece_table_next_span(&iterator, &span, &lines)) {
+    span.data += skip;
+    span.length -= skip;
+    skip = 0;
+    hash_span(save, offset, span.data, span.length);
+    hash_span(save, offset + span.length, &newline, 1);
+    offset += span.length + 1;
+    if (offset <= save->start) {
+      atomic_fetch_add(&save->written, span.length + 1);
+      continue;
+    }
+    if (offset - span.length - 1 < save->start) {
+      size_t unwritten = save->start - (offset - span.length - 1);
+      span.data += unwritten;
+      span.length -= unwritten;
+      atomic_fetch_add(&save->written, unwritten);
+    }
+    if (count + 2 > SAVE_BATCH &&
+        !flush_vectors(save, fd, vectors, &count, &pending)) {
+      return false;
+    }
+    size_t copyable = copyable_bytes(save, span);
+    if (copyable > 0) {
+      if (!flush_vectors(save, fd, vectors, &count, &pending)) {
+        return false;
+      }
+      copy_span(save, fd, &span, copyable);
+    }
+    while (span.length > SAVE_CHUNK) {
+      vectors[count++] = (struct iovec){(char *)span.data, SAVE_CHUNK};
+      pending += SAVE_CHUNK;
+      if (!flush_vectors(save, fd, vectors, &count, &pending)) {
+        return false;
+      }
+      span.data += SAVE_CHUNK;
+      span.length -= SAVE_CHUNK;
+    }
+    if (span.length > 0) {
+      vectors[count++] = (struct iovec){(char *)span.data, span.length};
+    }
+    vectors[count++] = (struct iovec){&newline, 1};
+    pending += span.length + 1;
+  }
+  return flush_vectors(save, fd, vectors, &count, &pending);
+}
+
+static void sync_directory(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *directory =
+      slash == NULL ? strdup(".")
+                    : strndup(path, slash > path ? (size_t)(slash - path) : 1);
+  if (directory == NULL) {
     return;
   }
+  int fd = open(directory, O_RDONLY | O_DIRECTORY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(directory);
+}
+
+static char *resolve_target(const char *name) {
+  char *target = realpath(name, NULL);
+  return target != NULL ? target : strdup(name);
+}
+
+static bool save_failed(char *message, size_t size, int error) {
+  snprintf(message, size, "save failed: %s", strerror(error));
+  return false;
+}
+
+static bool write_in_place(BufferSave *save) {
+  char *message = save->message;
+  size_t size = sizeof(save->message);
+  bool written = lseek(save->fd, save->start, SEEK_SET) != -1 &&
+                 write_spans(save, save->fd);
+  off_t length = save->from + atomic_load(&save->written);
+  written = written && ftruncate(save->fd, length) == 0 &&
+            fsync(save->fd) == 0 && stamp_file(save->fd, &save->stamp);
+  int error = errno;
+  remove_index_cache(save->fd);
+  if (close(save->fd) != 0 && written) {
+    written = false;
+    error = errno;
+  }
+  save->fd = -1;
+  if (!written) {
+    return save_failed(message, size, error);
+  }
+  snprintf(message, size, "written %zu lines in place", save->lines);
+  return true;
+}
+
+static bool write_snapshot(BufferSave *save) {
+  char *message = save->message;
+  size_t size = sizeof(save->message);
+  size_t name_length = strlen(save->target);
+  char *temp_name = malloc(name_length + 8);
+  if (temp_name == NULL) {
+    return save_failed(message, size, errno);
+  }
+  memcpy(temp_name, save->target, name_length);
+  memcpy(temp_name + name_length, ".XXXXXX", 8);
+  save->replaced_known = stamp_path(save->target, &save->replaced);
+
+  int fd = mkstemp(temp_name);
+  if (fd == -1) {
+    int error = errno;
+    free(temp_name);
+    return save_failed(message, size, error);
+  }
+
+  struct stat st;
+  if (stat(save->target, &st) == 0) {
+    fchmod(fd, st.st_mode & 07777);
+  } else {
+    fchmod(fd, 0666 & ~save->mask);
+  }
+
+  bool written = write_spans(save, fd) && fsync(fd) == 0 &&
+                 stamp_file(fd, &save->stamp);
+  int error = errno;
+  if (close(fd) != 0 && written) {
+    written = false;
+    error = errno;
+  }
+  if (written && rename(temp_name, save->target) != 0) {
+    written = false;
+    error = errno;
+  }
+  if (!written) {
+    unlink(temp_name);
+    free(temp_name);
+    return save_failed(message, size, error);
+  }
 
-  for (size_t i = 0; i < buffer->length; i++) {
-    if (buffer->lines[i].length > 0) {
-      fwrite(buffer->lines[i].data, 1, buffer->lines[i].length, f);
+  sync_directory(save->target);
+  free(temp_name);
+  snprintf(message, size, "written %zu lines", save->lines);
+  return true;
+}
+
+static bool target_unchanged(BufferSave *save) {
+  bool unchanged = false;
+  int fd = open(save->target, O_RDONLY);
+  struct stat st;
+  if (fd != -1 && fstat(fd, &st) == 0) {
+    if (st.st_size == 0) {
+      unchanged = hash_content("", 0) == save->expected_hash;
+    } else {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (map != MAP_FAILED) {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        unchanged = hash_content(map, st.st_size) == save->expected_hash;
+        munmap(map, st.st_size);
+      }
     }
-    if (i < buffer->length) {
-      fputc('\n', f);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (!unchanged) {
+    snprintf(save->message, sizeof(save->message),
+             "file changed on disk, :w! to overwrite");
+  }
+  return unchanged;
+}
+
+static void *save_in_background(void *arg) {
+  BufferSave *save = arg;
+  if (save->verify && !target_unchanged(save)) {
+    save->succeeded = false;
+  } else if (save->in_place) {
+    save->succeeded = write_in_place(save);
+  } else {
+    save->succeeded = write_snapshot(save);
+  }
+  if (save->succeeded && save->history != NULL) {
+    save->history_nodes =
+        write_undo_history(save->history, &save->snapshot, save->target,
+                           &save->hash);
+  }
+  atomic_store(&save->finished, true);
+  return NULL;
+}
+
+static void free_save(BufferSave *save) {
+  if (save->fd != -1) {
+    close(save->fd);
+  }
+  piece_table_free_snapshot(&save->snapshot);
+  free_undo_history(save->history);
+  free_hash_marks(save->marks);
+  free(save->target);
+  free(save);
+}
+
+static bool plan_in_place(Buffer *buffer, BufferSave *save) {
+  FileStamp *disk = &buffer->disk_stamp;
+  size_t start = buffer->modified_from < disk->size ? buffer->modified_from
+                                                     : disk->size;
+  if (!buffer->disk_known || disk->size < IN_PLACE_MINIMUM ||
+      disk->size - start > disk->size / IN_PLACE_FRACTION) {
+    return false;
+  }
+  if (buffer->disk_is_original && buffer->table.original_cr_total > 0) {
+    return false;
+  }
+
+  FileStamp stamp;
+  if (!stamp_path(save->target, &stamp) || !same_stamp(&stamp, disk)) {
+    return false;
+  }
+  int fd = open(save->target, O_WRONLY);
+  if (fd == -1) {
+    return false;
+  }
+  if (!stamp_file(fd, &stamp) || !same_stamp(&stamp, disk) ||
+      (buffer->disk_is_original && !pin_buffer_pages(buffer, start))) {
+    close(fd);
+    return false;
+  }
+  save->in_place = true;
+  save->fd = fd;
+  save->start = start;
+  return true;
+}
+
+static void plan_copies(Buffer *buffer, BufferSave *save) {
+  save->map = buffer->map;
+  save->map_length = buffer->map_length;
+  save->map_fd = -1;
+  save->copy_limit = buffer->pinned_from;
+  FileStamp stamp;
+  if (buffer->map_fd != -1 && !(save->in_place && buffer->disk_is_original) &&
+      stamp_file(buffer->map_fd, &stamp) &&
+      same_stamp(&stamp, &buffer->map_stamp)) {
+    save->map_fd = buffer->map_fd;
+  }
+}
+
+static bool start_save(Buffer *buffer, bool force) {
+  if (buffer == NULL || buffer->file.name == NULL) {
+    return false;
+  }
+  if (buffer->save != NULL) {
+    buffer->save->queued = true;
+    buffer->save->queued_force = buffer->save->queued_force || force;
+    return true;
+  }
+
+  wait_for_buffer_load(buffer);
+  if (buffer->partial) {
+    snprintf(buffer->message, sizeof(buffer->message),
+             "save failed: file only partially loaded");
+    return false;
+  }
+  if (buffer->read_only) {
+    snprintf(buffer->message, sizeof(buffer->message),
+             "save failed: buffer is read-only");
+    return false;
+  }
+
+  FileStamp stamp;
+  bool on_disk =
+      buffer->disk_known && stamp_path(buffer->file.name, &stamp);
+  bool same = on_disk && same_stamp(&stamp, &buffer->disk_stamp);
+  bool verify = on_disk && !same && !force && buffer->content_hashed &&
+                stamp.size == buffer->disk_stamp.size;
+  if (on_disk && !same && !force && !verify) {
+    snprintf(buffer->message, sizeof(buffer->message),
+             "file changed on disk, :w! to overwrite");
+    return false;
+  }
+  if (same && !is_buffer_modified(buffer)) {
+    snprintf(buffer->message, sizeof(buffer->message), "no changes");
+    return true;
+  }
+
+  BufferSave *save = malloc(sizeof(BufferSave));
+  if (save == NULL) {
+    return save_failed(buffer->message, sizeof(buffer->message), errno);
+  }
+  save->target = resolve_target(buffer->file.name);
+  if (save->target == NULL ||
+      !piece_table_freeze(&buffer->table, &save->snapshot)) {
+    int error = errno;
+    free(save->target);
+    free(save);
+    return save_failed(buffer->message, sizeof(buffer->message), error);
+  }
+  use_undo_tree(buffer);
+  save->history = copy_undo_history(buffer);
+  save->history_nodes = 0;
+  save->lines = piece_table_line_count(&buffer->table);
+  save->in_place = false;
+  save->replaced_known = false;
+  save->mask = creation_mask;
+  save->fd = -1;
+  save->start = 0;
+  plan_in_place(buffer, save);
+  plan_copies(buffer, save);
+
+  bool resumable =
+      same && !(buffer->disk_is_original && buffer->table.original_cr_total > 0);
+  save->marks = resume_content_hash(resumable ? buffer->hash_marks : NULL,
+                                    buffer->modified_from, &save->hash);
+  save->from = save->hash.total < save->start ? save->hash.total : save->start;
+
+  size_t size = piece_table_byte_count(&buffer->table);
+  save->row = save->lines;
+  save->column = 0;
+  if (save->from < size) {
+    save->row = piece_table_offset_row(&buffer->table, save->from,
+                                       &save->column);
+  }
+  save->total = size - (save->from < size ? save->from : size);
+  save->modified_from = buffer->modified_from;
+  buffer->modified_from = SIZE_MAX;
+  save->journal_mark = mark_buffer_journal(buffer);
+  save->generation = buffer->generation;
+  save->verify = verify;
+  save->expected_hash = buffer->content_hash;
+  atomic_init(&save->written, 0);
+  atomic_init(&save->finished, false);
+  save->succeeded = false;
+  save->queued = false;
+  save->queued_force = false;
+  save->message[0] = '\0';
+
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int error = pthread_create(&save->thread, NULL, save_in_background, save);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (error != 0) {
+    unmark_buffer_journal(buffer);
+    mark_buffer_modified(buffer, save->modified_from);
+    free_save(save);
+    return save_failed(buffer->message, sizeof(buffer->message), error);
+  }
+
+  buffer->save = save;
+  buffer->message[0] = '\0';
+  return true;
+}
+
+static bool finish_buffer_save(Buffer *buffer) {
+  BufferSave *save = buffer->save;
+  pthread_join(save->thread, NULL);
+  buffer->save = NULL;
+  memcpy(buffer->message, save->message, sizeof(buffer->message));
+  release_buffer_pages(buffer);
+
+  bool succeeded = save->succeeded;
+  if (succeeded) {
+    buffer->disk_stamp = save->stamp;
+    buffer->disk_known = true;
+    if (!save->in_place) {
+      buffer->disk_is_original = false;
+      if (save->replaced_known) {
+        forget_index_cache(&save->replaced);
+      }
+    } else if (buffer->disk_is_original) {
+      buffer->map_stamp = save->stamp;
     }
+    buffer->saved_generation = save->generation;
+    buffer->content_hashed = true;
+    buffer->content_hash = finish_content_hash(&save->hash);
+    free_hash_marks(buffer->hash_marks);
+    buffer->hash_marks = save->marks;
+    save->marks = NULL;
+    rebase_buffer_journal(buffer, save->journal_mark, save->history_nodes);
+  } else {
+    unmark_buffer_journal(buffer);
+    mark_buffer_modified(buffer, save->modified_from);
+  }
+  bool queued = save->queued;
+  bool queued_force = save->queued_force;
+  free_save(save);
+  if (queued) {
+    return start_save(buffer, queued_force);
+  }
+  return succeeded;
+}
+
+bool save_buffer(Buffer *buffer) { return start_save(buffer, false); }
+
+bool force_save_buffer(Buffer *buffer) { return start_save(buffer, true); }
+
+bool poll_buffer_save(Buffer *buffer) {
+  if (buffer->save == NULL) {
+    return false;
   }
+  if (atomic_load(&buffer->save->finished)) {
+    finish_buffer_save(buffer);
+  }
+  return true;
+}
 
-  fclose(f);
+bool wait_for_buffer_save(Buffer *buffer) {
+  bool succeeded = true;
+  while (buffer->save != NULL) {
+    succeeded = finish_buffer_save(buffer);
+  }
+  return succeeded;
+}
+
+bool is_buffer_saving(Buffer *buffer) { return buffer->save != NULL; }
+
+double buffer_save_progress(Buffer *buffer) {
+  if (buffer->save == NULL || buffer->save->total == 0) {
+    return 1.0;
+  }
+  double progress =
+      (double)atomic_load(&buffer->save->written) / buffer->save->total;
+  return progress < 1.0 ? progress : 1.0;
 }
@@ -1,8 +1,22 @@
 #ifndef SAVE_H
 #define SAVE_H
 
+#include <stdbool.h>
+
 #include "main.h"
 
-void save_buffer(Buffer *buffer);
+void capture_umask(void);
+
+bool save_buffer(Buffer *buffer);
+
+bool force_save_buffer(Buffer *buffer);
+
+bool poll_buffer_save(Buffer *buffer);
+
+bool wait_for_buffer_save(Buffer *buffer);
+
+bool is_buffer_saving(Buffer *buffer);
+
+double buffer_save_progress(Buffer *buffer);
 
 #endif
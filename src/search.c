@@ -2,11 +2,12 @@
 #include <stddef.h>
 #include <string.h>
 
+#include "buffer.h"
 #include "main.h"
 #include "search.h"
 
-bool find_occurrence(Window *window, const char *search_str, size_t search_len,
-                     SearchDirection direction) {
+static bool find_in_buffer(Window *window, const char *search_str,
+                           size_t search_len, SearchDirection direction) {
   if (search_len == 0) {
     return false;
   }
@@ -14,16 +15,21 @@ bool find_occurrence(Window *window, const char *search_str, size_t search_len,
   Buffer *buffer = window->current_buffer;
   size_t start_row = window->cursor.row - 1;
 
+  wait_for_buffer_load(buffer);
+  size_t length = buffer_line_count(buffer);
+
   if (direction == SEARCH_FORWARD) {
     size_t start_col = window->cursor.column;
 
-    for (size_t row = start_row; row < buffer->length; row++) {
-      Line *line = &buffer->lines[row];
+    LineIterator iterator;
+    buffer_iterate(buffer, start_row, &iterator);
+    Line line;
+    for (size_t row = start_row; buffer_next_line(&iterator, &line); row++) {
       size_t col_start = (row == start_row) ? start_col : 0;
 
-      for (size_t col = col_start; col < line->length; col++) {
-        if (col + search_len <= line->length &&
-            strncmp(&line->data[col], search_str, search_len) == 0) {
+      for (size_t col = col_start; col < line.length; col++) {
+        if (col + search_len <= line.length &&
+            memcmp(&line.data[col], search_str, search_len) == 0) {
           window->cursor.row = row + 1;
           window->cursor.column = col + 1;
           return true;
@@ -31,11 +37,12 @@ bool find_occurrence(Window *window, const char *search_str, size_t search_len,
       }
     }
 
-    for (size_t row = 0; row < start_row; row++) {
-      Line *line = &buffer->lines[row];
-      for (size_t col = 0; col < line->length; col++) {
-        if (col + search_len <= line->length &&
-            strncmp(&line->data[col], search_str, search_len) == 0) {
+    buffer_iterate(buffer, 0, &iterator);
+    for (size_t row = 0;
+         row < start_row && buffer_next_line(&iterator, &line); row++) {
+      for (size_t col = 0; col < line.length; col++) {
+        if (col + search_len <= line.length &&
+            memcmp(&line.data[col], search_str, search_len) == 0) {
           window->cursor.row = row + 1;
           window->cursor.column = col + 1;
           return true;
@@ -45,23 +52,23 @@ bool find_occurrence(Window *window, const char *search_str, size_t search_len,
   } else {
     size_t start_col = window->cursor.column - 2;
 
-    if (start_row >= buffer->length) {
-      start_row = buffer->length - 1;
+    if (start_row >= length) {
+      start_row = length - 1;
     }
 
     for (size_t row = start_row + 1; row > 0; row--) {
       size_t r = row - 1;
-      Line *line = &buffer->lines[r];
-      size_t col_end = (r == start_row) ? start_col : line->length;
+      Line line = buffer_get_line(buffer, r);
+      size_t col_end = (r == start_row) ? start_col : line.length;
 
-      if (col_end > line->length) {
-        col_end = line->length;
+      if (col_end > line.length) {
+        col_end = line.length;
       }
 
       for (size_t col = col_end + 1; col > 0; col--) {
         size_t c = col - 1;
-        if (c + search_len <= line->length &&
-            strncmp(&line->data[c], search_str, search_len) == 0) {
+        if (c + search_len <= line.length &&
+            memcmp(&line.data[c], search_str, search_len) == 0) {
           window->cursor.row = r + 1;
           window->cursor.column = c + 1;
           return true;
@@ -69,13 +76,13 @@ bool find_occurrence(Window *window, const char *search_str, size_t search_len,
       }
     }
 
-    for (size_t row = buffer->length; row > start_row + 1; row--) {
+    for (size_t row = length; row > start_row + 1; row--) {
       size_t r = row - 1;
-      Line *line = &buffer->lines[r];
-      for (size_t col = line->length; col > 0; col--) {
+      Line line = buffer_get_line(buffer, r);
+      for (size_t col = line.length; col > 0; col--) {
         size_t c = col - 1;
-        if (c + search_len <= line->length &&
-            strncmp(&line->data[c], search_str, search_len) == 0) {
+        if (c + search_len <= line.length &&
+            memcmp(&line.data[c], search_str, search_len) == 0) {
           window->cursor.row = r + 1;
           window->cursor.column = c + 1;
           return true;
@@ -86,3 +93,10 @@ bool find_occurrence(Window *window, const char *search_str, size_t search_len,
 
   return false;
 }
+
+bool find_occurrence(Window *window, const char *search_str, size_t search_len,
+                     SearchDirection direction) {
+  bool found = find_in_buffer(window, search_str, search_len, direction);
+  release_buffer_pages(window->current_buffer);
+  return found;
+}
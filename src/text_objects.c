@@ -2,6 +2,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "buffer.h"
 #include "main.h"
 #include "text_objects.h"
 
@@ -11,26 +12,26 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
   size_t row = window->cursor.row - 1;
   size_t col = window->cursor.column - 1;
 
-  if (row >= buf->length)
+  if (row >= buffer_line_count(buf))
     return false;
 
-  Line *line = &buf->lines[row];
+  Line line = buffer_get_line(buf, row);
 
   if (text_obj == 'p') {
     size_t para_start = row;
     size_t para_end = row;
 
     for (size_t r = row; r > 0; r--) {
-      Line *check_line = &buf->lines[r - 1];
-      if (check_line->length == 0) {
+      Line check_line = buffer_get_line(buf, r - 1);
+      if (check_line.length == 0) {
         break;
       }
       para_start = r - 1;
     }
 
-    for (size_t r = row + 1; r < buf->length; r++) {
-      Line *check_line = &buf->lines[r];
-      if (check_line->length == 0) {
+    for (size_t r = row + 1; r < buffer_line_count(buf); r++) {
+      Line check_line = buffer_get_line(buf, r);
+      if (check_line.length == 0) {
         break;
       }
       para_end = r;
@@ -39,17 +40,17 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
     *start_row = para_start;
     *start_col = 0;
     *end_row = para_end;
-    *end_col = buf->lines[para_end].length;
+    *end_col = buffer_line_length(buf, para_end);
     return true;
   } else if (text_obj == 'w') {
-    if (col < line->length && isalnum((unsigned char)line->data[col])) {
+    if (col < line.length && isalnum((unsigned char)line.data[col])) {
       size_t start = col;
       size_t end = col;
 
-      while (start > 0 && isalnum((unsigned char)line->data[start - 1])) {
+      while (start > 0 && isalnum((unsigned char)line.data[start - 1])) {
         start--;
       }
-      while (end < line->length && isalnum((unsigned char)line->data[end])) {
+      while (end < line.length && isalnum((unsigned char)line.data[end])) {
         end++;
       }
 
@@ -85,9 +86,9 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
     if (is_bracket) {
       int depth = 0;
       for (size_t i = col; i > 0; i--) {
-        if (line->data[i - 1] == close_char) {
+        if (line.data[i - 1] == close_char) {
           depth++;
-        } else if (line->data[i - 1] == text_obj) {
+        } else if (line.data[i - 1] == text_obj) {
           if (depth == 0) {
             s_col = i;
             found_start = true;
@@ -99,11 +100,11 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
 
       if (!found_start) {
         for (size_t r = row; r > 0; r--) {
-          Line *prev_line = &buf->lines[r - 1];
-          for (size_t i = prev_line->length; i > 0; i--) {
-            if (prev_line->data[i - 1] == close_char) {
+          Line prev_line = buffer_get_line(buf, r - 1);
+          for (size_t i = prev_line.length; i > 0; i--) {
+            if (prev_line.data[i - 1] == close_char) {
               depth++;
-            } else if (prev_line->data[i - 1] == text_obj) {
+            } else if (prev_line.data[i - 1] == text_obj) {
               if (depth == 0) {
                 s_row = r - 1;
                 s_col = i;
@@ -123,10 +124,10 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
         bool search_current = (s_row == row);
         size_t search_start = search_current ? s_col : 0;
 
-        for (size_t i = search_start; i < line->length; i++) {
-          if (line->data[i] == text_obj) {
+        for (size_t i = search_start; i < line.length; i++) {
+          if (line.data[i] == text_obj) {
             depth++;
-          } else if (line->data[i] == close_char) {
+          } else if (line.data[i] == close_char) {
             if (depth == 0) {
               e_row = row;
               e_col = i;
@@ -138,12 +139,12 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
         }
 
         if (!found_end) {
-          for (size_t r = row + 1; r < buf->length; r++) {
-            Line *next_line = &buf->lines[r];
-            for (size_t i = 0; i < next_line->length; i++) {
-              if (next_line->data[i] == text_obj) {
+          for (size_t r = row + 1; r < buffer_line_count(buf); r++) {
+            Line next_line = buffer_get_line(buf, r);
+            for (size_t i = 0; i < next_line.length; i++) {
+              if (next_line.data[i] == text_obj) {
                 depth++;
-              } else if (next_line->data[i] == close_char) {
+              } else if (next_line.data[i] == close_char) {
                 if (depth == 0) {
                   e_row = r;
                   e_col = i;
@@ -160,7 +161,7 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
       }
     } else {
       for (size_t i = col; i > 0; i--) {
-        if (line->data[i - 1] == text_obj) {
+        if (line.data[i - 1] == text_obj) {
           s_col = i;
           found_start = true;
           break;
@@ -169,9 +170,9 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
 
       if (!found_start) {
         for (size_t r = row; r > 0; r--) {
-          Line *prev_line = &buf->lines[r - 1];
-          for (size_t i = prev_line->length; i > 0; i--) {
-            if (prev_line->data[i - 1] == text_obj) {
+          Line prev_line = buffer_get_line(buf, r - 1);
+          for (size_t i = prev_line.length; i > 0; i--) {
+            if (prev_line.data[i - 1] == text_obj) {
               s_row = r - 1;
               s_col = i;
               found_start = true;
@@ -187,8 +188,8 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
         bool search_current = (s_row == row);
         size_t search_start = search_current ? s_col : 0;
 
-        for (size_t i = search_start; i < line->length; i++) {
-          if (line->data[i] == close_char) {
+        for (size_t i = search_start; i < line.length; i++) {
+          if (line.data[i] == close_char) {
             e_row = row;
             e_col = i;
             found_end = true;
@@ -197,10 +198,10 @@ bool find_text_object(Window *window, char text_obj, size_t *start_row,
         }
 
         if (!found_end) {
-          for (size_t r = row + 1; r < buf->length; r++) {
-            Line *next_line = &buf->lines[r];
-            for (size_t i = 0; i < next_line->length; i++) {
-              if (next_line->data[i] == close_char) {
+          for (size_t r = row + 1; r < buffer_line_count(buf); r++) {
+            Line next_line = buffer_get_line(buf, r);
+            for (size_t i = 0; i < next_line.length; i++) {
+              if (next_line.data[i] == close_char) {
                 e_row = r;
                 e_col = i;
                 found_end = true;
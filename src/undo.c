@@ -1,33 +1,476 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "buffer.h"
+#include "journal.h"
+#include "lz.h"
+#include "piece_table.h"
+#include "save.h"
 #include "undo.h"
+#include "undo_file.h"
 
-void init_undo_stack(Context *ctx) {
-  ctx->undo_stack.states = NULL;
-  ctx->undo_stack.length = 0;
-  ctx->undo_stack.capacity = 0;
+#define NO_NODE SIZE_MAX
+#define NOT_CAPTURED SIZE_MAX
+
+static uint64_t undo_clock;
+
+void init_undo_tree(UndoTree *tree) {
+  tree->nodes = NULL;
+  tree->n_nodes = 0;
+  tree->nodes_capacity = 0;
+  tree->deltas = NULL;
+  tree->n_deltas = 0;
+  tree->deltas_capacity = 0;
+  tree->pieces = NULL;
+  tree->n_pieces = 0;
+  tree->pieces_capacity = 0;
+  tree->current = NO_NODE;
+  tree->splice_recorded = false;
+  tree->packed = NULL;
+  tree->packed_length = 0;
+  tree->used = 0;
+}
+
+void free_undo_tree(UndoTree *tree) {
+  free(tree->nodes);
+  free(tree->deltas);
+  free(tree->pieces);
+  free(tree->packed);
+  init_undo_tree(tree);
+}
+
+static size_t tree_bytes(const UndoTree *tree) {
+  return tree->nodes_capacity * sizeof(UndoNode) +
+         tree->deltas_capacity * sizeof(UndoDelta) +
+         tree->pieces_capacity * sizeof(Piece) + tree->packed_length;
+}
+
+size_t undo_history_bytes(Buffer *buffer) {
+  return tree_bytes(&buffer->undo) +
+         piece_table_detached_bytes(&buffer->table);
+}
+
+static size_t packed_sizes(const UndoTree *tree, size_t sizes[3]) {
+  sizes[0] = tree->n_nodes * sizeof(UndoNode);
+  sizes[1] = tree->n_deltas * sizeof(UndoDelta);
+  sizes[2] = tree->n_pieces * sizeof(Piece);
+  return sizes[0] + sizes[1] + sizes[2];
+}
+
+static bool pack_undo_tree(UndoTree *tree) {
+  size_t sizes[3];
+  size_t length = packed_sizes(tree, sizes);
+  size_t capacity = length + length / 16 + 64;
+  unsigned char *raw = malloc(length);
+  unsigned char *packed = malloc(capacity);
+  if (raw == NULL || packed == NULL) {
+    free(raw);
+    free(packed);
+    return false;
+  }
+  memcpy(raw, tree->nodes, sizes[0]);
+  memcpy(raw + sizes[0], tree->deltas, sizes[1]);
+  memcpy(raw + sizes[0] + sizes[1], tree->pieces, sizes[2]);
+  size_t packed_length = lz_compress(raw, length, packed, capacity);
+  free(raw);
+  if (packed_length == 0) {
+    free(packed);
+    return false;
+  }
+  unsigned char *shrunk = realloc(packed, packed_length);
+  tree->packed = shrunk != NULL ? shrunk : packed;
+  tree->packed_length = packed_length;
+
+  free(tree->nodes);
+  free(tree->deltas);
+  free(tree->pieces);
+  tree->nodes = NULL;
+  tree->deltas = NULL;
+  tree->pieces = NULL;
+  tree->nodes_capacity = 0;
+  tree->deltas_capacity = 0;
+  tree->pieces_capacity = 0;
+  return true;
+}
+
+static bool unpack_undo_tree(UndoTree *tree) {
+  size_t sizes[3];
+  size_t length = packed_sizes(tree, sizes);
+  unsigned char *raw = malloc(length);
+  UndoNode *nodes = malloc(sizes[0]);
+  UndoDelta *deltas = malloc(sizes[1] > 0 ? sizes[1] : 1);
+  Piece *pieces = malloc(sizes[2] > 0 ? sizes[2] : 1);
+  if (raw == NULL || nodes == NULL || deltas == NULL || pieces == NULL ||
+      !lz_decompress(tree->packed, tree->packed_length, raw, length)) {
+    free(raw);
+    free(nodes);
+    free(deltas);
+    free(pieces);
+    return false;
+  }
+  memcpy(nodes, raw, sizes[0]);
+  memcpy(deltas, raw + sizes[0], sizes[1]);
+  memcpy(pieces, raw + sizes[0] + sizes[1], sizes[2]);
+  free(raw);
+
+  free(tree->packed);
+  tree->packed = NULL;
+  tree->packed_length = 0;
+  tree->nodes = nodes;
+  tree->deltas = deltas;
+  tree->pieces = pieces;
+  tree->nodes_capacity = tree->n_nodes;
+  tree->deltas_capacity = tree->n_deltas;
+  tree->pieces_capacity = tree->n_pieces;
+  return true;
+}
+
+static size_t delta_end(UndoTree *tree, size_t index) {
+  return index + 1 < tree->n_nodes ? tree->nodes[index + 1].first
+                                   : tree->n_deltas;
+}
+
+static size_t keep_pieces(Piece **kept, Piece *pieces, size_t first,
+                          size_t length) {
+  size_t n = 0;
+  for (size_t i = first; i < first + length; i++) {
+    if (pieces[i].source == PIECE_ADD) {
+      kept[n++] = &pieces[i];
+    }
+  }
+  return n;
+}
+
+static void compact_history_text(Buffer *buffer) {
+  UndoTree *tree = &buffer->undo;
+  if (tree->packed != NULL || is_buffer_saving(buffer)) {
+    return;
+  }
+  Piece **kept = malloc((tree->n_pieces > 0 ? tree->n_pieces : 1) *
+                        sizeof(Piece *));
+  if (kept == NULL) {
+    return;
+  }
+  size_t n_kept = 0;
+  for (size_t i = 0; i < tree->n_deltas; i++) {
+    UndoDelta *delta = &tree->deltas[i];
+    if (delta->stored) {
+      continue;
+    }
+    n_kept += keep_pieces(kept + n_kept, tree->pieces, delta->old_first,
+                          delta->old_length);
+    if (delta->new_first != NOT_CAPTURED) {
+      n_kept += keep_pieces(kept + n_kept, tree->pieces, delta->new_first,
+                            delta->new_length);
+    }
+  }
+  piece_table_compact(&buffer->table, kept, n_kept);
+  free(kept);
+}
+
+static void drop_undo_history(Buffer *buffer) {
+  free_undo_tree(&buffer->undo);
+  journal_history_dropped(buffer);
+  compact_history_text(buffer);
+}
+
+void use_undo_tree(Buffer *buffer) {
+  UndoTree *tree = &buffer->undo;
+  if (tree->packed != NULL && !unpack_undo_tree(tree)) {
+    drop_undo_history(buffer);
+  }
+  tree->used = ++undo_clock;
+}
+
+static Buffer *coldest_history(Context *ctx, Buffer *active, bool packed) {
+  Buffer *coldest = NULL;
+  for (size_t i = 0; i < ctx->n_buffers; i++) {
+    Buffer *buffer = ctx->buffers[i];
+    UndoTree *tree = &buffer->undo;
+    if (buffer != active && tree->n_nodes > 0 &&
+        (tree->packed != NULL) == packed &&
+        (coldest == NULL || tree->used < coldest->undo.used)) {
+      coldest = buffer;
+    }
+  }
+  return coldest;
+}
+
+static size_t node_bytes(Buffer *buffer, size_t index) {
+  UndoTree *tree = &buffer->undo;
+  size_t bytes = sizeof(UndoNode);
+  for (size_t i = tree->nodes[index].first; i < delta_end(tree, index); i++) {
+    const UndoDelta *delta = &tree->deltas[i];
+    size_t length = delta->old_length +
+                    (delta->new_first != NOT_CAPTURED ? delta->new_length : 0);
+    bytes += sizeof(UndoDelta) + length * sizeof(Piece);
+    for (size_t j = 0; !delta->stored && j < delta->old_length; j++) {
+      Piece piece = tree->pieces[delta->old_first + j];
+      if (piece.source == PIECE_ADD) {
+        bytes += piece_table_piece_bytes(&buffer->table, piece);
+      }
+    }
+  }
+  return bytes;
+}
+
+static void copy_pieces(Piece *pieces, size_t *n_pieces, const Piece *from,
+                        size_t *first, size_t length) {
+  if (*first == NOT_CAPTURED) {
+    return;
+  }
+  if (length > 0) {
+    memcpy(pieces + *n_pieces, from + *first, length * sizeof(Piece));
+  }
+  *first = *n_pieces;
+  *n_pieces += length;
 }
 
-static void free_undo_state(UndoState *state) {
-  if (state->lines != NULL) {
-    for (size_t i = 0; i < state->length; i++) {
-      free(state->lines[i].data);
+static bool trim_undo_tree(Buffer *buffer, size_t target) {
+  UndoTree *tree = &buffer->undo;
+  if (tree->packed != NULL || tree->current == 0 || tree->n_nodes < 2 ||
+      is_buffer_saving(buffer)) {
+    return false;
+  }
+  size_t *sizes = malloc(tree->n_nodes * sizeof(size_t));
+  Piece *pieces = malloc((tree->n_pieces > 0 ? tree->n_pieces : 1) *
+                         sizeof(Piece));
+  if (sizes == NULL || pieces == NULL) {
+    free(sizes);
+    free(pieces);
+    return false;
+  }
+  for (size_t i = 0; i < tree->n_nodes; i++) {
+    sizes[i] = node_bytes(buffer, i);
+  }
+  for (size_t i = tree->n_nodes; i-- > 1;) {
+    sizes[tree->nodes[i].parent] += sizes[i];
+  }
+
+  UndoNode *nodes = tree->nodes;
+  size_t root = tree->current;
+  while (nodes[root].parent != 0 && sizes[nodes[root].parent] <= target) {
+    root = nodes[root].parent;
+  }
+
+  size_t *remap = sizes;
+  size_t depth = nodes[root].depth;
+  size_t n_nodes = 0;
+  size_t n_deltas = 0;
+  size_t n_pieces = 0;
+  for (size_t i = root; i < tree->n_nodes; i++) {
+    remap[i] = i == root || (nodes[i].parent >= root &&
+                             remap[nodes[i].parent] != NO_NODE)
+                   ? n_nodes++
+                   : NO_NODE;
+  }
+  for (size_t i = root; i < tree->n_nodes; i++) {
+    if (remap[i] == NO_NODE) {
+      continue;
     }
-    free(state->lines);
-    state->lines = NULL;
+    UndoNode node = nodes[i];
+    size_t first = i == root ? delta_end(tree, i) : node.first;
+    size_t end = delta_end(tree, i);
+    node.parent = i == root ? NO_NODE : remap[node.parent];
+    node.child = node.child != NO_NODE ? remap[node.child] : NO_NODE;
+    node.depth -= depth;
+    node.first = n_deltas;
+    if (i == root) {
+      node.branch = 0;
+      node.generation = node.result;
+    }
+    for (size_t j = first; j < end; j++) {
+      UndoDelta delta = tree->deltas[j];
+      copy_pieces(pieces, &n_pieces, tree->pieces, &delta.old_first,
+                  delta.old_length);
+      copy_pieces(pieces, &n_pieces, tree->pieces, &delta.new_first,
+                  delta.new_length);
+      tree->deltas[n_deltas++] = delta;
+    }
+    nodes[remap[i]] = node;
+  }
+  tree->current = remap[tree->current];
+  free(sizes);
+
+  free(tree->pieces);
+  size_t capacity = n_pieces > 0 ? n_pieces : 1;
+  Piece *shrunk_pieces = realloc(pieces, capacity * sizeof(Piece));
+  tree->pieces = shrunk_pieces != NULL ? shrunk_pieces : pieces;
+  tree->pieces_capacity = shrunk_pieces != NULL ? capacity : tree->n_pieces;
+  tree->n_pieces = n_pieces;
+  tree->n_nodes = n_nodes;
+  tree->n_deltas = n_deltas;
+  UndoNode *shrunk_nodes = realloc(tree->nodes, n_nodes * sizeof(UndoNode));
+  if (shrunk_nodes != NULL) {
+    tree->nodes = shrunk_nodes;
+    tree->nodes_capacity = n_nodes;
+  }
+  UndoDelta *shrunk_deltas =
+      realloc(tree->deltas, (n_deltas > 0 ? n_deltas : 1) * sizeof(UndoDelta));
+  if (shrunk_deltas != NULL) {
+    tree->deltas = shrunk_deltas;
+    tree->deltas_capacity = n_deltas > 0 ? n_deltas : 1;
   }
-  state->length = 0;
+  journal_history_dropped(buffer);
+  compact_history_text(buffer);
+  return true;
 }
 
-void free_undo_stack(Context *ctx) {
-  for (size_t i = 0; i < ctx->undo_stack.length; i++) {
-    free_undo_state(&ctx->undo_stack.states[i]);
+static void enforce_undo_budget(Context *ctx, Buffer *active) {
+  if (ctx->undo_budget == 0) {
+    return;
   }
-  free(ctx->undo_stack.states);
-  ctx->undo_stack.states = NULL;
-  ctx->undo_stack.length = 0;
-  ctx->undo_stack.capacity = 0;
+  size_t total = 0;
+  for (size_t i = 0; i < ctx->n_buffers; i++) {
+    Buffer *buffer = ctx->buffers[i];
+    if (buffer->undo.n_nodes == 0 &&
+        piece_table_detached_bytes(&buffer->table) > 0) {
+      compact_history_text(buffer);
+    }
+    total += undo_history_bytes(buffer);
+  }
+  while (total > ctx->undo_budget) {
+    Buffer *buffer = coldest_history(ctx, active, false);
+    if (buffer != NULL) {
+      size_t before = undo_history_bytes(buffer);
+      if (pack_undo_tree(&buffer->undo)) {
+        total = total - before + undo_history_bytes(buffer);
+        continue;
+      }
+    } else {
+      buffer = coldest_history(ctx, active, true);
+    }
+    if (buffer == NULL) {
+      break;
+    }
+    total -= undo_history_bytes(buffer);
+    drop_undo_history(buffer);
+    total += undo_history_bytes(buffer);
+  }
+  if (total <= ctx->undo_budget) {
+    return;
+  }
+
+  size_t others = total - undo_history_bytes(active);
+  size_t target = ctx->undo_budget / 4 * 3;
+  trim_undo_tree(active, target > others ? target - others : 0);
+}
+
+static void *grow(void *items, size_t *capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) {
+    return items;
+  }
+  size_t new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+  void *new_items = realloc(items, new_capacity * size);
+  if (new_items != NULL) {
+    *capacity = new_capacity;
+  }
+  return new_items;
+}
+
+static bool reserve_pieces(UndoTree *tree, size_t count) {
+  Piece *pieces = grow(tree->pieces, &tree->pieces_capacity,
+                       tree->n_pieces + count, sizeof(Piece));
+  if (pieces == NULL) {
+    return false;
+  }
+  tree->pieces = pieces;
+  return true;
+}
+
+static size_t add_node(UndoTree *tree, size_t parent, Cursor cursor,
+                       uint64_t generation) {
+  UndoNode *nodes = grow(tree->nodes, &tree->nodes_capacity,
+                         tree->n_nodes + 1, sizeof(UndoNode));
+  if (nodes == NULL) {
+    return NO_NODE;
+  }
+  tree->nodes = nodes;
+
+  size_t index = tree->n_nodes++;
+  UndoNode *node = &nodes[index];
+  node->parent = parent;
+  node->child = NO_NODE;
+  node->branch = parent != NO_NODE ? nodes[parent].children++ : 0;
+  node->children = 0;
+  node->first = tree->n_deltas;
+  node->depth = parent != NO_NODE ? nodes[parent].depth + 1 : 0;
+  node->cursor = cursor;
+  node->generation = generation;
+  node->result = generation;
+  node->time = time(NULL);
+  if (parent != NO_NODE) {
+    nodes[parent].child = index;
+  }
+  tree->current = index;
+  return index;
+}
+
+static size_t capture_pieces(Buffer *buffer, size_t row, size_t count,
+                             size_t *first) {
+  UndoTree *tree = &buffer->undo;
+  size_t length = piece_table_copy_range(&buffer->table, row, count, NULL);
+  if (!reserve_pieces(tree, length)) {
+    return NOT_CAPTURED;
+  }
+  *first = tree->n_pieces;
+  tree->n_pieces +=
+      piece_table_copy_range(&buffer->table, row, count, tree->pieces + *first);
+  return length;
+}
+
+void record_undo(Buffer *buffer, size_t row, size_t count, size_t n_lines) {
+  UndoTree *tree = &buffer->undo;
+  tree->splice_recorded = false;
+  if (tree->n_nodes == 0) {
+    return;
+  }
+  use_undo_tree(buffer);
+  if (tree->n_nodes == 0) {
+    return;
+  }
+  if (tree->current != tree->n_nodes - 1 &&
+      add_node(tree, tree->current, (Cursor){row + 1, 1},
+               tree->nodes[tree->current].result) == NO_NODE) {
+    free_undo_tree(tree);
+    return;
+  }
+
+  UndoDelta *deltas = grow(tree->deltas, &tree->deltas_capacity,
+                           tree->n_deltas + 1, sizeof(UndoDelta));
+  if (deltas == NULL) {
+    free_undo_tree(tree);
+    return;
+  }
+  tree->deltas = deltas;
+
+  UndoDelta *delta = &deltas[tree->n_deltas];
+  delta->row = row;
+  delta->count = n_lines;
+  delta->old_length = capture_pieces(buffer, row, count, &delta->old_first);
+  delta->new_first = NOT_CAPTURED;
+  delta->new_length = 0;
+  delta->stored = false;
+  if (delta->old_length == NOT_CAPTURED) {
+    free_undo_tree(tree);
+    return;
+  }
+  tree->n_deltas++;
+  tree->nodes[tree->current].result = buffer->generation;
+}
+
+void record_undo_splice(Buffer *buffer, size_t row) {
+  UndoTree *tree = &buffer->undo;
+  if (tree->splice_recorded && piece_table_gap_row(&buffer->table, row)) {
+    return;
+  }
+  record_undo(buffer, row, 1, 1);
+  tree->splice_recorded = true;
 }
 
 void push_undo_state(Context *ctx) {
@@ -38,96 +481,336 @@ void push_undo_state(Context *ctx) {
     return;
   }
 
-  if (ctx->undo_stack.length >= ctx->undo_stack.capacity) {
-    size_t new_capacity =
-        ctx->undo_stack.capacity == 0 ? 16 : ctx->undo_stack.capacity * 2;
-    UndoState *new_states =
-        realloc(ctx->undo_stack.states, sizeof(UndoState) * new_capacity);
-    if (new_states == NULL) {
-      return;
-    }
-    ctx->undo_stack.states = new_states;
-    ctx->undo_stack.capacity = new_capacity;
-  }
-
-  UndoState *state = &ctx->undo_stack.states[ctx->undo_stack.length];
-  state->length = buffer->length;
-  state->cursor = window->cursor;
-
-  if (buffer->length > 0) {
-    state->lines = malloc(sizeof(Line) * buffer->length);
-    if (state->lines == NULL) {
-      return;
-    }
-
-    for (size_t i = 0; i < buffer->length; i++) {
-      state->lines[i].length = buffer->lines[i].length;
-      state->lines[i].capacity = buffer->lines[i].capacity;
-      if (buffer->lines[i].length > 0 && buffer->lines[i].data != NULL) {
-        state->lines[i].data = malloc(buffer->lines[i].capacity);
-        if (state->lines[i].data != NULL) {
-          memcpy(state->lines[i].data, buffer->lines[i].data,
-                 buffer->lines[i].length);
-        } else {
-          state->lines[i].length = 0;
-          state->lines[i].capacity = 0;
-        }
-      } else {
-        state->lines[i].data = NULL;
-        state->lines[i].capacity = 0;
-      }
+  wait_for_buffer_load(buffer);
+
+  use_undo_tree(buffer);
+  load_undo_file(buffer);
+  UndoTree *tree = &buffer->undo;
+  tree->splice_recorded = false;
+  if (tree->n_nodes == 0 &&
+      add_node(tree, NO_NODE, window->cursor, buffer->generation) == NO_NODE) {
+    return;
+  }
+
+  size_t current = tree->current;
+  UndoNode *node = &tree->nodes[current];
+  if (current > 0 && current == tree->n_nodes - 1 &&
+      node->first == tree->n_deltas) {
+    node->cursor = window->cursor;
+    node->generation = buffer->generation;
+    node->result = buffer->generation;
+    node->time = time(NULL);
+  } else if (add_node(tree, current, window->cursor, buffer->generation) ==
+             NO_NODE) {
+    return;
+  }
+  journal_checkpoint(buffer);
+  enforce_undo_budget(ctx, buffer);
+}
+
+static size_t piece_lines(const Piece *pieces, size_t length) {
+  size_t lines = 0;
+  for (size_t i = 0; i < length; i++) {
+    lines += pieces[i].count;
+  }
+  return lines;
+}
+
+static bool resolve_delta(Buffer *buffer, UndoDelta *delta) {
+  UndoTree *tree = &buffer->undo;
+  if (!delta->stored) {
+    return true;
+  }
+  if (!resolve_undo_pieces(buffer, tree->pieces + delta->old_first,
+                           delta->old_length) ||
+      (delta->new_first != NOT_CAPTURED &&
+       !resolve_undo_pieces(buffer, tree->pieces + delta->new_first,
+                            delta->new_length))) {
+    return false;
+  }
+  delta->stored = false;
+  return true;
+}
+
+static bool revert_delta(Buffer *buffer, UndoDelta *delta, bool journaled) {
+  UndoTree *tree = &buffer->undo;
+  if (!resolve_delta(buffer, delta)) {
+    return false;
+  }
+  if (delta->new_first == NOT_CAPTURED) {
+    size_t first;
+    size_t length = capture_pieces(buffer, delta->row, delta->count, &first);
+    if (length == NOT_CAPTURED) {
+      return false;
     }
+    delta->new_first = first;
+    delta->new_length = length;
+  }
+  mark_buffer_modified(buffer,
+                       piece_table_row_offset(&buffer->table, delta->row));
+  if (!piece_table_replace_pieces(&buffer->table, delta->row, delta->count,
+                                  tree->pieces + delta->old_first,
+                                  delta->old_length)) {
+    return false;
+  }
+  size_t restored =
+      piece_lines(tree->pieces + delta->old_first, delta->old_length);
+  publish_buffer_change(buffer, delta->row, delta->count, restored);
+  if (journaled) {
+    journal_replace(buffer, delta->row, delta->count, restored);
+  }
+  return true;
+}
+
+static bool apply_delta(Buffer *buffer, UndoDelta *delta, bool journaled) {
+  UndoTree *tree = &buffer->undo;
+  if (!resolve_delta(buffer, delta)) {
+    return false;
+  }
+  size_t removed =
+      piece_lines(tree->pieces + delta->old_first, delta->old_length);
+  mark_buffer_modified(buffer,
+                       piece_table_row_offset(&buffer->table, delta->row));
+  if (!piece_table_replace_pieces(&buffer->table, delta->row, removed,
+                                  tree->pieces + delta->new_first,
+                                  delta->new_length)) {
+    return false;
+  }
+  publish_buffer_change(buffer, delta->row, removed, delta->count);
+  if (journaled) {
+    journal_replace(buffer, delta->row, removed, delta->count);
+  }
+  return true;
+}
+
+static bool step_back(Buffer *buffer) {
+  UndoTree *tree = &buffer->undo;
+  size_t index = tree->current;
+  bool followed = journal_follows_node(buffer, index);
+  for (size_t i = delta_end(tree, index); i > tree->nodes[index].first; i--) {
+    if (!revert_delta(buffer, &tree->deltas[i - 1], !followed)) {
+      free_undo_tree(tree);
+      return false;
+    }
+  }
+
+  UndoNode *node = &tree->nodes[index];
+  tree->nodes[node->parent].child = index;
+  tree->current = node->parent;
+  tree->splice_recorded = false;
+  buffer->generation = node->generation;
+  if (followed) {
+    journal_undo(buffer);
   } else {
-    state->lines = NULL;
+    journal_history_dropped(buffer);
   }
+  return true;
+}
 
-  ctx->undo_stack.length++;
+static bool step_forward(Buffer *buffer, size_t index) {
+  UndoTree *tree = &buffer->undo;
+  bool followed = journal_follows_node(buffer, index);
+  for (size_t i = tree->nodes[index].first; i < delta_end(tree, index); i++) {
+    if (!apply_delta(buffer, &tree->deltas[i], !followed)) {
+      free_undo_tree(tree);
+      return false;
+    }
+  }
+
+  UndoNode *node = &tree->nodes[index];
+  tree->nodes[node->parent].child = index;
+  tree->current = index;
+  tree->splice_recorded = false;
+  buffer->generation = node->result;
+  if (followed) {
+    journal_redo(buffer);
+  } else {
+    journal_history_dropped(buffer);
+  }
+  return true;
+}
+
+static bool travel(Buffer *buffer, size_t target, Cursor *cursor) {
+  UndoTree *tree = &buffer->undo;
+  UndoNode *nodes = tree->nodes;
+  size_t ancestor = target;
+  size_t from = tree->current;
+  while (nodes[ancestor].depth > nodes[from].depth) {
+    ancestor = nodes[ancestor].parent;
+  }
+  while (nodes[from].depth > nodes[ancestor].depth) {
+    from = nodes[from].parent;
+  }
+  while (from != ancestor) {
+    from = nodes[from].parent;
+    ancestor = nodes[ancestor].parent;
+  }
+
+  while (tree->current != ancestor) {
+    *cursor = nodes[tree->current].cursor;
+    if (!step_back(buffer)) {
+      return false;
+    }
+  }
+  for (size_t index = target; index != ancestor;
+       index = nodes[index].parent) {
+    nodes[nodes[index].parent].child = index;
+  }
+  while (tree->current != target) {
+    size_t child = nodes[tree->current].child;
+    if (!step_forward(buffer, child)) {
+      return false;
+    }
+    *cursor = nodes[child].cursor;
+  }
+  return true;
+}
+
+static Buffer *undo_buffer(Context *ctx) {
+  Buffer *buffer = ctx->windows[ctx->current_window]->current_buffer;
+  if (buffer != NULL) {
+    wait_for_buffer_load(buffer);
+    use_undo_tree(buffer);
+    load_undo_file(buffer);
+  }
+  return buffer;
 }
 
 void undo(Context *ctx) {
   Window *window = ctx->windows[ctx->current_window];
-  Buffer *buffer = window->current_buffer;
+  Buffer *buffer = undo_buffer(ctx);
+  if (buffer == NULL) {
+    return;
+  }
+  UndoTree *tree = &buffer->undo;
+  if (tree->n_nodes == 0 || tree->current == 0) {
+    snprintf(buffer->message, sizeof(buffer->message),
+             "already at oldest change");
+    return;
+  }
+  Cursor cursor = tree->nodes[tree->current].cursor;
+  if (step_back(buffer)) {
+    window->cursor = cursor;
+  }
+}
+
+void redo(Context *ctx) {
+  Window *window = ctx->windows[ctx->current_window];
+  Buffer *buffer = undo_buffer(ctx);
+  if (buffer == NULL) {
+    return;
+  }
+  UndoTree *tree = &buffer->undo;
+  if (tree->n_nodes == 0 || tree->nodes[tree->current].child == NO_NODE) {
+    snprintf(buffer->message, sizeof(buffer->message),
+             "already at newest change");
+    return;
+  }
+  size_t child = tree->nodes[tree->current].child;
+  if (step_forward(buffer, child)) {
+    window->cursor = tree->nodes[child].cursor;
+  }
+}
+
+bool redo_branch(Context *ctx, size_t branch) {
+  Window *window = ctx->windows[ctx->current_window];
+  Buffer *buffer = undo_buffer(ctx);
+  if (buffer == NULL || buffer->undo.n_nodes == 0) {
+    return false;
+  }
+  UndoTree *tree = &buffer->undo;
+  for (size_t i = tree->current + 1; i < tree->n_nodes; i++) {
+    if (tree->nodes[i].parent == tree->current &&
+        tree->nodes[i].branch == branch) {
+      if (!step_forward(buffer, i)) {
+        return false;
+      }
+      window->cursor = tree->nodes[i].cursor;
+      return true;
+    }
+  }
+  return false;
+}
+
+void undo_time(Context *ctx, long step, bool seconds) {
+  Window *window = ctx->windows[ctx->current_window];
+  Buffer *buffer = undo_buffer(ctx);
+  if (buffer == NULL) {
+    return;
+  }
+  UndoTree *tree = &buffer->undo;
+  if (tree->n_nodes == 0) {
+    snprintf(buffer->message, sizeof(buffer->message), "no changes to undo");
+    return;
+  }
 
-  if (ctx->undo_stack.length == 0 || buffer == NULL) {
-    return;
-  }
-
-  ctx->undo_stack.length--;
-  UndoState *state = &ctx->undo_stack.states[ctx->undo_stack.length];
-
-  for (size_t i = 0; i < buffer->length; i++) {
-    free(buffer->lines[i].data);
-  }
-  free(buffer->lines);
-
-  buffer->length = state->length;
-  window->cursor = state->cursor;
-
-  if (state->length > 0) {
-    buffer->lines = malloc(sizeof(Line) * state->length);
-    if (buffer->lines != NULL) {
-      for (size_t i = 0; i < state->length; i++) {
-        buffer->lines[i].length = state->lines[i].length;
-        buffer->lines[i].capacity = state->lines[i].capacity;
-        if (state->lines[i].length > 0 && state->lines[i].data != NULL) {
-          buffer->lines[i].data = malloc(state->lines[i].capacity);
-          if (buffer->lines[i].data != NULL) {
-            memcpy(buffer->lines[i].data, state->lines[i].data,
-                   state->lines[i].length);
-          } else {
-            buffer->lines[i].data = NULL;
-            buffer->lines[i].length = 0;
-            buffer->lines[i].capacity = 0;
-          }
-        } else {
-          buffer->lines[i].data = NULL;
-          buffer->lines[i].capacity = 0;
-        }
+  size_t current = tree->current;
+  size_t target = 0;
+  if (seconds) {
+    time_t when = tree->nodes[current].time + step;
+    for (size_t i = tree->n_nodes; i-- > 0;) {
+      if (tree->nodes[i].time <= when) {
+        target = i;
+        break;
       }
     }
+  } else if (step < 0) {
+    size_t back = (size_t)-step;
+    target = back < current ? current - back : 0;
   } else {
-    buffer->lines = NULL;
+    size_t last = tree->n_nodes - 1;
+    target = (size_t)step < last - current ? current + (size_t)step : last;
   }
 
-  free_undo_state(state);
+  Cursor cursor = window->cursor;
+  if (target != current && travel(buffer, target, &cursor)) {
+    window->cursor = cursor;
+  }
+  snprintf(buffer->message, sizeof(buffer->message), "change %zu of %zu",
+           tree->n_nodes > 0 ? tree->current : 0,
+           tree->n_nodes > 0 ? tree->n_nodes - 1 : 0);
+}
+
+static int format_bytes(char *text, size_t size, size_t bytes) {
+  if (bytes >= 1024 * 1024) {
+    return snprintf(text, size, "%.1fM", bytes / (1024.0 * 1024.0));
+  }
+  if (bytes >= 1024) {
+    return snprintf(text, size, "%.1fK", bytes / 1024.0);
+  }
+  return snprintf(text, size, "%zuB", bytes);
+}
+
+void report_undo_stats(Context *ctx) {
+  Buffer *active = ctx->windows[ctx->current_window]->current_buffer;
+  if (active == NULL) {
+    return;
+  }
+  char total_text[16];
+  char budget_text[16];
+  size_t total = 0;
+  for (size_t i = 0; i < ctx->n_buffers; i++) {
+    total += undo_history_bytes(ctx->buffers[i]);
+  }
+  format_bytes(total_text, sizeof(total_text), total);
+  format_bytes(budget_text, sizeof(budget_text), ctx->undo_budget);
+
+  char *message = active->message;
+  size_t size = sizeof(active->message);
+  int used = snprintf(message, size, "undo %s of %s:", total_text,
+                      ctx->undo_budget > 0 ? budget_text : "unlimited");
+  for (size_t i = 0; i < ctx->n_buffers && used >= 0 && (size_t)used < size;
+       i++) {
+    Buffer *buffer = ctx->buffers[i];
+    const UndoTree *tree = &buffer->undo;
+    const char *name = strrchr(buffer->file.name, '/');
+    name = name != NULL ? name + 1 : buffer->file.name;
+    char bytes_text[16];
+    format_bytes(bytes_text, sizeof(bytes_text), undo_history_bytes(buffer));
+    int n = snprintf(message + used, size - (size_t)used, " %s%s %s/%zu%s",
+                     buffer == active ? "*" : "", name,
+                     bytes_text, tree->n_nodes > 0 ? tree->n_nodes - 1 : 0,
+                     tree->packed != NULL ? "z" : "");
+    used = n < 0 ? n : used + n;
+  }
 }
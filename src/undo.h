@@ -3,12 +3,28 @@
 
 #include "main.h"
 
-void init_undo_stack(Context *ctx);
+void init_undo_tree(UndoTree *tree);
 
-void free_undo_stack(Context *ctx);
+void free_undo_tree(UndoTree *tree);
+
+size_t undo_history_bytes(Buffer *buffer);
+
+void use_undo_tree(Buffer *buffer);
+
+void record_undo(Buffer *buffer, size_t row, size_t count, size_t n_lines);
+
+void record_undo_splice(Buffer *buffer, size_t row);
 
 void push_undo_state(Context *ctx);
 
 void undo(Context *ctx);
 
+void redo(Context *ctx);
+
+bool redo_branch(Context *ctx, size_t branch);
+
+void undo_time(Context *ctx, long step, bool seconds);
+
+void report_undo_stats(Context *ctx);
+
 #endif
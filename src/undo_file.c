@@ -0,0 +1,721 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "hash.h"
+#include "journal.h"
+#include "piece_table.h"
+#include "undo.h"
+#include "undo_file.h"
+
+#define UNDO_FILE_MAGIC "EDUNDO01"
+#define NO_NODE SIZE_MAX
+#define NOT_CAPTURED SIZE_MAX
+
+enum { UNDO_FILE_ROWS, UNDO_FILE_TEXT };
+
+enum { KEY_ORIGINAL, KEY_ADD, KEY_STORED };
+
+typedef struct {
+  char magic[8];
+  uint64_t content_hash;
+  uint64_t size;
+  uint64_t n_lines;
+  uint64_t n_nodes;
+  uint64_t n_deltas;
+  uint64_t n_pieces;
+  uint64_t n_stored;
+  uint64_t text_length;
+  uint64_t current;
+  uint64_t check;
+} UndoFileHeader;
+
+typedef struct {
+  uint64_t parent;
+  uint64_t child;
+  uint64_t first;
+  uint64_t row;
+  uint64_t column;
+  int64_t time;
+} UndoFileNode;
+
+typedef struct {
+  uint64_t row;
+  uint64_t count;
+  uint64_t old_first;
+  uint64_t old_length;
+  uint64_t new_first;
+  uint64_t new_length;
+} UndoFileDelta;
+
+typedef struct {
+  uint64_t source;
+  uint64_t start;
+  uint64_t count;
+} UndoFilePiece;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t length;
+} UndoFileLine;
+
+typedef struct {
+  const UndoFileHeader *header;
+  const UndoFileNode *nodes;
+  const UndoFileDelta *deltas;
+  const UndoFilePiece *pieces;
+  const UndoFileLine *lines;
+  const char *text;
+} UndoFileSections;
+
+typedef struct {
+  size_t key;
+  size_t start;
+  size_t count;
+  size_t row;
+} HistoryRun;
+
+struct UndoHistory {
+  UndoNode *nodes;
+  size_t n_nodes;
+  UndoDelta *deltas;
+  size_t n_deltas;
+  Piece *pieces;
+  size_t n_pieces;
+  size_t current;
+  const char *map;
+  size_t map_length;
+};
+
+typedef struct {
+  UndoFilePiece *pieces;
+  size_t length;
+  size_t capacity;
+  HistoryRun *texts;
+  size_t n_texts;
+  size_t texts_capacity;
+} HistoryPieces;
+
+static char *undo_file_path(const char *name) {
+  char *resolved = realpath(name, NULL);
+  const char *path = resolved != NULL ? resolved : name;
+  const char *slash = strrchr(path, '/');
+  int directory = slash != NULL ? (int)(slash - path + 1) : 0;
+  size_t length = strlen(path) + 6;
+  char *undo_path = malloc(length);
+  if (undo_path != NULL) {
+    snprintf(undo_path, length, "%.*s.%s.un~", directory, path,
+             path + directory);
+  }
+  free(resolved);
+  return undo_path;
+}
+
+static bool map_sections(const char *map, size_t length,
+                         UndoFileSections *sections) {
+  if (map == NULL || length < sizeof(UndoFileHeader)) {
+    return false;
+  }
+  const UndoFileHeader *header = (const UndoFileHeader *)map;
+  if (memcmp(header->magic, UNDO_FILE_MAGIC, sizeof(header->magic)) != 0) {
+    return false;
+  }
+
+  const uint64_t counts[] = {header->n_nodes, header->n_deltas,
+                             header->n_pieces, header->n_stored};
+  const size_t sizes[] = {sizeof(UndoFileNode), sizeof(UndoFileDelta),
+                          sizeof(UndoFilePiece), sizeof(UndoFileLine)};
+  const char *starts[4];
+  size_t offset = sizeof(UndoFileHeader);
+  for (size_t i = 0; i < 4; i++) {
+    if (counts[i] > (length - offset) / sizes[i]) {
+      return false;
+    }
+    starts[i] = map + offset;
+    offset += counts[i] * sizes[i];
+  }
+  if (header->text_length > length - offset) {
+    return false;
+  }
+
+  sections->header = header;
+  sections->nodes = (const UndoFileNode *)starts[0];
+  sections->deltas = (const UndoFileDelta *)starts[1];
+  sections->pieces = (const UndoFilePiece *)starts[2];
+  sections->lines = (const UndoFileLine *)starts[3];
+  sections->text = map + offset;
+  return true;
+}
+
+static uint64_t metadata_check(const UndoFileSections *sections) {
+  return hash_content(sections->nodes,
+                      (const char *)sections->lines -
+                          (const char *)sections->nodes);
+}
+
+static bool read_nodes(UndoTree *tree, const UndoFileSections *sections) {
+  const UndoFileHeader *header = sections->header;
+  for (size_t i = 0; i < header->n_nodes; i++) {
+    const UndoFileNode *stored = &sections->nodes[i];
+    size_t previous = i > 0 ? tree->nodes[i - 1].first : 0;
+    if ((i == 0 ? stored->parent != UINT64_MAX : stored->parent >= i) ||
+        stored->first < previous || stored->first > header->n_deltas) {
+      return false;
+    }
+    UndoNode *node = &tree->nodes[i];
+    node->parent = i > 0 ? stored->parent : NO_NODE;
+    node->child = NO_NODE;
+    node->branch = i > 0 ? tree->nodes[node->parent].children++ : 0;
+    node->children = 0;
+    node->first = stored->first;
+    node->depth = i > 0 ? tree->nodes[node->parent].depth + 1 : 0;
+    node->cursor = (Cursor){stored->row, stored->column};
+    node->time = stored->time;
+  }
+  for (size_t i = 0; i < header->n_nodes; i++) {
+    uint64_t child = sections->nodes[i].child;
+    if (child != UINT64_MAX) {
+      if (child <= i || child >= header->n_nodes ||
+          sections->nodes[child].parent != i) {
+        return false;
+      }
+      tree->nodes[i].child = child;
+    }
+  }
+  return tree->nodes[0].first == 0;
+}
+
+static bool valid_range(uint64_t first, uint64_t length, uint64_t limit) {
+  return first <= limit && length <= limit - first;
+}
+
+static bool read_deltas(UndoTree *tree, const UndoFileSections *sections) {
+  const UndoFileHeader *header = sections->header;
+  for (size_t i = 0; i < header->n_deltas; i++) {
+    const UndoFileDelta *stored = &sections->deltas[i];
+    bool captured = stored->new_first != UINT64_MAX;
+    if (!valid_range(stored->old_first, stored->old_length,
+                     header->n_pieces) ||
+        (captured && !valid_range(stored->new_first, stored->new_length,
+                                  header->n_pieces))) {
+      return false;
+    }
+    tree->deltas[i] = (UndoDelta){
+        .row = stored->row,
+        .count = stored->count,
+        .old_first = stored->old_first,
+        .old_length = stored->old_length,
+        .new_first = captured ? stored->new_first : NOT_CAPTURED,
+        .new_length = captured ? stored->new_length : 0,
+        .stored = true,
+    };
+  }
+  for (size_t i = 0; i < header->n_pieces; i++) {
+    const UndoFilePiece *stored = &sections->pieces[i];
+    bool rows = stored->source == UNDO_FILE_ROWS;
+    if (stored->source > UNDO_FILE_TEXT ||
+        !valid_range(stored->start, stored->count,
+                     rows ? header->n_lines : header->n_stored)) {
+      return false;
+    }
+    tree->pieces[i] = (Piece){rows ? PIECE_ORIGINAL : PIECE_ADD,
+                              stored->start, stored->count};
+  }
+  return true;
+}
+
+static bool read_undo_file(Buffer *buffer, const char *map, size_t length) {
+  UndoFileSections sections;
+  if (!map_sections(map, length, &sections)) {
+    return false;
+  }
+  const UndoFileHeader *header = sections.header;
+  if (header->content_hash != buffer->content_hash ||
+      header->n_lines != buffer_line_count(buffer) || header->n_nodes < 2 ||
+      header->current >= header->n_nodes ||
+      header->check != metadata_check(&sections)) {
+    return false;
+  }
+
+  UndoTree *tree = &buffer->undo;
+  tree->nodes = malloc(header->n_nodes * sizeof(UndoNode));
+  tree->deltas = malloc((header->n_deltas + 1) * sizeof(UndoDelta));
+  tree->pieces = malloc((header->n_pieces + 1) * sizeof(Piece));
+  if (tree->nodes == NULL || tree->deltas == NULL || tree->pieces == NULL) {
+    return false;
+  }
+  tree->n_nodes = tree->nodes_capacity = header->n_nodes;
+  tree->n_deltas = header->n_deltas;
+  tree->deltas_capacity = header->n_deltas + 1;
+  tree->n_pieces = header->n_pieces;
+  tree->pieces_capacity = header->n_pieces + 1;
+  if (!read_nodes(tree, &sections) || !read_deltas(tree, &sections)) {
+    return false;
+  }
+
+  tree->current = header->current;
+  for (size_t i = 0; i < tree->n_nodes; i++) {
+    UndoNode *node = &tree->nodes[i];
+    node->result =
+        i == tree->current ? buffer->generation : ++buffer->last_generation;
+    node->generation = i > 0 ? tree->nodes[node->parent].result : node->result;
+  }
+  return true;
+}
+
+void load_undo_file(Buffer *buffer) {
+  if (buffer->undo_loaded) {
+    return;
+  }
+  buffer->undo_loaded = true;
+  if (buffer->file.name == NULL || !buffer->content_hashed ||
+      buffer->partial || buffer->last_generation != 0 ||
+      buffer->undo.n_nodes > 0) {
+    return;
+  }
+
+  char *path = undo_file_path(buffer->file.name);
+  if (path == NULL) {
+    return;
+  }
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(UndoFileHeader)) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+
+  if (!read_undo_file(buffer, map, st.st_size)) {
+    free_undo_tree(&buffer->undo);
+    munmap(map, st.st_size);
+    return;
+  }
+  buffer->undo_map = map;
+  buffer->undo_map_length = st.st_size;
+  journal_history_loaded(buffer);
+}
+
+bool resolve_undo_pieces(Buffer *buffer, Piece *pieces, size_t length) {
+  UndoFileSections sections;
+  if (!map_sections(buffer->undo_map, buffer->undo_map_length, &sections)) {
+    return false;
+  }
+  uint64_t text_length = sections.header->text_length;
+  for (size_t i = 0; i < length; i++) {
+    Piece *piece = &pieces[i];
+    if (piece->source != PIECE_ADD) {
+      continue;
+    }
+    size_t first = buffer->table.added_length;
+    for (size_t j = 0; j < piece->count; j++) {
+      const UndoFileLine *line = &sections.lines[piece->start + j];
+      if (!valid_range(line->offset, line->length, text_length)) {
+        return false;
+      }
+      Line text = {line->length > 0 ? sections.text + line->offset : NULL,
+                   line->length};
+      if (piece_table_add_line(&buffer->table, text) == SIZE_MAX) {
+        return false;
+      }
+    }
+    piece->start = first;
+  }
+  return true;
+}
+
+static void *copy_items(const void *items, size_t count, size_t size) {
+  void *copy = malloc(count > 0 ? count * size : 1);
+  if (copy != NULL && count > 0) {
+    memcpy(copy, items, count * size);
+  }
+  return copy;
+}
+
+UndoHistory *copy_undo_history(Buffer *buffer) {
+  if (!buffer->undo_loaded) {
+    return NULL;
+  }
+  UndoTree *tree = &buffer->undo;
+  UndoHistory *history = malloc(sizeof(UndoHistory));
+  if (history == NULL) {
+    return NULL;
+  }
+  history->nodes = copy_items(tree->nodes, tree->n_nodes, sizeof(UndoNode));
+  history->deltas =
+      copy_items(tree->deltas, tree->n_deltas, sizeof(UndoDelta));
+  history->pieces = copy_items(tree->pieces, tree->n_pieces, sizeof(Piece));
+  history->n_nodes = tree->n_nodes;
+  history->n_deltas = tree->n_deltas;
+  history->n_pieces = tree->n_pieces;
+  history->current = tree->current;
+  history->map = buffer->undo_map;
+  history->map_length = buffer->undo_map_length;
+  if (history->nodes == NULL || history->deltas == NULL ||
+      history->pieces == NULL) {
+    free_undo_history(history);
+    return NULL;
+  }
+  return history;
+}
+
+void free_undo_history(UndoHistory *history) {
+  if (history == NULL) {
+    return;
+  }
+  free(history->nodes);
+  free(history->deltas);
+  free(history->pieces);
+  free(history);
+}
+
+static void *grow(void *items, size_t *capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) {
+    return items;
+  }
+  size_t new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+  void *new_items = realloc(items, new_capacity * size);
+  if (new_items != NULL) {
+    *capacity = new_capacity;
+  }
+  return new_items;
+}
+
+static int compare_runs(const void *a, const void *b) {
+  const HistoryRun *left = a;
+  const HistoryRun *right = b;
+  if (left->key != right->key) {
+    return left->key < right->key ? -1 : 1;
+  }
+  if (left->start != right->start) {
+    return left->start < right->start ? -1 : 1;
+  }
+  return 0;
+}
+
+static size_t runs_after(const HistoryRun *runs, size_t n_runs, size_t key,
+                         size_t start) {
+  HistoryRun probe = {key, start, 0, 0};
+  size_t low = 0;
+  size_t high = n_runs;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (compare_runs(&runs[middle], &probe) <= 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static HistoryRun *current_runs(PieceSnapshot *snapshot) {
+  HistoryRun *runs = malloc((snapshot->length + 1) * sizeof(HistoryRun));
+  if (runs == NULL) {
+    return NULL;
+  }
+  size_t row = 0;
+  for (size_t i = 0; i < snapshot->length; i++) {
+    Piece piece = snapshot->pieces[i];
+    size_t key = piece.source == PIECE_ADD ? KEY_ADD : KEY_ORIGINAL;
+    runs[i] = (HistoryRun){key, piece.start, piece.count, row};
+    row += piece.count;
+  }
+  qsort(runs, snapshot->length, sizeof(HistoryRun), compare_runs);
+  return runs;
+}
+
+static bool push_piece(HistoryPieces *out, uint64_t source, size_t start,
+                       size_t count) {
+  UndoFilePiece *pieces = grow(out->pieces, &out->capacity, out->length + 1,
+                               sizeof(UndoFilePiece));
+  if (pieces == NULL) {
+    return false;
+  }
+  out->pieces = pieces;
+  out->pieces[out->length++] = (UndoFilePiece){source, start, count};
+  if (source < UNDO_FILE_TEXT) {
+    return true;
+  }
+
+  HistoryRun *texts = grow(out->texts, &out->texts_capacity,
+                           out->n_texts + 1, sizeof(HistoryRun));
+  if (texts == NULL) {
+    return false;
+  }
+  out->texts = texts;
+  out->texts[out->n_texts++] =
+      (HistoryRun){source - UNDO_FILE_TEXT, start, count, 0};
+  return true;
+}
+
+static bool split_piece(HistoryPieces *out, const HistoryRun *runs,
+                        size_t n_runs, size_t key, Piece piece) {
+  size_t position = piece.start;
+  size_t end = piece.start + piece.count;
+  while (position < end) {
+    size_t next = key == KEY_STORED ? n_runs
+                                    : runs_after(runs, n_runs, key, position);
+    const HistoryRun *run = next > 0 ? &runs[next - 1] : NULL;
+    if (key != KEY_STORED && run != NULL && run->key == key &&
+        position < run->start + run->count) {
+      size_t count = run->start + run->count - position;
+      count = count < end - position ? count : end - position;
+      if (!push_piece(out, UNDO_FILE_ROWS, run->row + position - run->start,
+                      count)) {
+        return false;
+      }
+      position += count;
+      continue;
+    }
+    size_t limit = next < n_runs && runs[next].key == key ? runs[next].start
+                                                          : end;
+    limit = limit < end ? limit : end;
+    if (!push_piece(out, UNDO_FILE_TEXT + key, position, limit - position)) {
+      return false;
+    }
+    position = limit;
+  }
+  return true;
+}
+
+static bool split_pieces(HistoryPieces *out, const HistoryRun *runs,
+                         size_t n_runs, const UndoHistory *history,
+                         const UndoDelta *delta, size_t first, size_t length,
+                         uint64_t *out_first) {
+  *out_first = out->length;
+  for (size_t i = first; i < first + length; i++) {
+    Piece piece = history->pieces[i];
+    size_t key = piece.source == PIECE_ORIGINAL ? KEY_ORIGINAL
+                 : delta->stored                ? KEY_STORED
+                                                : KEY_ADD;
+    if (!split_piece(out, runs, n_runs, key, piece)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static size_t merge_texts(HistoryRun *texts, size_t n_texts) {
+  qsort(texts, n_texts, sizeof(HistoryRun), compare_runs);
+  size_t length = 0;
+  size_t stored = 0;
+  for (size_t i = 0; i < n_texts; i++) {
+    HistoryRun *last = length > 0 ? &texts[length - 1] : NULL;
+    if (last != NULL && last->key == texts[i].key &&
+        texts[i].start <= last->start + last->count) {
+      size_t end = texts[i].start + texts[i].count;
+      if (end > last->start + last->count) {
+        stored += end - (last->start + last->count);
+        last->count = end - last->start;
+      }
+      continue;
+    }
+    texts[length] = texts[i];
+    texts[length++].row = stored;
+    stored += texts[i].count;
+  }
+  return length;
+}
+
+static Line history_line(const UndoHistory *history, PieceSnapshot *snapshot,
+                         size_t key, size_t index) {
+  if (key != KEY_STORED) {
+    return piece_table_snapshot_line(
+        snapshot, key == KEY_ADD ? PIECE_ADD : PIECE_ORIGINAL, index);
+  }
+  UndoFileSections sections;
+  if (!map_sections(history->map, history->map_length, &sections) ||
+      index >= sections.header->n_stored) {
+    return (Line){NULL, 0};
+  }
+  const UndoFileLine *line = &sections.lines[index];
+  if (!valid_range(line->offset, line->length,
+                   sections.header->text_length)) {
+    return (Line){NULL, 0};
+  }
+  return (Line){sections.text + line->offset, line->length};
+}
+
+static bool write_history(FILE *file, const UndoHistory *history,
+                          PieceSnapshot *snapshot, HistoryPieces *out,
+                          UndoFileDelta *deltas, size_t n_texts,
+                          const ContentHash *hash) {
+  UndoFileHeader header = {.content_hash = finish_content_hash(hash),
+                           .size = hash->total,
+                           .n_nodes = history->n_nodes,
+                           .n_deltas = history->n_deltas,
+                           .n_pieces = out->length,
+                           .current = history->current};
+  memcpy(header.magic, UNDO_FILE_MAGIC, sizeof(header.magic));
+  for (size_t i = 0; i < snapshot->length; i++) {
+    header.n_lines += snapshot->pieces[i].count;
+  }
+
+  UndoFileNode *nodes = malloc(history->n_nodes * sizeof(UndoFileNode));
+  if (nodes == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < history->n_nodes; i++) {
+    const UndoNode *node = &history->nodes[i];
+    nodes[i] = (UndoFileNode){
+        .parent = node->parent != NO_NODE ? node->parent : UINT64_MAX,
+        .child = node->child != NO_NODE ? node->child : UINT64_MAX,
+        .first = node->first,
+        .row = node->cursor.row,
+        .column = node->cursor.column,
+        .time = node->time,
+    };
+  }
+
+  const HistoryRun *last = n_texts > 0 ? &out->texts[n_texts - 1] : NULL;
+  header.n_stored = last != NULL ? last->row + last->count : 0;
+  for (size_t i = 0; i < n_texts; i++) {
+    const HistoryRun *text = &out->texts[i];
+    for (size_t j = 0; j < text->count; j++) {
+      header.text_length +=
+          history_line(history, snapshot, text->key, text->start + j).length;
+    }
+  }
+
+  ContentHash check;
+  init_content_hash(&check);
+  update_content_hash(&check, nodes, history->n_nodes * sizeof(UndoFileNode));
+  update_content_hash(&check, deltas,
+                      history->n_deltas * sizeof(UndoFileDelta));
+  update_content_hash(&check, out->pieces,
+                      out->length * sizeof(UndoFilePiece));
+  header.check = finish_content_hash(&check);
+
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(nodes, sizeof(UndoFileNode), history->n_nodes, file);
+  fwrite(deltas, sizeof(UndoFileDelta), history->n_deltas, file);
+  fwrite(out->pieces, sizeof(UndoFilePiece), out->length, file);
+  free(nodes);
+
+  uint64_t offset = 0;
+  for (size_t i = 0; i < n_texts; i++) {
+    const HistoryRun *text = &out->texts[i];
+    for (size_t j = 0; j < text->count; j++) {
+      Line line = history_line(history, snapshot, text->key, text->start + j);
+      UndoFileLine entry = {offset, line.length};
+      fwrite(&entry, sizeof(entry), 1, file);
+      offset += line.length;
+    }
+  }
+  for (size_t i = 0; i < n_texts; i++) {
+    const HistoryRun *text = &out->texts[i];
+    for (size_t j = 0; j < text->count; j++) {
+      Line line = history_line(history, snapshot, text->key, text->start + j);
+      if (line.length > 0) {
+        fwrite(line.data, 1, line.length, file);
+      }
+    }
+  }
+  return fflush(file) == 0 && !ferror(file) && fsync(fileno(file)) == 0;
+}
+
+static bool build_history(const UndoHistory *history, PieceSnapshot *snapshot,
+                          HistoryPieces *out, UndoFileDelta *deltas,
+                          size_t *n_texts) {
+  HistoryRun *runs = current_runs(snapshot);
+  if (runs == NULL) {
+    return false;
+  }
+  bool built = true;
+  for (size_t i = 0; i < history->n_deltas && built; i++) {
+    const UndoDelta *delta = &history->deltas[i];
+    UndoFileDelta *stored = &deltas[i];
+    stored->row = delta->row;
+    stored->count = delta->count;
+    stored->new_first = UINT64_MAX;
+    stored->new_length = 0;
+    built = split_pieces(out, runs, snapshot->length, history, delta,
+                         delta->old_first, delta->old_length,
+                         &stored->old_first);
+    stored->old_length = out->length - stored->old_first;
+    if (built && delta->new_first != NOT_CAPTURED) {
+      built = split_pieces(out, runs, snapshot->length, history, delta,
+                           delta->new_first, delta->new_length,
+                           &stored->new_first);
+      stored->new_length = out->length - stored->new_first;
+    }
+  }
+  free(runs);
+  if (!built) {
+    return false;
+  }
+
+  *n_texts = merge_texts(out->texts, out->n_texts);
+  for (size_t i = 0; i < out->length; i++) {
+    UndoFilePiece *piece = &out->pieces[i];
+    if (piece->source >= UNDO_FILE_TEXT) {
+      size_t key = piece->source - UNDO_FILE_TEXT;
+      const HistoryRun *text =
+          &out->texts[runs_after(out->texts, *n_texts, key, piece->start) - 1];
+      piece->source = UNDO_FILE_TEXT;
+      piece->start = text->row + piece->start - text->start;
+    }
+  }
+  return true;
+}
+
+size_t write_undo_history(UndoHistory *history, PieceSnapshot *snapshot,
+                          const char *target, const ContentHash *hash) {
+  char *path = undo_file_path(target);
+  if (path == NULL) {
+    return 0;
+  }
+  if (history->n_nodes < 2) {
+    unlink(path);
+    free(path);
+    return 0;
+  }
+
+  size_t length = strlen(path) + 8;
+  char *temp_path = malloc(length);
+  HistoryPieces out = {0};
+  UndoFileDelta *deltas =
+      malloc((history->n_deltas + 1) * sizeof(UndoFileDelta));
+  size_t n_texts = 0;
+  bool written = false;
+  if (temp_path != NULL && deltas != NULL &&
+      build_history(history, snapshot, &out, deltas, &n_texts)) {
+    snprintf(temp_path, length, "%s.XXXXXX", path);
+    int fd = mkstemp(temp_path);
+    FILE *file = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (file == NULL && fd != -1) {
+      close(fd);
+    }
+    if (file != NULL) {
+      written = write_history(file, history, snapshot, &out, deltas, n_texts,
+                              hash);
+      written = fclose(file) == 0 && written &&
+                rename(temp_path, path) == 0;
+      if (!written) {
+        unlink(temp_path);
+      }
+    }
+  }
+  free(out.pieces);
+  free(out.texts);
+  free(deltas);
+  free(temp_path);
+  free(path);
+  return written ? history->n_nodes : 0;
+}
@@ -0,0 +1,21 @@
+#ifndef UNDO_FILE_H
+#define UNDO_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "hash.h"
+#include "main.h"
+
+void load_undo_file(Buffer *buffer);
+
+bool resolve_undo_pieces(Buffer *buffer, Piece *pieces, size_t length);
+
+UndoHistory *copy_undo_history(Buffer *buffer);
+
+size_t write_undo_history(UndoHistory *history, PieceSnapshot *snapshot,
+                          const char *target, const ContentHash *hash);
+
+void free_undo_history(UndoHistory *history);
+
+#endif
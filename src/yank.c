@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "buffer.h"
 #include "yank.h"
 
 static void free_yank_buffer(Context *ctx) {
@@ -31,13 +32,13 @@ static void normalize_selection(size_t *start_row, size_t *start_col,
 
 static void copy_line_to_yank(Buffer *buffer, size_t row, char **dest,
                               size_t *dest_len) {
-  if (row < buffer->length) {
-    Line *line = &buffer->lines[row];
-    if (line->length > 0) {
-      *dest = malloc(line->length);
+  if (row < buffer_line_count(buffer)) {
+    Line line = buffer_get_line(buffer, row);
+    if (line.length > 0) {
+      *dest = malloc(line.length);
       if (*dest != NULL) {
-        memcpy(*dest, line->data, line->length);
-        *dest_len = line->length;
+        memcpy(*dest, line.data, line.length);
+        *dest_len = line.length;
       } else {
         *dest_len = 0;
       }
@@ -71,16 +72,16 @@ static void yank_single_line(Context *ctx, Buffer *buffer, size_t row,
   ctx->yank_buffer = malloc(sizeof(char *));
   ctx->yank_buffer_lengths = malloc(sizeof(size_t));
 
-  if (row - 1 < buffer->length) {
-    Line *line = &buffer->lines[row - 1];
+  if (row - 1 < buffer_line_count(buffer)) {
+    Line line = buffer_get_line(buffer, row - 1);
     size_t len = end_col - start_col + 1;
-    if (start_col - 1 < line->length) {
-      if (end_col > line->length) {
-        len = line->length - start_col + 1;
+    if (start_col - 1 < line.length) {
+      if (end_col > line.length) {
+        len = line.length - start_col + 1;
       }
       ctx->yank_buffer[0] = malloc(len);
       if (ctx->yank_buffer[0] != NULL) {
-        memcpy(ctx->yank_buffer[0], line->data + start_col - 1, len);
+        memcpy(ctx->yank_buffer[0], line.data + start_col - 1, len);
         ctx->yank_buffer_lengths[0] = len;
       } else {
         ctx->yank_buffer_lengths[0] = 0;
@@ -104,14 +105,14 @@ static void yank_multiple_lines(Context *ctx, Buffer *buffer, size_t start_row,
 
   for (size_t i = 0; i < ctx->yank_buffer_length; i++) {
     size_t row = start_row + i - 1;
-    if (row < buffer->length) {
-      Line *line = &buffer->lines[row];
+    if (row < buffer_line_count(buffer)) {
+      Line line = buffer_get_line(buffer, row);
       if (i == 0) {
-        size_t len = line->length - start_col + 1;
-        if (start_col - 1 < line->length) {
+        size_t len = line.length - start_col + 1;
+        if (start_col - 1 < line.length) {
           ctx->yank_buffer[i] = malloc(len);
           if (ctx->yank_buffer[i] != NULL) {
-            memcpy(ctx->yank_buffer[i], line->data + start_col - 1, len);
+            memcpy(ctx->yank_buffer[i], line.data + start_col - 1, len);
             ctx->yank_buffer_lengths[i] = len;
           } else {
             ctx->yank_buffer_lengths[i] = 0;
@@ -122,13 +123,13 @@ static void yank_multiple_lines(Context *ctx, Buffer *buffer, size_t start_row,
         }
       } else if (i == ctx->yank_buffer_length - 1) {
         size_t len = end_col;
-        if (end_col > line->length) {
-          len = line->length;
+        if (end_col > line.length) {
+          len = line.length;
         }
         if (len > 0) {
           ctx->yank_buffer[i] = malloc(len);
           if (ctx->yank_buffer[i] != NULL) {
-            memcpy(ctx->yank_buffer[i], line->data, len);
+            memcpy(ctx->yank_buffer[i], line.data, len);
             ctx->yank_buffer_lengths[i] = len;
           } else {
             ctx->yank_buffer_lengths[i] = 0;
@@ -148,31 +149,34 @@ static void yank_multiple_lines(Context *ctx, Buffer *buffer, size_t start_row,
   }
 }
 
+static Line *yank_to_lines(Context *ctx, size_t leading) {
+  Line *lines = malloc((ctx->yank_buffer_length + leading) * sizeof(Line));
+  if (lines == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < leading; i++) {
+    lines[i] = (Line){NULL, 0};
+  }
+  for (size_t i = 0; i < ctx->yank_buffer_length; i++) {
+    lines[leading + i] =
+        (Line){ctx->yank_buffer[i],
+               ctx->yank_buffer[i] != NULL ? ctx->yank_buffer_lengths[i] : 0};
+  }
+  return lines;
+}
+
 static void paste_linewise(Context *ctx, Window *window, Buffer *buffer) {
   size_t insert_row = window->cursor.row;
 
-  buffer->lines = realloc(
-      buffer->lines, sizeof(Line) * (buffer->length + ctx->yank_buffer_length));
-  memmove(&buffer->lines[insert_row + ctx->yank_buffer_length],
-          &buffer->lines[insert_row],
-          sizeof(Line) * (buffer->length - insert_row));
-
-  for (size_t i = 0; i < ctx->yank_buffer_length; i++) {
-    size_t len = ctx->yank_buffer_lengths[i];
-    if (ctx->yank_buffer[i] != NULL && len > 0) {
-      size_t capacity = len < 16 ? 16 : len * 2;
-      buffer->lines[insert_row + i].data = malloc(capacity);
-      memcpy(buffer->lines[insert_row + i].data, ctx->yank_buffer[i], len);
-      buffer->lines[insert_row + i].length = len;
-      buffer->lines[insert_row + i].capacity = capacity;
-    } else {
-      buffer->lines[insert_row + i].data = NULL;
-      buffer->lines[insert_row + i].length = 0;
-      buffer->lines[insert_row + i].capacity = 0;
-    }
+  Line *lines = yank_to_lines(ctx, 1);
+  if (lines == NULL) {
+    return;
   }
+  size_t row = insert_row - 1;
+  buffer_insert(buffer, row, buffer_line_length(buffer, row), lines,
+                ctx->yank_buffer_length + 1);
+  free(lines);
 
-  buffer->length += ctx->yank_buffer_length;
   window->cursor.row = insert_row + 1;
   window->cursor.column = 1;
 }
@@ -183,19 +187,8 @@ static void paste_single_line(Context *ctx, Window *window, Buffer *buffer) {
   size_t yank_len = ctx->yank_buffer_lengths[0];
 
   if (ctx->yank_buffer[0] != NULL && yank_len > 0) {
-    Line *line = &buffer->lines[row];
-    size_t new_length = line->length + yank_len;
-    if (new_length > line->capacity) {
-      size_t new_capacity = line->capacity == 0 ? 16 : line->capacity;
-      while (new_capacity < new_length) {
-        new_capacity *= 2;
-      }
-      line->data = realloc(line->data, new_capacity);
-      line->capacity = new_capacity;
-    }
-    memmove(line->data + col + yank_len, line->data + col, line->length - col);
-    memcpy(line->data + col, ctx->yank_buffer[0], yank_len);
-    line->length = new_length;
+    Line text = {ctx->yank_buffer[0], yank_len};
+    buffer_insert(buffer, row, col, &text, 1);
     window->cursor.column += yank_len;
   }
 }
@@ -203,74 +196,15 @@ static void paste_single_line(Context *ctx, Window *window, Buffer *buffer) {
 static void paste_multiple_lines(Context *ctx, Window *window, Buffer *buffer) {
   size_t row = window->cursor.row - 1;
   size_t col = window->cursor.column - 1;
-  Line *current_line = &buffer->lines[row];
-
-  char *rest_of_line = NULL;
-  size_t rest_len = 0;
-  if (col < current_line->length) {
-    rest_len = current_line->length - col;
-    rest_of_line = malloc(rest_len);
-    if (rest_of_line != NULL) {
-      memcpy(rest_of_line, current_line->data + col, rest_len);
-    }
-    current_line->length = col;
-    if (col > 0) {
-      current_line->data = realloc(current_line->data, col);
-    } else {
-      free(current_line->data);
-      current_line->data = NULL;
-    }
-  }
-
-  buffer->lines = realloc(
-      buffer->lines, sizeof(Line) * (buffer->length + ctx->yank_buffer_length));
-  memmove(&buffer->lines[row + ctx->yank_buffer_length],
-          &buffer->lines[row + 1], sizeof(Line) * (buffer->length - row - 1));
 
-  for (size_t i = 0; i < ctx->yank_buffer_length; i++) {
-    size_t yank_len = ctx->yank_buffer_lengths[i];
-    if (ctx->yank_buffer[i] != NULL && yank_len > 0) {
-      if (i == 0) {
-        Line *line = &buffer->lines[row];
-        size_t new_length = line->length + yank_len;
-        if (new_length > line->capacity) {
-          size_t new_capacity = line->capacity == 0 ? 16 : line->capacity;
-          while (new_capacity < new_length) {
-            new_capacity *= 2;
-          }
-          line->data = realloc(line->data, new_capacity);
-          line->capacity = new_capacity;
-        }
-        memcpy(line->data + line->length, ctx->yank_buffer[i], yank_len);
-        line->length = new_length;
-      } else if (i == ctx->yank_buffer_length - 1) {
-        size_t new_length = yank_len + rest_len;
-        size_t capacity = new_length < 16 ? 16 : new_length * 2;
-        buffer->lines[row + i].data = malloc(capacity);
-        memcpy(buffer->lines[row + i].data, ctx->yank_buffer[i], yank_len);
-        if (rest_of_line != NULL) {
-          memcpy(buffer->lines[row + i].data + yank_len, rest_of_line,
-                 rest_len);
-        }
-        buffer->lines[row + i].length = new_length;
-        buffer->lines[row + i].capacity = capacity;
-      } else {
-        size_t capacity = yank_len < 16 ? 16 : yank_len * 2;
-        buffer->lines[row + i].data = malloc(capacity);
-        memcpy(buffer->lines[row + i].data, ctx->yank_buffer[i], yank_len);
-        buffer->lines[row + i].length = yank_len;
-        buffer->lines[row + i].capacity = capacity;
-      }
-    } else {
-      buffer->lines[row + i].data = NULL;
-      buffer->lines[row + i].length = 0;
-      buffer->lines[row + i].capacity = 0;
-    }
+  Line *lines = yank_to_lines(ctx, 0);
+  if (lines == NULL) {
+    return;
   }
+  buffer_insert(buffer, row, col, lines, ctx->yank_buffer_length);
+  free(lines);
 
-  buffer->length += ctx->yank_buffer_length - 1;
   window->cursor.row += ctx->yank_buffer_length - 1;
-  free(rest_of_line);
 }
 
 void yank_selection(Context *ctx) {